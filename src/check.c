@@ -2,23 +2,79 @@
 #include "env.h"
 #include "ast.h"
 #include "type_table.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <overture/log.h>
+#include <overture/mem.h>
 #include <overture/mem_pool.h>
 #include <overture/mem_stream.h>
 #include <overture/vec.h>
+#include <overture/map.h>
+#include <overture/hash.h>
 #include <overture/span.h>
 
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 
+struct overload_arg {
+    const struct type* type;
+    bool is_mutable;
+};
+
+// The result of overload resolution only depends on the candidates, on the type and mutability of
+// the arguments, and on the expected return type. Successful resolutions are memoized with these as
+// a key, since the same built-in functions and operators are typically called with the same types.
+struct overload_key {
+    struct ast* const* candidates;
+    size_t candidate_count;
+    const struct overload_arg* args;
+    size_t arg_count;
+    const struct type* ret_type;
+};
+
+// Candidate lists are only compared when looking up a key, as hashing the first candidate and the
+// number of candidates is enough to tell apart the overload sets of different functions.
+static inline uint32_t hash_overload_key(uint32_t h, const struct overload_key* key) {
+    h = hash_uint64(h, (uintptr_t)key->candidates[0]);
+    h = hash_uint64(h, key->candidate_count);
+    for (size_t i = 0; i < key->arg_count; ++i) {
+        h = hash_uint64(h, (uintptr_t)key->args[i].type);
+        h = hash_uint8(h, key->args[i].is_mutable);
+    }
+    return hash_uint64(h, (uintptr_t)key->ret_type);
+}
+
+static inline bool are_overload_keys_equal(const struct overload_key* key, const struct overload_key* other_key) {
+    if (key->candidate_count != other_key->candidate_count ||
+        key->arg_count != other_key->arg_count ||
+        key->ret_type != other_key->ret_type)
+        return false;
+    for (size_t i = 0; i < key->arg_count; ++i) {
+        if (key->args[i].type != other_key->args[i].type ||
+            key->args[i].is_mutable != other_key->args[i].is_mutable)
+            return false;
+    }
+    return !memcmp(key->candidates, other_key->candidates, sizeof(struct ast*) * key->candidate_count);
+}
+
+MAP_DEFINE(overload_cache, struct overload_key, struct ast*, hash_overload_key, are_overload_keys_equal, PRIVATE)
+VEC_DEFINE(overload_arg_vec, struct overload_arg, PRIVATE)
+
 struct type_checker {
     struct type_print_options type_print_options;
     struct mem_pool* mem_pool;
     struct type_table* type_table;
     struct env* env;
     struct log* log;
+    struct stats* stats;
+    struct overload_cache overload_cache;
+    struct overload_arg_vec overload_args;
+};
+
+struct builtins {
+    struct env* env;
 };
 
 struct const_eval {
@@ -447,7 +503,7 @@ static bool check_operator_signature(struct type_checker* type_checker, struct a
     return true;
 }
 
-static void check_shader_or_func_decl(struct type_checker* type_checker, struct ast* ast) {
+static void check_shader_or_func_signature_and_body(struct type_checker* type_checker, struct ast* ast) {
     assert(ast->tag == AST_FUNC_DECL || ast->tag == AST_SHADER_DECL);
     env_push_scope(type_checker->env, ast);
 
@@ -492,6 +548,14 @@ static void check_shader_or_func_decl(struct type_checker* type_checker, struct
     insert_func_or_shader_symbol(type_checker, ast);
 }
 
+static void check_shader_or_func_decl(struct type_checker* type_checker, struct ast* ast) {
+    struct trace* trace = stats_trace(type_checker->stats);
+    uint64_t begin_time = trace ? stats_time() : 0;
+    check_shader_or_func_signature_and_body(type_checker, ast);
+    if (trace)
+        trace_add_event(trace, TRACE_TRACK_COMPILER, "check", ast_decl_name(ast), begin_time, stats_time());
+}
+
 static void check_return_stmt(struct type_checker* type_checker, struct ast* ast) {
     struct ast* shader_or_func = env_find_enclosing_shader_or_func(type_checker->env);
     assert(shader_or_func);
@@ -757,6 +821,9 @@ static struct ast* find_func_from_candidates(
         return NULL;
     }
 
+    if (type_checker->stats)
+        type_checker->stats->counters[COUNTER_OVERLOAD_RESOLUTIONS]++;
+
     size_t viable_count = remove_non_viable_candidates(candidates, candidate_count, ret_type, args);
     if (viable_count == 0) {
         report_overload_error(
@@ -774,6 +841,60 @@ static struct ast* find_func_from_candidates(
     return symbol;
 }
 
+static struct ast* find_memoized_func_from_candidates(
+    struct type_checker* type_checker,
+    const struct file_loc* loc,
+    const char* func_name,
+    struct ast** candidates,
+    size_t candidate_count,
+    const struct type* ret_type,
+    struct ast* args)
+{
+    overload_arg_vec_clear(&type_checker->overload_args);
+    for (const struct ast* arg = args; arg; arg = arg->next) {
+        overload_arg_vec_push(&type_checker->overload_args, &(struct overload_arg) {
+            .type = arg->type,
+            .is_mutable = ast_is_mutable(arg)
+        });
+    }
+
+    struct overload_key key = {
+        .candidates = candidates,
+        .candidate_count = candidate_count,
+        .args = type_checker->overload_args.elems,
+        .arg_count = type_checker->overload_args.elem_count,
+        .ret_type = ret_type
+    };
+    struct ast* const* memoized_symbol = overload_cache_find(&type_checker->overload_cache, &key);
+    if (memoized_symbol) {
+        if (type_checker->stats)
+            type_checker->stats->counters[COUNTER_OVERLOADS_MEMOIZED]++;
+        return *memoized_symbol;
+    }
+
+    // The candidates are filtered in place during resolution, so it works on a copy, which keeps the
+    // key intact.
+    struct small_ast_vec filtered_candidates;
+    small_ast_vec_init(&filtered_candidates);
+    for (size_t i = 0; i < candidate_count; ++i)
+        small_ast_vec_push(&filtered_candidates, &candidates[i]);
+    struct ast* symbol = find_func_from_candidates(
+        type_checker, loc, func_name, filtered_candidates.elems, candidate_count, ret_type, args);
+    small_ast_vec_destroy(&filtered_candidates);
+
+    // Only successful resolutions are memoized, so the key is only copied into the pool then.
+    if (symbol) {
+        struct ast** key_candidates = MEM_POOL_ALLOC_ARRAY(*type_checker->mem_pool, candidate_count, struct ast*);
+        struct overload_arg* key_args = MEM_POOL_ALLOC_ARRAY(*type_checker->mem_pool, key.arg_count, struct overload_arg);
+        memcpy(key_candidates, candidates, sizeof(struct ast*) * candidate_count);
+        memcpy(key_args, key.args, sizeof(struct overload_arg) * key.arg_count);
+        key.candidates = key_candidates;
+        key.args = key_args;
+        overload_cache_insert(&type_checker->overload_cache, &key, &symbol);
+    }
+    return symbol;
+}
+
 static struct ast* find_func_or_struct_with_name(
     struct type_checker* type_checker,
     const struct file_loc* loc,
@@ -791,7 +912,7 @@ static struct ast* find_func_or_struct_with_name(
     } else if (symbols.elem_count == 1 && symbols.elems[0]->tag == AST_STRUCT_DECL) {
         symbol = symbols.elems[0];
     } else {
-        symbol = find_func_from_candidates(
+        symbol = find_memoized_func_from_candidates(
             type_checker, loc, func_name, symbols.elems, symbols.elem_count, ret_type, args);
     }
 
@@ -1304,7 +1425,7 @@ static const struct type* check_cast_expr(
     const struct type* expected_type)
 {
     // This can happen for implicit casts inserted during type-checking. If we ever check the same
-    // AST again (e.g. for builtins), then just return the result of the cast.
+    // AST again, then just return the result of the cast.
     if (!ast->cast_expr.type) {
         assert(ast->type);
         assert(!expected_type || ast->type == expected_type);
@@ -1419,20 +1540,85 @@ static void check_top_level_decl(struct type_checker* type_checker, struct ast*
     }
 }
 
-void check(
+static struct env* check_with_base_env(
     struct mem_pool* mem_pool,
     struct type_table* type_table,
+    const struct env* base_env,
     struct ast* ast,
-    struct log* log)
+    struct log* log,
+    struct stats* stats)
 {
     struct type_checker type_checker = {
         .type_print_options.disable_colors = log->disable_colors,
         .mem_pool = mem_pool,
         .type_table = type_table,
-        .env = env_create(),
-        .log = log
+        .env = env_create(base_env),
+        .log = log,
+        .stats = stats,
+        .overload_cache = overload_cache_create(),
+        .overload_args = overload_arg_vec_create()
     };
     for (; ast; ast = ast->next)
         check_top_level_decl(&type_checker, ast);
-    env_destroy(type_checker.env);
+    overload_arg_vec_destroy(&type_checker.overload_args);
+    overload_cache_destroy(&type_checker.overload_cache);
+    return type_checker.env;
+}
+
+struct builtins* check_builtins(
+    struct mem_pool* mem_pool,
+    struct type_table* type_table,
+    struct ast* ast,
+    struct log* log)
+{
+    struct builtins* builtins = xmalloc(sizeof(struct builtins));
+    builtins->env = check_with_base_env(mem_pool, type_table, NULL, ast, log, NULL);
+    env_freeze(builtins->env);
+    return builtins;
+}
+
+static inline void insert_checked_decl(struct env* env, struct ast* ast) {
+    [[maybe_unused]] bool was_inserted = true;
+    switch (ast->tag) {
+        case AST_STRUCT_DECL:
+            was_inserted = env_insert_symbol(env, ast->struct_decl.name, ast, false);
+            break;
+        case AST_SHADER_DECL:
+        case AST_FUNC_DECL:
+            was_inserted = env_insert_symbol(env, ast_decl_name(ast), ast, true);
+            break;
+        case AST_VAR_DECL:
+            for (struct ast* var = ast->var_decl.vars; var; var = var->next)
+                was_inserted &= env_insert_symbol(env, var->var.name, var, false);
+            break;
+        default:
+            break;
+    }
+    assert(was_inserted);
+}
+
+struct builtins* builtins_create(const struct builtins* base, struct ast* ast) {
+    struct builtins* builtins = xmalloc(sizeof(struct builtins));
+    builtins->env = env_create(base ? base->env : NULL);
+    for (; ast; ast = ast->next)
+        insert_checked_decl(builtins->env, ast);
+    env_freeze(builtins->env);
+    return builtins;
+}
+
+void builtins_destroy(struct builtins* builtins) {
+    env_destroy(builtins->env);
+    free(builtins);
+}
+
+void check(
+    struct mem_pool* mem_pool,
+    struct type_table* type_table,
+    const struct builtins* builtins,
+    struct ast* ast,
+    struct log* log,
+    struct stats* stats)
+{
+    const struct env* base_env = builtins ? builtins->env : NULL;
+    env_destroy(check_with_base_env(mem_pool, type_table, base_env, ast, log, stats));
 }
@@ -7,9 +7,27 @@ struct log;
 struct mem_pool;
 struct type_table;
 struct builtins;
+struct stats;
 
-void check(
+// Checks the built-in declarations once, so that their symbols can be shared between all the files
+// that are checked afterwards. The declarations must outlive the returned object.
+[[nodiscard]] struct builtins* check_builtins(
     struct mem_pool* mem_pool,
     struct type_table* type_table,
     struct ast* ast,
     struct log* log);
+// Creates built-ins from declarations that have already been checked (e.g. loaded from an image). The
+// declarations can refer to the ones of the given base built-ins, which can be NULL, and which must
+// outlive the returned object.
+[[nodiscard]] struct builtins* builtins_create(const struct builtins* base, struct ast* ast);
+void builtins_destroy(struct builtins*);
+
+// Checks the given program. Built-ins, when not NULL, must come from the same type table. Statistics
+// are collected in the given object, unless it is NULL.
+void check(
+    struct mem_pool* mem_pool,
+    struct type_table* type_table,
+    const struct builtins* builtins,
+    struct ast* ast,
+    struct log* log,
+    struct stats* stats);
@@ -1,42 +1,66 @@
 #include "env.h"
 
 #include <overture/map.h>
+#include <overture/set.h>
+#include <overture/vec.h>
 #include <overture/hash.h>
 #include <overture/mem.h>
 
 struct symbol {
     struct ast* ast;
     struct symbol* next;
+    struct symbol* shadowed;
+    struct scope* scope;
     bool allow_overload;
 };
 
-static inline uint32_t hash_symbol_name(uint32_t h, const char* const* string_ptr) {
-    return hash_string(h, *string_ptr);
+static inline uint32_t hash_name_address(uint32_t h, const char* const* name) {
+    return hash_uint64(h, (uintptr_t)*name);
+}
+
+static inline bool are_name_addresses_equal(const char* const* name, const char* const* other_name) {
+    return *name == *other_name;
+}
+
+static inline uint32_t hash_name_string(uint32_t h, const char* const* name) {
+    return hash_string(h, *name);
 }
 
-static inline bool are_symbol_names_equal(const char* const* string_ptr, const char* const* other_ptr) {
-    return !strcmp(*string_ptr, *other_ptr);
+static inline bool are_name_strings_equal(const char* const* name, const char* const* other_name) {
+    return !strcmp(*name, *other_name);
 }
 
-MAP_DEFINE(symbol_table, const char*, struct symbol*, hash_symbol_name, are_symbol_names_equal, PRIVATE)
+MAP_DEFINE(binding_map, const char*, struct symbol*, hash_name_address, are_name_addresses_equal, PRIVATE)
+MAP_DEFINE(name_cache, const char*, const char*, hash_name_address, are_name_addresses_equal, PRIVATE)
+SET_DEFINE(name_set, const char*, hash_name_string, are_name_strings_equal, PRIVATE)
+VEC_DEFINE(name_vec, const char*, PRIVATE)
 
 struct scope {
     struct ast* ast;
-    struct symbol_table symbol_table;
+    struct name_vec names;
     struct scope* prev;
     struct scope* next;
 };
 
+// Names come from different places (the AST of the file, built-in images, or string literals in the
+// type checker), so they are first mapped to a canonical address, which is the same for equal names
+// in a chain of environments. Symbols are then found by address, through a map that contains the
+// innermost binding of each name. Bindings that are shadowed by it are linked from it.
 struct env {
     struct scope* scope;
     struct symbol* free_symbols;
+    struct binding_map bindings;
+    struct name_set canonical_names;
+    struct name_cache name_cache;
+    const struct env* base;
+    bool is_frozen;
 };
 
 [[nodiscard]] static inline struct symbol* alloc_symbol(struct env* env) {
     if (env->free_symbols) {
         struct symbol* symbol = env->free_symbols;
         env->free_symbols = symbol->next;
-        symbol->next = NULL;
+        memset(symbol, 0, sizeof(struct symbol));
         return symbol;
     }
     return xcalloc(1, sizeof(struct symbol));
@@ -49,43 +73,54 @@ static inline void free_symbol(struct env* env, struct symbol* symbol) {
 
 [[nodiscard]] static inline struct scope* alloc_scope(struct scope* prev) {
     struct scope* scope = xcalloc(1, sizeof(struct scope));
-    scope->symbol_table = symbol_table_create();
+    scope->names = name_vec_create();
     scope->prev = prev;
     return scope;
 }
 
 static inline void clear_scope(struct env* env, struct scope* scope) {
-    MAP_FOREACH_VAL(struct symbol*, symbol_ptr, scope->symbol_table) {
-        struct symbol* symbol = *symbol_ptr;
+    VEC_FOREACH(const char*, name, scope->names) {
+        struct symbol* symbol = *binding_map_find(&env->bindings, name);
+        assert(symbol->scope == scope);
+        binding_map_remove(&env->bindings, name);
+        if (symbol->shadowed)
+            binding_map_insert(&env->bindings, name, &symbol->shadowed);
         while (symbol) {
             struct symbol* next = symbol->next;
             free_symbol(env, symbol);
             symbol = next;
         }
     }
-    symbol_table_clear(&scope->symbol_table);
+    name_vec_clear(&scope->names);
 }
 
-static inline void free_scope(struct env* env, struct scope* scope) {
-    clear_scope(env, scope);
-    symbol_table_destroy(&scope->symbol_table);
+static inline void free_scope(struct scope* scope) {
+    name_vec_destroy(&scope->names);
     free(scope);
 }
 
-struct env* env_create(void) {
+struct env* env_create(const struct env* base) {
+    assert(!base || (base->is_frozen && !base->scope->prev));
     struct env* env = xmalloc(sizeof(struct env));
     env->scope = alloc_scope(NULL);
     env->free_symbols = NULL;
+    env->bindings = binding_map_create();
+    env->canonical_names = name_set_create();
+    env->name_cache = name_cache_create();
+    env->base = base;
+    env->is_frozen = false;
     return env;
 }
 
 void env_destroy(struct env* env) {
+    for (struct scope* scope = env->scope; scope; scope = scope->prev)
+        clear_scope(env, scope);
     struct scope* scope = env->scope;
     while (scope->prev)
         scope = scope->prev;
     while (scope) {
         struct scope* next = scope->next;
-        free_scope(env, scope);
+        free_scope(scope);
         scope = next;
     }
     struct symbol* symbol = env->free_symbols;
@@ -94,9 +129,17 @@ void env_destroy(struct env* env) {
         free(symbol);
         symbol = next;
     }
+    name_cache_destroy(&env->name_cache);
+    name_set_destroy(&env->canonical_names);
+    binding_map_destroy(&env->bindings);
     free(env);
 }
 
+void env_freeze(struct env* env) {
+    assert(!env->scope->prev);
+    env->is_frozen = true;
+}
+
 struct ast* env_find_enclosing_shader_or_func(struct env* env) {
     for (struct scope* scope = env->scope; scope; scope = scope->prev) {
         if (!scope->ast)
@@ -121,36 +164,81 @@ struct ast* env_find_enclosing_loop(struct env* env) {
     return NULL;
 }
 
-static inline struct symbol* find_first_symbol(struct scope* scope, const char* name) {
-    struct symbol* const* symbol_ptr = symbol_table_find(&scope->symbol_table, &name);
+static inline const char* find_canonical_name(const struct env* env, const char* name) {
+    for (; env; env = env->base) {
+        const char* const* canonical_name = name_set_find(&env->canonical_names, &name);
+        if (canonical_name)
+            return *canonical_name;
+    }
+    return NULL;
+}
+
+static inline const char* canonicalize_name(struct env* env, const char* name) {
+    const char* const* cached_name = name_cache_find(&env->name_cache, &name);
+    if (cached_name)
+        return *cached_name;
+
+    // Frozen environments may be shared between threads, and must therefore not be modified.
+    const char* canonical_name = find_canonical_name(env, name);
+    if (env->is_frozen)
+        return canonical_name ? canonical_name : name;
+
+    if (!canonical_name) {
+        canonical_name = name;
+        name_set_insert(&env->canonical_names, &canonical_name);
+    }
+    name_cache_insert(&env->name_cache, &name, &canonical_name);
+    return canonical_name;
+}
+
+static inline struct symbol* find_innermost_symbol(const struct env* env, const char* name) {
+    struct symbol* const* symbol_ptr = binding_map_find(&env->bindings, &name);
     return symbol_ptr ? *symbol_ptr : NULL;
 }
 
 struct ast* env_find_one_symbol(struct env* env, const char* name) {
-    struct scope* scope = env->scope;
-    while (scope) {
-        struct symbol* symbol = find_first_symbol(scope, name);
-        if (symbol)
-            return symbol->next ? NULL : symbol->ast;
-        scope = scope->prev;
+    name = canonicalize_name(env, name);
+    struct symbol* symbol = find_innermost_symbol(env, name);
+    if (!symbol || !symbol->scope->prev) {
+        // The global scope is made of the symbols of this environment plus the ones of the
+        // base environments, so the symbol is only unique if it is present in only one of them.
+        for (const struct env* base = env->base; base; base = base->base) {
+            struct symbol* base_symbol = find_innermost_symbol(base, name);
+            if (symbol && base_symbol)
+                return NULL;
+            symbol = symbol ? symbol : base_symbol;
+        }
     }
-    return NULL;
+    return symbol && !symbol->next ? symbol->ast : NULL;
+}
+
+static inline void push_all_symbols(struct symbol* symbol, struct small_ast_vec* symbols) {
+    for (; symbol; symbol = symbol->next)
+        small_ast_vec_push(symbols, &symbol->ast);
 }
 
 void env_find_all_symbols(struct env* env, const char* name, struct small_ast_vec* symbols) {
-    struct scope* scope = env->scope;
-    while (scope) {
-        struct symbol* symbol = find_first_symbol(scope, name);
-        while (symbol) {
-            small_ast_vec_push(symbols, &symbol->ast);
-            symbol = symbol->next;
-        }
-        scope = scope->prev;
-    }
+    name = canonicalize_name(env, name);
+    for (struct symbol* symbol = find_innermost_symbol(env, name); symbol; symbol = symbol->shadowed)
+        push_all_symbols(symbol, symbols);
+    for (const struct env* base = env->base; base; base = base->base)
+        push_all_symbols(find_innermost_symbol(base, name), symbols);
 }
 
 bool env_insert_symbol(struct env* env, const char* name, struct ast* ast, bool allow_overload) {
-    struct symbol* first_symbol = find_first_symbol(env->scope, name);
+    assert(!env->is_frozen);
+    name = canonicalize_name(env, name);
+    struct symbol* innermost_symbol = find_innermost_symbol(env, name);
+    struct symbol* first_symbol = innermost_symbol && innermost_symbol->scope == env->scope ? innermost_symbol : NULL;
+    if (!first_symbol && !env->scope->prev) {
+        // Symbols of the base environments cannot be modified, but they still conflict with new
+        // symbols, since they belong to the same global scope.
+        for (const struct env* base = env->base; base; base = base->base) {
+            struct symbol* base_symbol = find_innermost_symbol(base, name);
+            if (base_symbol && (!allow_overload || !base_symbol->allow_overload))
+                return false;
+        }
+    }
     if (first_symbol && (!allow_overload || !first_symbol->allow_overload))
         return false;
     struct symbol* symbol = alloc_symbol(env);
@@ -162,8 +250,13 @@ bool env_insert_symbol(struct env* env, const char* name, struct ast* ast, bool
         first_symbol->next = symbol;
     } else {
         symbol->ast = ast;
-        [[maybe_unused]] bool was_inserted = symbol_table_insert(&env->scope->symbol_table, &name, &symbol);
+        symbol->scope = env->scope;
+        symbol->shadowed = innermost_symbol;
+        if (innermost_symbol)
+            binding_map_remove(&env->bindings, &name);
+        [[maybe_unused]] bool was_inserted = binding_map_insert(&env->bindings, &name, &symbol);
         assert(was_inserted);
+        name_vec_push(&env->scope->names, &name);
     }
     return true;
 }
@@ -6,8 +6,12 @@
 
 struct env;
 
-[[nodiscard]] struct env* env_create(void);
+// Creates an environment whose global scope extends the global scope of the given base environment,
+// which must be frozen. The base environment can be NULL, or have a base environment itself.
+[[nodiscard]] struct env* env_create(const struct env*);
 void env_destroy(struct env*);
+// Makes the global scope of the environment immutable, so that it can be used as a base.
+void env_freeze(struct env*);
 [[nodiscard]] struct ast* env_find_enclosing_shader_or_func(struct env*);
 [[nodiscard]] struct ast* env_find_enclosing_loop(struct env*);
 [[nodiscard]] struct ast* env_find_one_symbol(struct env*, const char*);
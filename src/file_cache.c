@@ -1,10 +1,24 @@
 #include "file_cache.h"
 
 #include <overture/set.h>
+#include <overture/map.h>
+#include <overture/hash.h>
 #include <overture/file.h>
 #include <overture/mem_pool.h>
 #include <overture/str_pool.h>
 
+#include <string.h>
+#include <assert.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TAB_WIDTH 4
+
+VEC_IMPL(cached_file_vec, struct cached_file*, PUBLIC)
+
 static uint32_t hash_cached_file(uint32_t h, struct cached_file* const* cached_file) {
     return hash_uint64(h, (uintptr_t)(*cached_file)->file_name);
 }
@@ -14,60 +28,244 @@ static bool cached_file_is_equal(struct cached_file* const* cached_file, struct
 }
 
 SET_DEFINE(cached_file_set, struct cached_file*, hash_cached_file, cached_file_is_equal, PRIVATE)
-VEC_DEFINE(line_vec, struct str_view, PRIVATE)
 
-static struct str convert_tabs_to_spaces(const char* file_data, size_t file_size) {
+// Both strings are interned in the string pool of the cache.
+struct include_key {
+    const char* directory;
+    const char* file_name;
+};
+
+struct include_resolution {
+    bool does_exist;
+    struct cached_file* cached_file;
+};
+
+static uint32_t hash_include_key(uint32_t h, const struct include_key* include_key) {
+    h = hash_uint64(h, (uintptr_t)include_key->directory);
+    return hash_uint64(h, (uintptr_t)include_key->file_name);
+}
+
+static bool are_include_keys_equal(const struct include_key* include_key, const struct include_key* other_include_key) {
+    return
+        include_key->directory == other_include_key->directory &&
+        include_key->file_name == other_include_key->file_name;
+}
+
+MAP_DEFINE(include_map, struct include_key, struct include_resolution, hash_include_key, are_include_keys_equal, PRIVATE)
+VEC_DEFINE(include_key_vec, struct include_key, PRIVATE)
+
+// File names are interned in the string pool of the cache.
+static uint32_t hash_file_name(uint32_t h, const char* const* file_name) {
+    return hash_uint64(h, (uintptr_t)*file_name);
+}
+
+static bool are_file_names_equal(const char* const* file_name, const char* const* other_file_name) {
+    return *file_name == *other_file_name;
+}
+
+MAP_DEFINE(memory_file_map, const char*, struct cached_file*, hash_file_name, are_file_names_equal, PRIVATE)
+
+static char* convert_tabs_to_spaces(struct str_view line) {
     struct str str = str_create();
-    for (size_t i = 0; i < file_size; ++i) {
-        if (file_data[i] == '\t') {
-            str_append(&str, STR_VIEW("    "));
+    for (size_t i = 0; i < line.length; ++i) {
+        if (line.data[i] == '\t') {
+            for (size_t j = 0; j < TAB_WIDTH; ++j)
+                str_push(&str, ' ');
             continue;
         }
-        str_push(&str, file_data[i]);
+        str_push(&str, line.data[i]);
+    }
+    return str_terminate(&str);
+}
+
+static size_t count_lines(struct str_view file_data) {
+    size_t line_count = 1;
+    const char* end = file_data.data + file_data.length;
+    for (const char* ptr = file_data.data; (ptr = memchr(ptr, '\n', end - ptr)); ++ptr)
+        line_count++;
+    return line_count;
+}
+
+static void extract_lines(struct cached_file* cached_file) {
+    struct str_view file_data = cached_file->file_data;
+    size_t line_count = count_lines(file_data);
+    struct str_view* lines = xmalloc(sizeof(struct str_view) * line_count);
+
+    const char* line_begin = file_data.data;
+    const char* end = file_data.data + file_data.length;
+    for (size_t i = 0; i < line_count; ++i) {
+        const char* line_end = memchr(line_begin, '\n', end - line_begin);
+        if (!line_end)
+            line_end = end;
+        lines[i] = (struct str_view) { .data = line_begin, .length = line_end - line_begin };
+        line_begin = line_end + 1;
     }
-    str_terminate(&str);
-    return str;
+
+    cached_file->lines = lines;
+    cached_file->line_count = line_count;
 }
 
-static struct line_vec extract_lines(const char* file_data, size_t file_size) {
-    struct line_vec line_vec = line_vec_create();
-    line_vec_push(&line_vec, &(struct str_view) { .data = file_data });
+static uint64_t hash_file_data(const char* file_data, size_t file_size) {
+    // FNV-1a
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
     for (size_t i = 0; i < file_size; ++i) {
-        if (file_data[i] == '\n')
-            line_vec_push(&line_vec, &(struct str_view) { .data = &file_data[i + 1] });
-        else
-            line_vec_last(&line_vec)->length++;
+        h ^= (uint8_t)file_data[i];
+        h *= UINT64_C(0x100000001b3);
     }
-    return line_vec;
+    return h;
 }
 
-static struct cached_file* alloc_cached_file(const char* file_name, const char* file_data, size_t file_size) {
-    struct str cached_data = convert_tabs_to_spaces(file_data, file_size);
-    struct line_vec lines = extract_lines(cached_data.data, cached_data.length);
+static bool stat_file(const char* file_name, struct stat* file_stat) {
+    return stat(file_name, file_stat) == 0 && S_ISREG(file_stat->st_mode);
+}
 
-    struct cached_file* cached_file = xcalloc(1, sizeof(struct cached_file));
-    cached_file->file_name = file_name;
-    cached_file->file_data = str_release(&cached_data);
-    cached_file->line_count = lines.elem_count;
-    cached_file->lines = line_vec_release(&lines);
-    return cached_file;
+static char* read_whole_file(int fd, size_t file_size) {
+    char* file_data = xmalloc(file_size + 1);
+    size_t bytes_read = 0;
+    while (bytes_read < file_size) {
+        ssize_t read_count = read(fd, file_data + bytes_read, file_size - bytes_read);
+        if (read_count <= 0) {
+            free(file_data);
+            return NULL;
+        }
+        bytes_read += (size_t)read_count;
+    }
+    file_data[file_size] = 0;
+    return file_data;
 }
 
-static void free_cached_file(struct cached_file* cached_file) {
-    free((char*)cached_file->file_data.data);
+static bool load_cached_file(struct cached_file* cached_file, bool allow_mapping) {
+    int fd = open(cached_file->file_name, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    // The file is stat'ed before being read, so that a modification made while reading it is
+    // detected at the next revalidation.
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    // The lexer expects the data to be followed by a null terminator. The end of the last page of a
+    // mapping is filled with zeros, so this holds unless the file size is a multiple of the page size.
+    // In that case, or if the file cannot be mapped, it is read into memory.
+    size_t file_size = file_stat.st_size;
+    char* file_data = NULL;
+    bool is_mapped = false;
+    if (allow_mapping && file_size > 0 && file_size % (size_t)sysconf(_SC_PAGESIZE) != 0) {
+        file_data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        is_mapped = file_data != MAP_FAILED;
+        if (!is_mapped)
+            file_data = NULL;
+    }
+    if (!file_data)
+        file_data = read_whole_file(fd, file_size);
+    close(fd);
+    if (!file_data)
+        return false;
+
+    cached_file->file_data = (struct str_view) { .data = file_data, .length = file_size };
+    cached_file->is_mapped = is_mapped;
+    cached_file->is_in_memory = false;
+    cached_file->lines = NULL;
+    cached_file->line_count = 0;
+    cached_file->expanded_lines = NULL;
+    cached_file->is_stale = false;
+    cached_file->file_size = file_stat.st_size;
+    cached_file->modification_time = file_stat.st_mtime;
+    cached_file->load_time = time(NULL);
+
+    // Files modified during the second in which they are loaded are compared by content when they are
+    // revalidated. Their hash is taken now, because a mapped file may change under the mapping.
+    cached_file->has_content_hash = file_stat.st_mtime >= cached_file->load_time;
+    if (cached_file->has_content_hash)
+        cached_file->content_hash = hash_file_data(file_data, file_size);
+    return true;
+}
+
+static void load_cached_file_from_buffer(struct cached_file* cached_file, struct str_view contents) {
+    char* file_data = xmalloc(contents.length + 1);
+    memcpy(file_data, contents.data, contents.length);
+    file_data[contents.length] = 0;
+
+    cached_file->file_data = (struct str_view) { .data = file_data, .length = contents.length };
+    cached_file->is_mapped = false;
+    cached_file->is_in_memory = true;
+    cached_file->lines = NULL;
+    cached_file->line_count = 0;
+    cached_file->expanded_lines = NULL;
+    cached_file->is_stale = false;
+    cached_file->file_size = contents.length;
+    cached_file->modification_time = 0;
+    cached_file->load_time = time(NULL);
+    cached_file->has_content_hash = false;
+}
+
+static void unload_cached_file(struct cached_file* cached_file) {
+    if (cached_file->is_mapped)
+        munmap((char*)cached_file->file_data.data, cached_file->file_data.length);
+    else
+        free((char*)cached_file->file_data.data);
+    if (cached_file->expanded_lines) {
+        for (size_t i = 0; i < cached_file->line_count; ++i)
+            free(cached_file->expanded_lines[i]);
+        free(cached_file->expanded_lines);
+    }
     free(cached_file->lines);
-    free(cached_file);
+    cached_file->file_data = (struct str_view) {};
+    cached_file->is_mapped = false;
+    cached_file->lines = NULL;
+    cached_file->expanded_lines = NULL;
+    cached_file->line_count = 0;
+    cached_file->has_pragma_once = false;
+    cached_file->include_guard = (struct str_view) {};
+}
+
+static bool is_cached_file_up_to_date(const struct cached_file* cached_file) {
+    struct stat file_stat;
+    if (!stat_file(cached_file->file_name, &file_stat))
+        return false;
+    if (file_stat.st_size != cached_file->file_size || file_stat.st_mtime != cached_file->modification_time)
+        return false;
+    if (file_stat.st_mtime < cached_file->load_time)
+        return true;
+    assert(cached_file->has_content_hash);
+
+    size_t file_size = 0;
+    char* file_data = read_file(cached_file->file_name, &file_size);
+    if (!file_data)
+        return false;
+    bool is_up_to_date = hash_file_data(file_data, file_size) == cached_file->content_hash;
+    free(file_data);
+    return is_up_to_date;
+}
+
+uint64_t cached_file_content_hash(struct cached_file* cached_file) {
+    if (!cached_file->has_content_hash) {
+        cached_file->content_hash = hash_file_data(cached_file->file_data.data, cached_file->file_data.length);
+        cached_file->has_content_hash = true;
+    }
+    return cached_file->content_hash;
 }
 
 struct file_cache {
     struct cached_file_set cached_files;
+    struct include_map includes;
+    struct include_key_vec missing_includes; // Keys of the includes that were not found.
+    struct memory_file_map memory_files; // Files inserted from a buffer, by given and canonical name.
     struct mem_pool mem_pool;
     struct str_pool* str_pool;
+    struct include_resolver include_resolver;
+    bool disable_mapping;
 };
 
 struct file_cache* file_cache_create(void) {
     struct file_cache* file_cache = xcalloc(1, sizeof(struct file_cache));
     file_cache->cached_files = cached_file_set_create();
+    file_cache->includes = include_map_create();
+    file_cache->missing_includes = include_key_vec_create();
+    file_cache->memory_files = memory_file_map_create();
     file_cache->mem_pool = mem_pool_create();
     file_cache->str_pool = str_pool_create(&file_cache->mem_pool);
     return file_cache;
@@ -75,11 +273,14 @@ struct file_cache* file_cache_create(void) {
 
 void file_cache_destroy(struct file_cache* file_cache) {
     SET_FOREACH(struct cached_file*, cached_file, file_cache->cached_files) {
-        if (*cached_file)
-            free_cached_file(*cached_file);
+        unload_cached_file(*cached_file);
+        free(*cached_file);
     }
 
     cached_file_set_destroy(&file_cache->cached_files);
+    include_map_destroy(&file_cache->includes);
+    include_key_vec_destroy(&file_cache->missing_includes);
+    memory_file_map_destroy(&file_cache->memory_files);
     mem_pool_destroy(&file_cache->mem_pool);
     str_pool_destroy(file_cache->str_pool);
     free(file_cache);
@@ -87,10 +288,22 @@ void file_cache_destroy(struct file_cache* file_cache) {
 
 void file_cache_reset(struct file_cache* file_cache) {
     SET_FOREACH(struct cached_file*, cached_file, file_cache->cached_files) {
-        if (*cached_file) {
-            (*cached_file)->has_pragma_once = false;
-        }
+        (*cached_file)->has_pragma_once = false;
+    }
+}
+
+size_t file_cache_revalidate(struct file_cache* file_cache) {
+    // Files may have been created or removed since includes were resolved.
+    include_map_clear(&file_cache->includes);
+    include_key_vec_clear(&file_cache->missing_includes);
+
+    size_t stale_file_count = 0;
+    SET_FOREACH(struct cached_file*, cached_file, file_cache->cached_files) {
+        if (!(*cached_file)->is_stale && !(*cached_file)->is_in_memory && !is_cached_file_up_to_date(*cached_file))
+            (*cached_file)->is_stale = true;
+        stale_file_count += (*cached_file)->is_stale ? 1 : 0;
     }
+    return stale_file_count;
 }
 
 static const char* canonicalize_file_name(struct file_cache* file_cache, const char* file_name) {
@@ -111,19 +324,173 @@ struct cached_file* file_cache_find(struct file_cache* file_cache, const char* f
     return file_cache_find_internal(file_cache, canonical_file_name);
 }
 
+struct cached_file* file_cache_find_loaded(struct file_cache* file_cache, const char* cached_file_name) {
+    struct cached_file* cached_file = file_cache_find_internal(file_cache, cached_file_name);
+    return cached_file && !cached_file->is_stale ? cached_file : NULL;
+}
+
 struct cached_file* file_cache_read(struct file_cache* file_cache, const char* file_name) {
     const char* canonical_file_name = canonicalize_file_name(file_cache, file_name);
 
     struct cached_file* cached_file = file_cache_find_internal(file_cache, canonical_file_name);
-    if (cached_file)
+    if (cached_file && !cached_file->is_stale)
         return cached_file;
 
-    size_t file_size = 0;
-    char* file_data = read_file(canonical_file_name, &file_size);
-    cached_file = file_data ? alloc_cached_file(canonical_file_name, file_data, file_size) : NULL;
-    free(file_data);
+    // Stale files are reloaded in place, so that pointers to the cached file remain valid.
+    if (cached_file) {
+        unload_cached_file(cached_file);
+        return load_cached_file(cached_file, !file_cache->disable_mapping) ? cached_file : NULL;
+    }
+
+    cached_file = xcalloc(1, sizeof(struct cached_file));
+    cached_file->file_name = canonical_file_name;
+    if (!load_cached_file(cached_file, !file_cache->disable_mapping)) {
+        free(cached_file);
+        return NULL;
+    }
 
     [[maybe_unused]] bool was_inserted = cached_file_set_insert(&file_cache->cached_files, &cached_file);
     assert(was_inserted);
     return cached_file;
 }
+
+static struct cached_file* insert_file(struct file_cache* file_cache, const char* file_name, struct str_view contents) {
+    const char* given_file_name = str_pool_insert(file_cache->str_pool, file_name);
+    const char* canonical_file_name = canonicalize_file_name(file_cache, file_name);
+
+    // Existing files are replaced in place, so that pointers to the cached file remain valid.
+    struct cached_file* cached_file = file_cache_find_internal(file_cache, canonical_file_name);
+    if (cached_file) {
+        unload_cached_file(cached_file);
+    } else {
+        cached_file = xcalloc(1, sizeof(struct cached_file));
+        cached_file->file_name = canonical_file_name;
+        [[maybe_unused]] bool was_inserted = cached_file_set_insert(&file_cache->cached_files, &cached_file);
+        assert(was_inserted);
+    }
+    load_cached_file_from_buffer(cached_file, contents);
+
+    // Includes are looked up by the name under which the file is inserted, to avoid canonicalizing
+    // every candidate path. If the name was already used, it refers to the same, updated file.
+    memory_file_map_insert(&file_cache->memory_files, &given_file_name, &cached_file);
+    memory_file_map_insert(&file_cache->memory_files, &canonical_file_name, &cached_file);
+    return cached_file;
+}
+
+struct cached_file* file_cache_insert(struct file_cache* file_cache, const char* file_name, struct str_view contents) {
+    // Includes that were not found before may now resolve to this file. The ones that were found
+    // remain valid, since files are replaced in place.
+    VEC_FOREACH(struct include_key, include_key, file_cache->missing_includes) {
+        include_map_remove(&file_cache->includes, include_key);
+    }
+    include_key_vec_clear(&file_cache->missing_includes);
+    return insert_file(file_cache, file_name, contents);
+}
+
+void file_cache_set_include_resolver(struct file_cache* file_cache, const struct include_resolver* include_resolver) {
+    file_cache->include_resolver = include_resolver ? *include_resolver : (struct include_resolver) {};
+    include_map_clear(&file_cache->includes);
+    include_key_vec_clear(&file_cache->missing_includes);
+}
+
+void file_cache_disable_mapping(struct file_cache* file_cache) {
+    file_cache->disable_mapping = true;
+}
+
+// Finds a file among the ones inserted from a buffer, or asks the include resolver for it.
+static bool find_in_memory(struct file_cache* file_cache, const char* file_name, struct cached_file** cached_file) {
+    // Names that were never interned cannot be the name of an inserted file.
+    const char* interned_file_name = file_cache->memory_files.elem_count > 0
+        ? str_pool_find(file_cache->str_pool, file_name) : NULL;
+    struct cached_file* const* memory_file = interned_file_name
+        ? memory_file_map_find(&file_cache->memory_files, &interned_file_name) : NULL;
+    if (memory_file) {
+        *cached_file = *memory_file;
+        return true;
+    }
+
+    struct str_view contents;
+    const struct include_resolver* include_resolver = &file_cache->include_resolver;
+    if (!include_resolver->resolve || !include_resolver->resolve(include_resolver->data, file_name, &contents))
+        return false;
+    *cached_file = insert_file(file_cache, file_name, contents);
+    return true;
+}
+
+bool cached_file_read_line(struct cached_file* cached_file, size_t line, struct str_view* contents) {
+    // Lines are extracted the first time they are needed.
+    if (!cached_file->lines)
+        extract_lines(cached_file);
+    if (line == 0 || line > cached_file->line_count)
+        return false;
+
+    // Tabs are only expanded when a line is displayed, and the result is kept for later.
+    struct str_view raw_line = cached_file->lines[line - 1];
+    if (!memchr(raw_line.data, '\t', raw_line.length)) {
+        *contents = raw_line;
+        return true;
+    }
+    if (!cached_file->expanded_lines)
+        cached_file->expanded_lines = xcalloc(cached_file->line_count, sizeof(char*));
+    if (!cached_file->expanded_lines[line - 1])
+        cached_file->expanded_lines[line - 1] = convert_tabs_to_spaces(raw_line);
+    *contents = STR_VIEW(cached_file->expanded_lines[line - 1]);
+    return true;
+}
+
+size_t cached_file_find_line(struct cached_file* cached_file, size_t offset, size_t* line_begin) {
+    if (!cached_file->lines)
+        extract_lines(cached_file);
+    assert(offset <= cached_file->file_data.length);
+
+    // Find the last line that begins at or before the offset.
+    const char* ptr = cached_file->file_data.data + offset;
+    size_t first = 0, last = cached_file->line_count - 1;
+    while (first < last) {
+        size_t middle = first + (last - first + 1) / 2;
+        if (cached_file->lines[middle].data <= ptr)
+            first = middle;
+        else
+            last = middle - 1;
+    }
+    *line_begin = cached_file->lines[first].data - cached_file->file_data.data;
+    return first + 1;
+}
+
+bool file_cache_find_in_directory(
+    struct file_cache* file_cache,
+    struct str_view directory,
+    struct str_view file_name,
+    struct cached_file** cached_file)
+{
+    struct include_key include_key = {
+        .directory = str_pool_insert_view(file_cache->str_pool, directory),
+        .file_name = str_pool_insert_view(file_cache->str_pool, file_name)
+    };
+    const struct include_resolution* include_resolution = include_map_find(&file_cache->includes, &include_key);
+    if (include_resolution) {
+        *cached_file = include_resolution->cached_file;
+        return include_resolution->does_exist;
+    }
+
+    struct str full_path = str_create();
+    str_printf(&full_path, "%.*s/%.*s",
+        (int)directory.length, directory.data,
+        (int)file_name.length, file_name.data);
+    bool does_exist = find_in_memory(file_cache, full_path.data, cached_file);
+    if (!does_exist) {
+        does_exist = file_exists(full_path.data);
+        *cached_file = does_exist ? file_cache_read(file_cache, full_path.data) : NULL;
+    }
+    str_destroy(&full_path);
+
+    // Files that exist but cannot be read are not cached, so that reading them is attempted again.
+    if (!does_exist || *cached_file) {
+        [[maybe_unused]] bool was_inserted = include_map_insert(&file_cache->includes, &include_key,
+            &(struct include_resolution) { .does_exist = does_exist, .cached_file = *cached_file });
+        assert(was_inserted);
+        if (!does_exist)
+            include_key_vec_push(&file_cache->missing_includes, &include_key);
+    }
+    return does_exist;
+}
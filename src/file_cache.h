@@ -2,21 +2,91 @@
 
 #include <overture/str.h>
 #include <overture/log.h>
+#include <overture/vec.h>
 
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
+// Files are mapped in memory when possible (see `file_cache_disable_mapping`), and lexed in place.
+// The data of a file is always followed by a null terminator, and its tabs are left as-is: the lexer
+// counts them as 4 columns, which is consistent with the lines returned by `cached_file_read_line`.
 struct cached_file {
     const char* file_name;
     struct str_view file_data;
-    struct str_view* lines;
+    struct str_view* lines; // Built the first time a line is needed.
+    char** expanded_lines;
     size_t line_count;
+    bool is_mapped;
     bool has_pragma_once;
+    struct str_view include_guard; // Guard macro of the file, if it has one, pointing into its data.
+    bool is_stale;
+    bool is_in_memory; // Set for files inserted from a buffer, which are never reloaded from disk.
+    int64_t file_size;
+    time_t modification_time;
+    time_t load_time;
+    bool has_content_hash;
+    uint64_t content_hash; // Computed on demand, see `cached_file_content_hash`.
 };
 
+VEC_DECL(cached_file_vec, struct cached_file*, PUBLIC)
+
 struct file_cache;
 
+// Provides the contents of included files that are not in the cache, before they are looked up on
+// disk (for instance, from an archive). Returns false if the file does not exist. The contents are
+// copied into the cache, so the resolver is only asked once for each file.
+struct include_resolver {
+    bool (*resolve)(void* data, const char* file_name, struct str_view* contents);
+    void* data;
+};
+
 [[nodiscard]] struct file_cache* file_cache_create(void);
 void file_cache_destroy(struct file_cache*);
 void file_cache_reset(struct file_cache*);
 [[nodiscard]] struct cached_file* file_cache_find(struct file_cache*, const char* file_name);
 struct cached_file* file_cache_read(struct file_cache*, const char* file_name);
+
+// Adds a file to the cache with the given contents, which are copied, replacing the file that has the
+// same name, if any. The file is then found by `file_cache_read` and by includes without touching the
+// disk. Replacing a file invalidates the data of the previous version.
+struct cached_file* file_cache_insert(struct file_cache*, const char* file_name, struct str_view contents);
+
+void file_cache_set_include_resolver(struct file_cache*, const struct include_resolver*);
+
+// Makes the cache read files into memory instead of mapping them. A mapped file that another process
+// truncates or rewrites in place raises SIGBUS when it is accessed, which long-lived processes must
+// avoid. This only applies to files loaded afterwards.
+void file_cache_disable_mapping(struct file_cache*);
+
+// Finds a file using the name under which it is stored in the cache, as found in the source locations
+// of its tokens. This does not resolve the path, and returns NULL for files that are not loaded yet
+// or need to be reloaded.
+[[nodiscard]] struct cached_file* file_cache_find_loaded(struct file_cache*, const char* cached_file_name);
+
+// Looks for a file in the given directory. Returns false if it does not exist, and otherwise returns
+// true and the file, which is NULL if it could not be read. Results are kept, including for files
+// that do not exist, until the cache is revalidated.
+[[nodiscard]] bool file_cache_find_in_directory(
+    struct file_cache*,
+    struct str_view directory,
+    struct str_view file_name,
+    struct cached_file** cached_file);
+
+// Returns the contents of the given line (starting at 1) of a file, with tabs expanded to spaces.
+// The returned contents remain valid until the file is reloaded or the cache is destroyed.
+[[nodiscard]] bool cached_file_read_line(struct cached_file*, size_t line, struct str_view* contents);
+
+// Returns the line (starting at 1) that contains the byte at the given offset of a file, and the
+// offset at which that line begins. The end of the file belongs to the last line.
+[[nodiscard]] size_t cached_file_find_line(struct cached_file*, size_t offset, size_t* line_begin);
+
+// Returns a hash of the contents of a file. It is computed the first time it is needed, so that files
+// that are only compiled once are not read an extra time.
+[[nodiscard]] uint64_t cached_file_content_hash(struct cached_file*);
+
+// Checks whether the files in the cache have changed on disk since they were loaded. Files whose size
+// or modification time differ are reloaded the next time they are read. Files modified during the
+// second in which they were loaded are compared by content, since their modification time is not
+// precise enough to tell. Returns the number of files that were found to be out of date.
+size_t file_cache_revalidate(struct file_cache*);
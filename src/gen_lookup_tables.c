@@ -0,0 +1,78 @@
+#include "lexer.h"
+#include "preprocessor.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Writes the tables used to recognize keywords and directives, indexed by `hash_keyword` and
+// `hash_directive`. Fails if two entries hash to the same slot, since lookups only check one slot.
+
+struct entry {
+    const char* name;
+    const char* value;
+};
+
+static bool write_table(
+    const char* file_name,
+    const char* type_name,
+    const char* table_name,
+    const char* size_name,
+    size_t table_size,
+    const struct entry* entries,
+    size_t entry_count,
+    size_t (*hash)(struct str_view))
+{
+    const struct entry* slots[table_size];
+    memset(slots, 0, sizeof(slots));
+    for (size_t i = 0; i < entry_count; ++i) {
+        size_t index = hash(STR_VIEW(entries[i].name));
+        if (slots[index]) {
+            fprintf(stderr, "'%s' and '%s' share the same slot in '%s'\n",
+                slots[index]->name, entries[i].name, table_name);
+            return false;
+        }
+        slots[index] = &entries[i];
+    }
+
+    FILE* file = fopen(file_name, "w");
+    if (!file) {
+        fprintf(stderr, "cannot open '%s' for writing\n", file_name);
+        return false;
+    }
+    fprintf(file, "// Generated by gen_lookup_tables.c. Do not edit.\n");
+    fprintf(file, "static const struct %s %s[%s] = {\n", type_name, table_name, size_name);
+    for (size_t i = 0; i < table_size; ++i) {
+        if (!slots[i])
+            continue;
+        fprintf(file, "    [%zu] = { { .data = \"%s\", .length = %zu }, %s },\n",
+            i, slots[i]->name, strlen(slots[i]->name), slots[i]->value);
+    }
+    fprintf(file, "};\n");
+    return fclose(file) == 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <keyword table> <directive table>\n", argv[0]);
+        return 1;
+    }
+
+    static const struct entry keywords[] = {
+#define x(tag, str, ...) { str, "TOKEN_" #tag },
+        KEYWORD_LIST(x)
+        KEYWORD_ALIAS_LIST(x)
+#undef x
+    };
+    static const struct entry directives[] = {
+#define x(name, str) { str, "DIRECTIVE_" #name },
+        DIRECTIVE_LIST(x)
+#undef x
+    };
+
+    bool is_ok =
+        write_table(argv[1], "keyword", "keyword_table", "KEYWORD_TABLE_SIZE", KEYWORD_TABLE_SIZE,
+            keywords, sizeof(keywords) / sizeof(keywords[0]), hash_keyword) &&
+        write_table(argv[2], "directive_entry", "directive_table", "DIRECTIVE_TABLE_SIZE", DIRECTIVE_TABLE_SIZE,
+            directives, sizeof(directives) / sizeof(directives[0]), hash_directive);
+    return is_ok ? 0 : 1;
+}
@@ -2,20 +2,26 @@
 
 #include <assert.h>
 #include <ctype.h>
-#include <inttypes.h>
+#include <string.h>
 
-struct lexer lexer_create(const char* file_name, struct str_view file_data) {
+struct keyword {
+    struct str_view name;
+    enum token_tag tag;
+};
+
+#include "keyword_table.inc"
+
+struct lexer lexer_create(uint16_t file_id, struct str_view file_data) {
     return (struct lexer) {
-        .file_name = file_name,
+        .file_id = file_id,
         .file_data = file_data,
         .on_new_line = true,
-        .has_space_before = false,
-        .pos.source_pos = { .row = 1, .col = 1 }
+        .has_space_before = false
     };
 }
 
 static inline char next_char(const struct lexer* lexer, size_t i) {
-    return lexer->file_data.data[lexer->pos.bytes_read + i];
+    return lexer->file_data.data[lexer->bytes_read + i];
 }
 
 static inline char cur_char(const struct lexer* lexer) {
@@ -23,18 +29,12 @@ static inline char cur_char(const struct lexer* lexer) {
 }
 
 static inline bool is_eof(const struct lexer* lexer) {
-    return lexer->pos.bytes_read >= lexer->file_data.length;
+    return lexer->bytes_read >= lexer->file_data.length;
 }
 
 static inline void eat_char(struct lexer* lexer) {
     assert(!is_eof(lexer));
-    if (cur_char(lexer) == '\n') {
-        lexer->pos.source_pos.row++;
-        lexer->pos.source_pos.col = 1;
-    } else {
-        lexer->pos.source_pos.col++;
-    }
-    lexer->pos.bytes_read++;
+    lexer->bytes_read++;
 }
 
 static inline bool accept_char(struct lexer* lexer, char c) {
@@ -55,38 +55,28 @@ static inline void eat_spaces(struct lexer* lexer) {
 
 static inline struct token make_token(
     struct lexer* lexer,
-    const struct lexer_pos* begin_pos,
+    size_t begin,
     enum token_tag tag)
 {
-    struct file_loc loc = {
-        .file_name = lexer->file_name,
-        .begin     = begin_pos->source_pos,
-        .end       = lexer->pos.source_pos
-    };
-
-    struct str_view contents = str_view_substr(
-        lexer->file_data,
-        begin_pos->bytes_read,
-        lexer->pos.bytes_read - begin_pos->bytes_read);
-
     bool on_new_line = lexer->on_new_line;
     lexer->on_new_line = tag == TOKEN_NL;
 
     return (struct token) {
         .tag              = tag,
-        .loc              = loc,
         .on_new_line      = on_new_line,
         .has_space_before = lexer->has_space_before,
-        .contents         = contents
+        .file_id          = lexer->file_id,
+        .offset           = begin,
+        .length           = lexer->bytes_read - begin
     };
 }
 
 static inline struct token make_error_token(
     struct lexer* lexer,
-    const struct lexer_pos* begin_pos,
+    size_t begin,
     enum token_error error)
 {
-    struct token token = make_token(lexer, begin_pos, TOKEN_ERROR);
+    struct token token = make_token(lexer, begin, TOKEN_ERROR);
     token.error = error;
     return token;
 }
@@ -112,13 +102,12 @@ static inline bool accept_exp(struct lexer* lexer, int base) {
 }
 
 static inline struct token parse_literal(struct lexer* lexer) {
-    struct lexer_pos begin_pos = lexer->pos;
+    size_t begin = lexer->bytes_read;
 
     int base = 10;
-    size_t prefix_len = 0;
     if (accept_char(lexer, '0')) {
         if (accept_char(lexer, 'x'))
-            base = 16, prefix_len = 2;
+            base = 16;
     }
 
     while (accept_digit(lexer, base)) ;
@@ -137,53 +126,45 @@ static inline struct token parse_literal(struct lexer* lexer) {
     }
 
     bool is_float = has_exp || has_dot;
-    struct token token = make_token(lexer, &begin_pos, is_float ? TOKEN_FLOAT_LITERAL : TOKEN_INT_LITERAL);
-    if (is_float)
-        token.float_literal = strtod(token.contents.data, NULL);
-    else
-        token.int_literal = strtoumax(token.contents.data + prefix_len, NULL, base);
-    return token;
+    return make_token(lexer, begin, is_float ? TOKEN_FLOAT_LITERAL : TOKEN_INT_LITERAL);
 }
 
+// Empty slots have a length of zero, which never matches an identifier.
 static inline enum token_tag find_keyword(struct str_view ident) {
-#define x(tag, str, ...) if (str_view_is_equal(&ident, &STR_VIEW(str))) return TOKEN_##tag;
-    KEYWORD_LIST(x)
-#undef x
-    if (str_view_is_equal(&ident, &STR_VIEW("and"))) return TOKEN_AND;
-    if (str_view_is_equal(&ident, &STR_VIEW("or")))  return TOKEN_OR;
-    if (str_view_is_equal(&ident, &STR_VIEW("not"))) return TOKEN_NOT;
-    return TOKEN_ERROR;
+    const struct keyword* keyword = &keyword_table[hash_keyword(ident)];
+    return keyword->name.length == ident.length && !memcmp(keyword->name.data, ident.data, ident.length)
+        ? keyword->tag : TOKEN_ERROR;
 }
 
 struct token lexer_advance(struct lexer* lexer) {
     while (true) {
         eat_spaces(lexer);
 
-        struct lexer_pos begin_pos = lexer->pos;
+        size_t begin = lexer->bytes_read;
         if (is_eof(lexer))
-            return make_token(lexer, &begin_pos, TOKEN_EOF);
-
-        if (accept_char(lexer, '\n')) return make_token(lexer, &begin_pos, TOKEN_NL);
-        if (accept_char(lexer, '(' )) return make_token(lexer, &begin_pos, TOKEN_LPAREN);
-        if (accept_char(lexer, ')' )) return make_token(lexer, &begin_pos, TOKEN_RPAREN);
-        if (accept_char(lexer, '{' )) return make_token(lexer, &begin_pos, TOKEN_LBRACE);
-        if (accept_char(lexer, '}' )) return make_token(lexer, &begin_pos, TOKEN_RBRACE);
-        if (accept_char(lexer, ';' )) return make_token(lexer, &begin_pos, TOKEN_SEMICOLON);
-        if (accept_char(lexer, ',' )) return make_token(lexer, &begin_pos, TOKEN_COMMA);
-        if (accept_char(lexer, '~' )) return make_token(lexer, &begin_pos, TOKEN_TILDE);
-        if (accept_char(lexer, '?' )) return make_token(lexer, &begin_pos, TOKEN_QUESTION);
-        if (accept_char(lexer, ':' )) return make_token(lexer, &begin_pos, TOKEN_COLON);
+            return make_token(lexer, begin, TOKEN_EOF);
+
+        if (accept_char(lexer, '\n')) return make_token(lexer, begin, TOKEN_NL);
+        if (accept_char(lexer, '(' )) return make_token(lexer, begin, TOKEN_LPAREN);
+        if (accept_char(lexer, ')' )) return make_token(lexer, begin, TOKEN_RPAREN);
+        if (accept_char(lexer, '{' )) return make_token(lexer, begin, TOKEN_LBRACE);
+        if (accept_char(lexer, '}' )) return make_token(lexer, begin, TOKEN_RBRACE);
+        if (accept_char(lexer, ';' )) return make_token(lexer, begin, TOKEN_SEMICOLON);
+        if (accept_char(lexer, ',' )) return make_token(lexer, begin, TOKEN_COMMA);
+        if (accept_char(lexer, '~' )) return make_token(lexer, begin, TOKEN_TILDE);
+        if (accept_char(lexer, '?' )) return make_token(lexer, begin, TOKEN_QUESTION);
+        if (accept_char(lexer, ':' )) return make_token(lexer, begin, TOKEN_COLON);
 
         if (accept_char(lexer, '\\')) {
             if (accept_char(lexer, '\n'))
                 continue;
-            return make_token(lexer, &begin_pos, TOKEN_BACKSLASH);
+            return make_token(lexer, begin, TOKEN_BACKSLASH);
         }
 
         if (accept_char(lexer, '#' )) {
             if (accept_char(lexer, '#'))
-                return make_token(lexer, &begin_pos, TOKEN_CONCAT);
-            return make_token(lexer, &begin_pos, TOKEN_HASH);
+                return make_token(lexer, begin, TOKEN_CONCAT);
+            return make_token(lexer, begin, TOKEN_HASH);
         }
 
         if (accept_char(lexer, '.')) {
@@ -192,77 +173,77 @@ struct token lexer_advance(struct lexer* lexer) {
             if (cur_char(lexer) == '.' && next_char(lexer, 1) == '.') {
                 eat_char(lexer);
                 eat_char(lexer);
-                return make_token(lexer, &begin_pos, TOKEN_ELLIPSIS);
+                return make_token(lexer, begin, TOKEN_ELLIPSIS);
             }
-            return make_token(lexer, &begin_pos, TOKEN_DOT);
+            return make_token(lexer, begin, TOKEN_DOT);
         }
 
         if (accept_char(lexer, '[')) {
             if (accept_char(lexer, '['))
-                return make_token(lexer, &begin_pos, TOKEN_LMETA);
-            return make_token(lexer, &begin_pos, TOKEN_LBRACKET);
+                return make_token(lexer, begin, TOKEN_LMETA);
+            return make_token(lexer, begin, TOKEN_LBRACKET);
         }
 
         if (accept_char(lexer, ']')) {
             if (accept_char(lexer, ']'))
-                return make_token(lexer, &begin_pos, TOKEN_RMETA);
-            return make_token(lexer, &begin_pos, TOKEN_RBRACKET);
+                return make_token(lexer, begin, TOKEN_RMETA);
+            return make_token(lexer, begin, TOKEN_RBRACKET);
         }
 
         if (accept_char(lexer, '!')) {
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_CMP_NE);
-            return make_token(lexer, &begin_pos, TOKEN_NOT);
+                return make_token(lexer, begin, TOKEN_CMP_NE);
+            return make_token(lexer, begin, TOKEN_NOT);
         }
 
         if (accept_char(lexer, '=')) {
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_CMP_EQ);
-            return make_token(lexer, &begin_pos, TOKEN_EQ);
+                return make_token(lexer, begin, TOKEN_CMP_EQ);
+            return make_token(lexer, begin, TOKEN_EQ);
         }
 
         if (accept_char(lexer, '>')) {
             if (accept_char(lexer, '>')) {
                 if (accept_char(lexer, '='))
-                    return make_token(lexer, &begin_pos, TOKEN_RSHIFT_EQ);
-                return make_token(lexer, &begin_pos, TOKEN_RSHIFT);
+                    return make_token(lexer, begin, TOKEN_RSHIFT_EQ);
+                return make_token(lexer, begin, TOKEN_RSHIFT);
             }
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_CMP_GE);
-            return make_token(lexer, &begin_pos, TOKEN_CMP_GT);
+                return make_token(lexer, begin, TOKEN_CMP_GE);
+            return make_token(lexer, begin, TOKEN_CMP_GT);
         }
 
         if (accept_char(lexer, '<')) {
             if (accept_char(lexer, '<')) {
                 if (accept_char(lexer, '='))
-                    return make_token(lexer, &begin_pos, TOKEN_LSHIFT_EQ);
-                return make_token(lexer, &begin_pos, TOKEN_LSHIFT);
+                    return make_token(lexer, begin, TOKEN_LSHIFT_EQ);
+                return make_token(lexer, begin, TOKEN_LSHIFT);
             }
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_CMP_LE);
-            return make_token(lexer, &begin_pos, TOKEN_CMP_LT);
+                return make_token(lexer, begin, TOKEN_CMP_LE);
+            return make_token(lexer, begin, TOKEN_CMP_LT);
         }
 
         if (accept_char(lexer, '+')) {
             if (accept_char(lexer, '+'))
-                return make_token(lexer, &begin_pos, TOKEN_INC);
+                return make_token(lexer, begin, TOKEN_INC);
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_ADD_EQ);
-            return make_token(lexer, &begin_pos, TOKEN_ADD);
+                return make_token(lexer, begin, TOKEN_ADD_EQ);
+            return make_token(lexer, begin, TOKEN_ADD);
         }
 
         if (accept_char(lexer, '-')) {
             if (accept_char(lexer, '-'))
-                return make_token(lexer, &begin_pos, TOKEN_DEC);
+                return make_token(lexer, begin, TOKEN_DEC);
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_SUB_EQ);
-            return make_token(lexer, &begin_pos, TOKEN_SUB);
+                return make_token(lexer, begin, TOKEN_SUB_EQ);
+            return make_token(lexer, begin, TOKEN_SUB);
         }
 
         if (accept_char(lexer, '*')) {
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_MUL_EQ);
-            return make_token(lexer, &begin_pos, TOKEN_MUL);
+                return make_token(lexer, begin, TOKEN_MUL_EQ);
+            return make_token(lexer, begin, TOKEN_MUL);
         }
 
         if (accept_char(lexer, '/')) {
@@ -274,7 +255,7 @@ struct token lexer_advance(struct lexer* lexer) {
             if (accept_char(lexer, '*')) {
                 while (true) {
                     if (is_eof(lexer))
-                        return make_error_token(lexer, &begin_pos, TOKEN_ERROR_UNTERMINATED_COMMENT);
+                        return make_error_token(lexer, begin, TOKEN_ERROR_UNTERMINATED_COMMENT);
                     if (accept_char(lexer, '*')) {
                         if (accept_char(lexer, '/'))
                             break;
@@ -285,36 +266,36 @@ struct token lexer_advance(struct lexer* lexer) {
                 continue;
             }
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_DIV_EQ);
-            return make_token(lexer, &begin_pos, TOKEN_DIV);
+                return make_token(lexer, begin, TOKEN_DIV_EQ);
+            return make_token(lexer, begin, TOKEN_DIV);
         }
 
         if (accept_char(lexer, '%')) {
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_REM_EQ);
-            return make_token(lexer, &begin_pos, TOKEN_REM);
+                return make_token(lexer, begin, TOKEN_REM_EQ);
+            return make_token(lexer, begin, TOKEN_REM);
         }
 
         if (accept_char(lexer, '&')) {
             if (accept_char(lexer, '&'))
-                return make_token(lexer, &begin_pos, TOKEN_LOGIC_AND);
+                return make_token(lexer, begin, TOKEN_LOGIC_AND);
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_AND_EQ);
-            return make_token(lexer, &begin_pos, TOKEN_AND);
+                return make_token(lexer, begin, TOKEN_AND_EQ);
+            return make_token(lexer, begin, TOKEN_AND);
         }
 
         if (accept_char(lexer, '|')) {
             if (accept_char(lexer, '|'))
-                return make_token(lexer, &begin_pos, TOKEN_LOGIC_OR);
+                return make_token(lexer, begin, TOKEN_LOGIC_OR);
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_OR_EQ);
-            return make_token(lexer, &begin_pos, TOKEN_OR);
+                return make_token(lexer, begin, TOKEN_OR_EQ);
+            return make_token(lexer, begin, TOKEN_OR);
         }
 
         if (accept_char(lexer, '^')) {
             if (accept_char(lexer, '='))
-                return make_token(lexer, &begin_pos, TOKEN_XOR_EQ);
-            return make_token(lexer, &begin_pos, TOKEN_XOR);
+                return make_token(lexer, begin, TOKEN_XOR_EQ);
+            return make_token(lexer, begin, TOKEN_XOR);
         }
 
         if (isdigit(cur_char(lexer)))
@@ -324,27 +305,68 @@ struct token lexer_advance(struct lexer* lexer) {
             bool escape_active = false;
             while (!is_eof(lexer) && cur_char(lexer) != '\n') {
                 if (!escape_active && accept_char(lexer, '"')) {
-                    struct token token = make_token(lexer, &begin_pos, TOKEN_STRING_LITERAL);
-                    token.string_literal = str_view_shrink(token.contents, 1, 1);
-                    return token;
+                    return make_token(lexer, begin, TOKEN_STRING_LITERAL);
                 }
                 escape_active = cur_char(lexer) == '\\';
                 eat_char(lexer);
             }
-            return make_error_token(lexer, &begin_pos, TOKEN_ERROR_UNTERMINATED_STRING);
+            return make_error_token(lexer, begin, TOKEN_ERROR_UNTERMINATED_STRING);
         }
 
         if (isalpha(cur_char(lexer)) || cur_char(lexer) == '_') {
             while (!is_eof(lexer) && (isalnum(cur_char(lexer)) || cur_char(lexer) == '_'))
                 eat_char(lexer);
-            struct token token = make_token(lexer, &begin_pos, TOKEN_IDENT);
-            enum token_tag keyword_tag = find_keyword(token.contents);
+            struct token token = make_token(lexer, begin, TOKEN_IDENT);
+            enum token_tag keyword_tag = find_keyword(str_view_substr(lexer->file_data, begin, token.length));
             if (keyword_tag != TOKEN_ERROR)
                 token.tag = keyword_tag;
             return token;
         }
 
         eat_char(lexer);
-        return make_error_token(lexer, &begin_pos, TOKEN_ERROR_INVALID);
+        return make_error_token(lexer, begin, TOKEN_ERROR_INVALID);
+    }
+}
+
+static inline bool is_inactive_line(const char* begin, const char* end) {
+    while (begin < end && isspace(*begin))
+        begin++;
+    if (begin < end && *begin == '#')
+        return false;
+    for (; begin < end; ++begin) {
+        if (*begin == '"' || *begin == '/' || *begin == '\\')
+            return false;
+    }
+    return true;
+}
+
+size_t lexer_skip_inactive_lines(struct lexer* lexer) {
+    assert(lexer->on_new_line);
+    const char* data = lexer->file_data.data;
+    size_t bytes_read = lexer->bytes_read;
+    size_t line_count = 0;
+    while (bytes_read < lexer->file_data.length) {
+        const char* line_end = memchr(data + bytes_read, '\n', lexer->file_data.length - bytes_read);
+        if (!line_end || !is_inactive_line(data + bytes_read, line_end))
+            break;
+        bytes_read = line_end - data + 1;
+        line_count++;
+    }
+    lexer->bytes_read = bytes_read;
+    return line_count;
+}
+
+struct source_pos lexer_advance_source_pos(struct source_pos source_pos, struct str_view text) {
+    for (size_t i = 0; i < text.length; ++i) {
+        if (text.data[i] == '\n') {
+            source_pos.row++;
+            source_pos.col = 1;
+        } else if (text.data[i] == '\t') {
+            // Tabs are displayed as 4 spaces in diagnostics.
+            source_pos.col += 4;
+        } else {
+            source_pos.col++;
+        }
     }
+    return source_pos;
 }
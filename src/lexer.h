@@ -5,18 +5,43 @@
 
 #include "token.h"
 
-struct lexer_pos {
-    struct source_pos source_pos;
-    size_t bytes_read;
-};
+#include <stddef.h>
+#include <stdint.h>
+
+// Alternative spellings of operators, which are recognized like keywords.
+#define KEYWORD_ALIAS_LIST(x) \
+    x(AND, "and") \
+    x(OR,  "or") \
+    x(NOT, "not")
+
+// Keywords are found in a table indexed by this hash, which gives every keyword its own slot. The
+// table is generated at build time by `gen_lookup_tables.c`, which fails if two keywords collide.
+#define KEYWORD_TABLE_SIZE 128
+
+static inline size_t hash_keyword(struct str_view ident) {
+    size_t first_char = (unsigned char)ident.data[0];
+    size_t last_char  = (unsigned char)ident.data[ident.length - 1];
+    return (ident.length + first_char * 4 + last_char * 37) % KEYWORD_TABLE_SIZE;
+}
 
 struct lexer {
-    const char* file_name;
+    uint16_t file_id;
     struct str_view file_data;
-    struct lexer_pos pos;
+    size_t bytes_read;
     bool on_new_line;
     bool has_space_before;
 };
 
-[[nodiscard]] struct lexer lexer_create(const char* file_name, struct str_view file_data);
+// Tokens are created with the given file identifier, and their offset in the given data (see
+// `struct token`). The data must be followed by a null terminator.
+[[nodiscard]] struct lexer lexer_create(uint16_t file_id, struct str_view file_data);
 struct token lexer_advance(struct lexer*);
+
+// Skips the lines that follow the current position, which must be at the start of a line, as long as
+// they cannot contain a directive, a multi-line comment, or a line continuation. This is used to go
+// over inactive blocks without lexing them. Returns the number of lines that were skipped.
+size_t lexer_skip_inactive_lines(struct lexer*);
+
+// Returns the position reached by going over the given text from the given position. Tabs count as 4
+// columns, which is consistent with the lines returned by `cached_file_read_line`.
+[[nodiscard]] struct source_pos lexer_advance_source_pos(struct source_pos, struct str_view text);
@@ -1,48 +1,82 @@
-#include "parse.h"
-#include "check.h"
-#include "type_table.h"
+#include "session.h"
 #include "file_cache.h"
-#include "preprocessor.h"
-#include "lexer.h"
+#include "serialize.h"
+#include "thread_pool.h"
+#include "server.h"
+#include "stats.h"
+#include "trace.h"
 #include "ast.h"
 
 #include <overture/cli.h>
-#include <overture/mem_pool.h>
+#include <overture/mem.h>
 #include <overture/log.h>
 #include <overture/term.h>
 #include <overture/vec.h>
 #include <overture/str.h>
-#include <overture/file.h>
+#include <overture/mem_stream.h>
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
-struct user_macro {
-    const char* name;
-    const char* expansion;
-};
+#include <unistd.h>
 
-VEC_DEFINE(user_macro_vec, struct user_macro, PRIVATE)
+VEC_DEFINE(user_macro_vec, struct session_macro, PRIVATE)
 VEC_DEFINE(raw_str_vec, char*, PRIVATE)
 
 struct options {
     bool print_ast;
     bool disable_colors;
+    bool disable_log_colors;
+    bool disable_output_colors;
     bool disable_builtins;
     bool warns_as_errors;
+    bool time_report;
+    bool print_deps;
+    bool write_deps;
+    const char* time_report_json_file;
+    const char* trace_file;
+    const char* builtins_image_file;
+    const char* pch_output_file;
+    const char* pch_file;
+    const char* deps_file;
+    const char* deps_target;
+    const char* server_socket;
+    const char* connect_socket;
     struct raw_str_vec include_dirs;
     struct user_macro_vec user_macros;
     uint32_t max_warns;
     uint32_t max_errors;
+    uint32_t thread_count;
+};
+
+struct compile_job {
+    const char* file_name;
+    bool status;
+    char* diagnostics;
+    char* output;
+};
+
+typedef void (*compile_job_callback)(void* data, const struct compile_job*);
+
+struct parallel_compile {
+    const struct options* options;
+    struct compile_job* jobs;
+    struct session** sessions;
+    struct stats* file_stats;
+};
+
+// State kept by the compile server between requests. Sessions are created once, and the number of
+// threads used to compile files is set when the server is started.
+struct compile_server {
+    struct session** sessions;
+    uint32_t thread_count;
 };
 
 #ifdef ENABLE_BUILTINS
-#define BUILTINS_LINE_COUNT 512
-static const char* builtins_name = "builtins.osl";
-static const char builtins_data[] = {
-#embed "builtins.osl.preprocessed"
-    , 0
+static const uint8_t builtins_image[] = {
+#embed "builtins.osl.image"
 };
 #endif
 
@@ -53,6 +87,7 @@ static struct options options_create() {
         .disable_builtins = false,
         .max_errors = UINT32_MAX,
         .max_warns = UINT32_MAX,
+        .thread_count = 1,
         .include_dirs = raw_str_vec_create(),
         .user_macros = user_macro_vec_create()
     };
@@ -74,7 +109,20 @@ static enum cli_state usage(void*, char*) {
         "      --max-warns <n>             Sets the maximum number of warning messages to display.\n"
         "      --no-builtins               Do not automatically include built-in functions and operators.\n"
         "      --print-ast                 Prints the AST on the standard output.\n"
-        "  -I  --include-dir <directory>   Adds the given directory to the list of include directories.\n");
+        "      --time-report               Prints the time spent in each phase and other statistics.\n"
+        "      --time-report-json <file>   Writes the time report to the given file, in JSON format.\n"
+        "      --trace-out <file>          Writes a trace of the compilation, in the Chrome trace event format.\n"
+        "      --emit-builtins <file>      Writes the checked declarations to a built-ins image.\n"
+        "      --emit-pch <file>           Writes the macros and checked declarations to a precompiled header.\n"
+        "      --include-pch <file>        Includes the given precompiled header at the beginning of each file.\n"
+        "  -I  --include-dir <directory>   Adds the given directory to the list of include directories.\n"
+        "  -M  --print-deps                Prints the files included by each input file as a Makefile rule.\n"
+        "  -MD --write-deps                Writes that rule next to the emitted file, or to '<input>.d' in the cwd.\n"
+        "  -MF --deps-file <file>          Writes that rule to the given file instead (requires a single input file).\n"
+        "  -MT --deps-target <target>      Sets the target of that rule (defaults to the emitted file, or '<input>.oso').\n"
+        "  -j  --jobs <n>                  Compiles files on the given number of threads (0 uses all cores).\n"
+        "      --server <socket>           Runs a compile server listening on the given socket.\n"
+        "      --connect <socket>          Sends the other arguments to the compile server listening on the given socket.\n");
     return CLI_STATE_ERROR;
 }
 
@@ -97,122 +145,176 @@ static struct cli_option cli_option_multi_strings(
     };
 }
 
-static void register_standard_macros(struct preprocessor* preprocessor) {
-    preprocessor_register_macro(preprocessor, "M_PI",       "3.1415926535897932");
-    preprocessor_register_macro(preprocessor, "M_PI_2",     "1.5707963267948966");
-    preprocessor_register_macro(preprocessor, "M_PI_4",     "0.7853981633974483");
-    preprocessor_register_macro(preprocessor, "M_2_PI",     "0.6366197723675813");
-    preprocessor_register_macro(preprocessor, "M_2PI",      "6.2831853071795865");
-    preprocessor_register_macro(preprocessor, "M_4PI",      "12.566370614359173");
-    preprocessor_register_macro(preprocessor, "M_2_SQRTPI", "1.1283791670955126");
-    preprocessor_register_macro(preprocessor, "M_E",        "2.7182818284590452");
-    preprocessor_register_macro(preprocessor, "M_LN2",      "0.6931471805599453");
-    preprocessor_register_macro(preprocessor, "M_LN10",     "2.3025850929940457");
-    preprocessor_register_macro(preprocessor, "M_LOG2E",    "1.4426950408889634");
-    preprocessor_register_macro(preprocessor, "M_LOG10E",   "0.4342944819032518");
-    preprocessor_register_macro(preprocessor, "M_SQRT2",    "1.4142135623730950");
-    preprocessor_register_macro(preprocessor, "M_SQRT1_2",  "0.7071067811865475");
-
-#define STR(x) #x
-#define STRINGIFY(x) STR(x)
-
-    preprocessor_register_macro(preprocessor, "NOSL_VERSION_MAJOR", STRINGIFY(NOSL_VERSION_MINOR));
-    preprocessor_register_macro(preprocessor, "NOSL_VERSION_MINOR", STRINGIFY(NOSL_VERSION_MINOR));
-    preprocessor_register_macro(preprocessor, "NOSL_VERSION_PATCH", STRINGIFY(NOSL_VERSION_PATCH));
-
-#undef STRINGIFY
-#undef STR
-
-    struct str full_version = str_create();
-    str_printf(&full_version, "%d", 10000 * NOSL_VERSION_MAJOR + 100 * NOSL_VERSION_MINOR + NOSL_VERSION_PATCH);
-    preprocessor_register_macro(preprocessor, "NOSL_VERSION", str_terminate(&full_version));
-    str_destroy(&full_version);
-}
-
-static void register_user_macros(struct preprocessor* preprocessor, const struct options* options) {
-    VEC_FOREACH(struct user_macro, user_macro, options->user_macros) {
-        preprocessor_register_macro(preprocessor, user_macro->name, user_macro->expansion);
-    }
+static inline enum cli_state cli_set_string(void* data, char* arg) {
+    *(const char**)data = arg;
+    return CLI_STATE_ACCEPTED;
 }
 
-static struct file_line read_line(void* data, const char* file_name, uint32_t line) {
-    struct file_cache* file_cache = data;
-    const struct cached_file* cached_file = file_cache_read(file_cache, file_name);
-    if (!cached_file)
-        return (struct file_line) {};
-    if (line == 0 || line > cached_file->line_count)
-        return (struct file_line) {};
-    return (struct file_line) {
-        .is_valid = true,
-        .contents = cached_file->lines[line - 1]
+static struct cli_option cli_option_single_string(
+    const char* short_name,
+    const char* long_name,
+    const char** string)
+{
+    return (struct cli_option) {
+        .short_name = short_name,
+        .long_name = long_name,
+        .data = (void*)string,
+        .parse = cli_set_string,
+        .has_value = true
     };
 }
 
-static bool compile_file(
-    const char* file_name,
-    struct ast* builtins,
-    struct file_cache* file_cache,
-    struct type_table* type_table,
-    const struct options* options)
-{
-    struct line_reader line_reader = {
-        .read_line = read_line,
-        .data = file_cache
-    };
+static void write_builtins_image(const char* file_name, const struct ast* ast, struct log* log) {
+    FILE* file = fopen(file_name, "wb");
+    if (!file) {
+        log_error(log, NULL, "cannot open '%s' for writing", file_name);
+        return;
+    }
+    if (!serialize_ast(file, ast))
+        log_error(log, NULL, "cannot write built-ins image to '%s'", file_name);
+    fclose(file);
+}
 
-    struct log log = {
-        .file = stderr,
-        .disable_colors = options->disable_colors || !is_term(stderr),
-        .warns_as_errors = options->warns_as_errors,
-        .max_warns = options->max_warns,
-        .max_errors = options->max_errors,
-        .line_reader = &line_reader
-    };
+static bool needs_deps(const struct options* options) {
+    return options->print_deps || options->write_deps || options->deps_file;
+}
 
-    if (!is_file(file_name) || !file_exists(file_name)) {
-        log_error(&log, NULL, "cannot open '%s'\n", file_name);
-        return false;
+// Escapes the characters that have a special meaning in Makefile rules, like GCC does.
+static void print_dep_name(FILE* file, const char* name) {
+    for (; *name; ++name) {
+        if (*name == ' ' || *name == '#')
+            fputc('\\', file);
+        else if (*name == '$')
+            fputc('$', file);
+        fputc(*name, file);
     }
+}
 
-    struct preprocessor* preprocessor = preprocessor_open(
-        &log, file_cache, file_name, (const char* const*)options->include_dirs.elems);
-    assert(preprocessor);
+// Replaces the extension of a file name. The directory is removed unless `keep_dir` is set, which
+// places the file in the current directory, like GCC does when there is no output file.
+static char* replace_extension(const char* file_name, const char* extension, bool keep_dir) {
+    if (!keep_dir) {
+        const char* base_name = strrchr(file_name, '/');
+        file_name = base_name ? base_name + 1 : file_name;
+    }
+    const char* old_extension = strrchr(file_name, '.');
+    if (!old_extension || strchr(old_extension, '/'))
+        old_extension = file_name + strlen(file_name);
 
-    register_standard_macros(preprocessor);
-    register_user_macros(preprocessor, options);
+    struct str new_file_name = str_create();
+    str_printf(&new_file_name, "%.*s%s", (int)(old_extension - file_name), file_name, extension);
+    return str_terminate(&new_file_name);
+}
 
-    struct mem_pool mem_pool = mem_pool_create();
-    struct ast* first_decl = parse_with_preprocessor(&mem_pool, preprocessor, &log);
+// Writes the files read to compile the given file as a Makefile rule. This is a by-product of the
+// compilation, so the files are not preprocessed again.
+static void write_deps(
+    const char* file_name,
+    const struct session* session,
+    const struct options* options,
+    FILE* output_file,
+    struct log* log)
+{
+    // Nothing is written if the file could not be opened.
+    const struct cached_file_vec* included_files = session_included_files(session);
+    if (included_files->elem_count == 0)
+        return;
+
+    // Like GCC, the rule is placed next to the emitted file, if any, which is also the default target.
+    // When nothing is emitted, the target is named after the object file that `oslc` would produce,
+    // since a rule whose target is the input file would be dropped by make as a circular dependency.
+    const char* emitted_file = options->pch_output_file ? options->pch_output_file : options->builtins_image_file;
+
+    char* deps_file_name = NULL;
+    FILE* file = output_file;
+    if (options->deps_file || !options->print_deps) {
+        deps_file_name = options->deps_file ? NULL
+            : replace_extension(emitted_file ? emitted_file : file_name, ".d", emitted_file != NULL);
+        const char* opened_file_name = deps_file_name ? deps_file_name : options->deps_file;
+        file = fopen(opened_file_name, "w");
+        if (!file) {
+            log_error(log, NULL, "cannot open '%s' for writing", opened_file_name);
+            free(deps_file_name);
+            return;
+        }
+    }
 
-    // If builtins are available, prepend them to the program.
-    struct ast* last_builtin = NULL;
-    struct ast* full_program = first_decl;
-    if (builtins) {
-        last_builtin = ast_list_last(builtins);
-        last_builtin->next = first_decl;
-        full_program = builtins;
+    char* default_target = !options->deps_target && !emitted_file ? replace_extension(file_name, ".oso", false) : NULL;
+    const char* target = options->deps_target ? options->deps_target : emitted_file ? emitted_file : default_target;
+    print_dep_name(file, target);
+    fputc(':', file);
+    VEC_FOREACH(struct cached_file*, cached_file, *included_files) {
+        fputs(" \\\n  ", file);
+        print_dep_name(file, (*cached_file)->file_name);
+    }
+    if (options->pch_file) {
+        fputs(" \\\n  ", file);
+        print_dep_name(file, options->pch_file);
     }
+    fputc('\n', file);
 
-    if (full_program) {
-        check(&mem_pool, type_table, full_program, &log);
+    if (file != output_file)
+        fclose(file);
+    free(default_target);
+    free(deps_file_name);
+}
 
-        if (options->print_ast) {
-            ast_print(stdout, first_decl, &(struct ast_print_options) {
-                .disable_colors = options->disable_colors || !is_term(stdout)
-            });
-        }
-    }
+// Compiles a file, adding the time spent in each phase and other statistics to the given object,
+// unless it is NULL.
+static bool compile_file(
+    const char* file_name,
+    struct session* session,
+    const struct options* options,
+    FILE* log_file,
+    FILE* output_file,
+    struct stats* stats)
+{
+    struct log log = {
+        .file = log_file,
+        .disable_colors = options->disable_log_colors,
+        .warns_as_errors = options->warns_as_errors,
+        .max_warns = options->max_warns,
+        .max_errors = options->max_errors,
+        .line_reader = session_line_reader(session)
+    };
 
-    // Remove builtins from the program.
-    if (last_builtin)
-        last_builtin->next = NULL;
+    struct compile_options compile_options = {
+        .include_dirs = (const char* const*)options->include_dirs.elems,
+        .macros = options->user_macros.elems,
+        .macro_count = options->user_macros.elem_count,
+        .pch_file = options->pch_file,
+        .pch_output_file = options->pch_output_file,
+        .disable_builtins = options->disable_builtins
+    };
 
-    mem_pool_destroy(&mem_pool);
-    preprocessor_close(preprocessor);
+    struct ast* first_decl = session_compile_file(session, file_name, &compile_options, &log, stats);
+    if (first_decl && options->print_ast) {
+        uint64_t print_begin_time = stats_time();
+        ast_print(output_file, first_decl, &(struct ast_print_options) {
+            .disable_colors = options->disable_output_colors
+        });
+        stats_end_phase(stats, PHASE_PRINT, print_begin_time);
+    }
 
+    if (first_decl && options->builtins_image_file && log.error_count == 0)
+        write_builtins_image(options->builtins_image_file, first_decl, &log);
+    if (needs_deps(options))
+        write_deps(file_name, session, options, output_file, &log);
     return log.error_count == 0;
 }
 
+static void enable_colors_on_terminals(struct options* options, bool is_log_term, bool is_output_term) {
+    options->disable_log_colors = options->disable_colors || !is_log_term;
+    options->disable_output_colors = options->disable_colors || !is_output_term;
+}
+
+static size_t count_remaining_args(int argc, char** argv) {
+    size_t arg_count = 0;
+    for (int i = 1; i < argc; ++i)
+        arg_count += argv[i] ? 1 : 0;
+    return arg_count;
+}
+
 static bool parse_options(int argc, char** argv, struct options* options) {
     struct cli_option cli_options[] = {
         { .short_name = "-h", .long_name = "--help", .parse = usage },
@@ -220,67 +322,378 @@ static bool parse_options(int argc, char** argv, struct options* options) {
         cli_flag(NULL, "--no-builtins",     &options->disable_builtins),
         cli_flag(NULL, "--warns-as-errors", &options->warns_as_errors),
         cli_flag(NULL, "--print-ast",       &options->print_ast),
+        cli_flag(NULL, "--time-report",     &options->time_report),
         cli_option_uint32(NULL, "--max-errors", &options->max_errors),
         cli_option_uint32(NULL, "--max-warns", &options->max_warns),
+        cli_option_single_string(NULL, "--emit-builtins", &options->builtins_image_file),
+        cli_option_single_string(NULL, "--emit-pch", &options->pch_output_file),
+        cli_option_single_string(NULL, "--include-pch", &options->pch_file),
+        cli_option_single_string(NULL, "--time-report-json", &options->time_report_json_file),
+        cli_option_single_string(NULL, "--trace-out", &options->trace_file),
         cli_option_multi_strings("-I", "--include-dir", &options->include_dirs),
+        cli_flag("-M", "--print-deps", &options->print_deps),
+        cli_flag("-MD", "--write-deps", &options->write_deps),
+        cli_option_single_string("-MF", "--deps-file", &options->deps_file),
+        cli_option_single_string("-MT", "--deps-target", &options->deps_target),
+        cli_option_uint32("-j", "--jobs", &options->thread_count),
+        cli_option_single_string(NULL, "--server", &options->server_socket),
+        cli_option_single_string(NULL, "--connect", &options->connect_socket),
     };
     if (!cli_parse_options(argc, argv, cli_options, sizeof(cli_options) / sizeof(cli_options[0])))
         return false;
+    if (options->pch_output_file && options->pch_file) {
+        fprintf(stderr, "'--emit-pch' and '--include-pch' cannot be used together\n");
+        return false;
+    }
+    if (options->deps_file && count_remaining_args(argc, argv) > 1) {
+        fprintf(stderr, "'-MF' cannot be used with more than one input file\n");
+        return false;
+    }
+    if (options->print_deps && !options->deps_file && options->print_ast) {
+        fprintf(stderr, "'-M' and '--print-ast' cannot be used together, unless '-MF' is used\n");
+        return false;
+    }
     if (options->max_errors < 2)
         options->max_errors = 2;
+    if (options->thread_count == 0) {
+        long core_count = sysconf(_SC_NPROCESSORS_ONLN);
+        options->thread_count = core_count > 0 ? (uint32_t)core_count : 1;
+    }
     raw_str_vec_push(&options->include_dirs, (char*[]) { NULL });
     return true;
 }
 
-static struct ast* parse_builtins(
-    [[maybe_unused]] struct mem_pool* mem_pool,
-    [[maybe_unused]] struct type_table* type_table)
-{
+static struct session* create_session(void) {
 #ifdef ENABLE_BUILTINS
-    struct log log = {
-        .file = NULL,
-        .disable_colors = true,
-        .max_warns = 1,
-        .max_errors = 1
-    };
-
-    struct lexer lexer = lexer_create(builtins_name, STR_VIEW(builtins_data));
-    struct ast* builtins = parse_with_lexer(mem_pool, &lexer, &log);
-    check(mem_pool, type_table, builtins, &log);
-    assert(log.error_count == 0 && log.warn_count == 0);
-    return builtins;
+    return session_create(builtins_image, sizeof(builtins_image));
 #else
-    return NULL;
+    return session_create(NULL, 0);
 #endif
 }
 
-int main(int argc, char** argv) {
+static void destroy_sessions(struct session** sessions, size_t session_count) {
+    for (size_t i = 0; i < session_count; ++i) {
+        if (sessions[i])
+            session_destroy(sessions[i]);
+    }
+    free(sessions);
+}
+
+static bool needs_stats(const struct options* options) {
+    return options->time_report || options->time_report_json_file || options->trace_file;
+}
+
+static void init_file_stats(struct stats* stats, const struct options* options, size_t thread_index) {
+    if (options->trace_file)
+        stats->trace = trace_create(thread_index);
+}
+
+static void print_time_report(FILE* file, const char* file_name, const struct stats* stats) {
+    struct str title = str_create();
+    str_printf(&title, "time report for '%s':", file_name);
+    stats_print(file, str_terminate(&title), stats);
+    str_destroy(&title);
+}
+
+static void write_time_report_json(
+    const char* json_file_name,
+    const char* const* file_names,
+    const struct stats* file_stats,
+    size_t file_count,
+    const struct stats* total_stats,
+    FILE* log_file)
+{
+    FILE* file = fopen(json_file_name, "w");
+    if (!file) {
+        fprintf(log_file, "cannot open '%s' for writing\n", json_file_name);
+        return;
+    }
+    fputs("{\"files\":[", file);
+    for (size_t i = 0; i < file_count; ++i) {
+        stats_print_json(file, file_names[i], &file_stats[i]);
+        if (i + 1 < file_count)
+            fputc(',', file);
+    }
+    fputs("],\"total\":", file);
+    stats_print_json(file, "total", total_stats);
+    fputs("}\n", file);
+    fclose(file);
+}
+
+static void write_trace(const char* trace_file_name, const struct stats* file_stats, size_t file_count, FILE* log_file) {
+    FILE* file = fopen(trace_file_name, "w");
+    if (!file) {
+        fprintf(log_file, "cannot open '%s' for writing\n", trace_file_name);
+        return;
+    }
+    struct trace** traces = xmalloc(sizeof(struct trace*) * file_count);
+    for (size_t i = 0; i < file_count; ++i)
+        traces[i] = file_stats[i].trace;
+    trace_write(file, traces, file_count);
+    free(traces);
+    fclose(file);
+}
+
+// Prints the statistics accumulated over all the files, after the reports of individual files, and
+// writes the requested reports and traces.
+static void finish_file_stats(
+    const struct options* options,
+    const char* const* file_names,
+    struct stats* file_stats,
+    size_t file_count,
+    FILE* log_file)
+{
+    struct stats total_stats = {};
+    for (size_t i = 0; i < file_count; ++i)
+        stats_accumulate(&total_stats, &file_stats[i]);
+    if (options->time_report)
+        stats_print(log_file, "time report for all files:", &total_stats);
+    if (options->time_report_json_file) {
+        write_time_report_json(options->time_report_json_file,
+            file_names, file_stats, file_count, &total_stats, log_file);
+    }
+    if (options->trace_file)
+        write_trace(options->trace_file, file_stats, file_count, log_file);
+    for (size_t i = 0; i < file_count; ++i) {
+        if (file_stats[i].trace)
+            trace_destroy(file_stats[i].trace);
+    }
+}
+
+static void run_compile_job(void* data, size_t job_index, size_t thread_index) {
+    struct parallel_compile* parallel_compile = data;
+    struct compile_job* job = &parallel_compile->jobs[job_index];
+
+    // Sessions that were not created by the caller are created lazily, on the thread that uses them.
+    struct session** session = &parallel_compile->sessions[thread_index];
+    if (!*session)
+        *session = create_session();
+
+    // Diagnostics and output are buffered, so that they can be printed in the order of the input files.
+    struct mem_stream log_stream;
+    struct mem_stream output_stream;
+    mem_stream_init(&log_stream);
+    mem_stream_init(&output_stream);
+    struct stats* stats = parallel_compile->file_stats ? &parallel_compile->file_stats[job_index] : NULL;
+    if (stats)
+        init_file_stats(stats, parallel_compile->options, thread_index);
+    job->status = compile_file(job->file_name, *session, parallel_compile->options,
+        log_stream.file, output_stream.file, stats);
+    if (parallel_compile->options->time_report)
+        print_time_report(log_stream.file, job->file_name, stats);
+    job->diagnostics = mem_stream_release(&log_stream);
+    job->output = mem_stream_release(&output_stream);
+}
+
+// Compiles the given files on `options->thread_count` threads, using the given sessions, of which
+// there must be at least as many as there are threads. The callback is called with the buffered
+// diagnostics and output of each file, in the order of the input files. Statistics are collected
+// for each file in the given array, unless it is NULL.
+static bool compile_files_buffered(
+    const char* const* file_names,
+    size_t file_count,
+    const struct options* options,
+    struct session** sessions,
+    struct stats* file_stats,
+    compile_job_callback callback,
+    void* callback_data)
+{
+    struct parallel_compile parallel_compile = {
+        .options = options,
+        .jobs = xcalloc(file_count, sizeof(struct compile_job)),
+        .sessions = sessions,
+        .file_stats = file_stats
+    };
+    for (size_t i = 0; i < file_count; ++i)
+        parallel_compile.jobs[i].file_name = file_names[i];
+
+    struct thread_pool* thread_pool = thread_pool_create(
+        options->thread_count, file_count, run_compile_job, &parallel_compile);
+
+    bool status = true;
+    for (size_t i = 0; i < file_count; ++i) {
+        thread_pool_wait(thread_pool, i);
+        struct compile_job* job = &parallel_compile.jobs[i];
+        callback(callback_data, job);
+        free(job->output);
+        free(job->diagnostics);
+        status &= job->status;
+    }
+
+    thread_pool_destroy(thread_pool);
+    free(parallel_compile.jobs);
+    return status;
+}
+
+static void print_compile_job(void*, const struct compile_job* job) {
+    fputs(job->diagnostics, stderr);
+    fputs(job->output, stdout);
+}
+
+static void send_compile_job(void* data, const struct compile_job* job) {
+    struct server_connection* connection = data;
+    server_send(connection, SERVER_STREAM_DIAGNOSTICS, job->diagnostics, strlen(job->diagnostics));
+    server_send(connection, SERVER_STREAM_OUTPUT, job->output, strlen(job->output));
+}
+
+static void send_error(struct server_connection* connection, const char* message) {
+    server_send(connection, SERVER_STREAM_DIAGNOSTICS, message, strlen(message));
+}
+
+static void collect_file_names(int argc, char** argv, struct raw_str_vec* file_names) {
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i])
+            raw_str_vec_push(file_names, &argv[i]);
+    }
+}
+
+static int handle_compile_request(void* data, int argc, char** argv, struct server_connection* connection) {
+    struct compile_server* compile_server = data;
     struct options options = options_create();
     if (!parse_options(argc, argv, &options)) {
         options_destroy(&options);
+        send_error(connection, "invalid command-line options\n");
+        return 1;
+    }
+    if (options.server_socket || options.connect_socket) {
+        options_destroy(&options);
+        send_error(connection, "cannot start or connect to a server from a compile request\n");
         return 1;
     }
 
-    struct mem_pool mem_pool = mem_pool_create();
-    struct type_table* type_table = type_table_create(&mem_pool);
-    struct file_cache* file_cache = file_cache_create();
+    // Clients disable colors themselves when their output is not a terminal.
+    enable_colors_on_terminals(&options, true, true);
 
-    struct ast* builtins = NULL;
-    if (!options.disable_builtins)
-        builtins = parse_builtins(&mem_pool, type_table);
+    struct raw_str_vec file_names = raw_str_vec_create();
+    collect_file_names(argc, argv, &file_names);
 
     bool status = true;
-    size_t file_count = 0;
-    for (int i = 1; i < argc; ++i) {
-        if (!argv[i])
+    size_t file_count = file_names.elem_count;
+    if (file_count > 0) {
+        options.thread_count = compile_server->thread_count;
+
+        // Files may have changed on disk since the previous request.
+        for (size_t i = 0; i < compile_server->thread_count; ++i) {
+            if (compile_server->sessions[i])
+                session_revalidate(compile_server->sessions[i]);
+        }
+
+        struct stats* file_stats = needs_stats(&options) ? xcalloc(file_count, sizeof(struct stats)) : NULL;
+        status = compile_files_buffered((const char* const*)file_names.elems, file_count,
+            &options, compile_server->sessions, file_stats, send_compile_job, connection);
+        if (file_stats) {
+            struct mem_stream report_stream;
+            mem_stream_init(&report_stream);
+            finish_file_stats(&options, (const char* const*)file_names.elems, file_stats, file_count, report_stream.file);
+            char* report = mem_stream_release(&report_stream);
+            send_error(connection, report);
+            free(report);
+            free(file_stats);
+        }
+    } else {
+        send_error(connection, "no input files\n");
+    }
+
+    raw_str_vec_destroy(&file_names);
+    options_destroy(&options);
+    return file_count > 0 && status ? 0 : 1;
+}
+
+// Only returns when the server fails, see `server_run`.
+static void run_compile_server(const char* socket_path, uint32_t thread_count) {
+    struct compile_server compile_server = {
+        .sessions = xcalloc(thread_count, sizeof(struct session*)),
+        .thread_count = thread_count
+    };
+
+    // Files can be modified by other processes while the server keeps them, which would crash the
+    // server if they were mapped in memory.
+    for (uint32_t i = 0; i < thread_count; ++i) {
+        compile_server.sessions[i] = create_session();
+        session_disable_file_mapping(compile_server.sessions[i]);
+    }
+    server_run(socket_path, handle_compile_request, &compile_server);
+    destroy_sessions(compile_server.sessions, thread_count);
+}
+
+// Forwards all arguments but the ones used to connect to the server.
+static int forward_to_compile_server(const char* socket_path, int argc, char** argv) {
+    struct raw_str_vec args = raw_str_vec_create();
+    for (int i = 0; i < argc; ++i) {
+        if (!strcmp(argv[i], "--connect")) {
+            i++;
             continue;
-        status &= compile_file(argv[i], builtins, file_cache, type_table, &options);
-        file_count++;
+        }
+        raw_str_vec_push(&args, &argv[i]);
+    }
+
+    // The server cannot tell whether the output of the client is a terminal.
+    if (!is_term(stderr) || !is_term(stdout))
+        raw_str_vec_push(&args, (char*[]) { "--no-color" });
+
+    int status = client_run(socket_path, (int)args.elem_count, args.elems);
+    raw_str_vec_destroy(&args);
+    return status == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    // Parsing options consumes arguments, so keep a copy to forward them to a compile server.
+    char** raw_args = xmalloc(sizeof(char*) * (argc + 1));
+    memcpy(raw_args, argv, sizeof(char*) * (argc + 1));
+
+    struct options options = options_create();
+    if (!parse_options(argc, argv, &options)) {
+        options_destroy(&options);
+        free(raw_args);
+        return 1;
+    }
+
+    if (options.server_socket || options.connect_socket) {
+        int status = 1;
+        if (options.connect_socket)
+            status = forward_to_compile_server(options.connect_socket, argc, raw_args);
+        else
+            run_compile_server(options.server_socket, options.thread_count);
+        options_destroy(&options);
+        free(raw_args);
+        return status;
+    }
+    free(raw_args);
+
+    enable_colors_on_terminals(&options, is_term(stderr), is_term(stdout));
+
+    struct raw_str_vec file_names = raw_str_vec_create();
+    collect_file_names(argc, argv, &file_names);
+
+    bool status = true;
+    size_t file_count = file_names.elem_count;
+    struct stats* file_stats = needs_stats(&options) && file_count > 0
+        ? xcalloc(file_count, sizeof(struct stats)) : NULL;
+    if (options.thread_count > 1 && file_count > 1) {
+        struct session** sessions = xcalloc(options.thread_count, sizeof(struct session*));
+        status = compile_files_buffered((const char* const*)file_names.elems, file_count,
+            &options, sessions, file_stats, print_compile_job, NULL);
+        destroy_sessions(sessions, options.thread_count);
+    } else if (file_count > 0) {
+        // Built-ins are loaded only once, and shared by every input file.
+        struct session* session = create_session();
+        for (size_t i = 0; i < file_count; ++i) {
+            struct stats* stats = file_stats ? &file_stats[i] : NULL;
+            if (stats)
+                init_file_stats(stats, &options, 0);
+            status &= compile_file(file_names.elems[i], session, &options, stderr, stdout, stats);
+            if (options.time_report)
+                print_time_report(stderr, file_names.elems[i], stats);
+        }
+        session_destroy(session);
+    }
+
+    if (file_stats) {
+        finish_file_stats(&options, (const char* const*)file_names.elems, file_stats, file_count, stderr);
+        free(file_stats);
     }
 
-    file_cache_destroy(file_cache);
-    type_table_destroy(type_table);
-    mem_pool_destroy(&mem_pool);
+    raw_str_vec_destroy(&file_names);
     options_destroy(&options);
 
     if (file_count == 0) {
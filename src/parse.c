@@ -1,7 +1,8 @@
 #include "ast.h"
 #include "parse.h"
-#include "lexer.h"
 #include "preprocessor.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <overture/log.h>
 #include <overture/str.h>
@@ -14,17 +15,13 @@
 #define TOKENS_AHEAD 3
 #define TOKENS_BEHIND 3
 
-struct parse_input {
-    void* data;
-    struct token (*next_token)(void* data);
-};
-
 struct parser {
     struct token ahead[TOKENS_AHEAD];
     struct token behind[TOKENS_BEHIND];
-    struct parse_input input;
+    struct preprocessor* preprocessor;
     struct mem_pool* mem_pool;
     struct log* log;
+    struct stats* stats;
 };
 
 static struct ast* parse_type(struct parser*);
@@ -38,7 +35,15 @@ static inline void read_token(struct parser* parser) {
     parser->behind[0] = parser->ahead[0];
     for (size_t i = 1; i < TOKENS_AHEAD; ++i)
         parser->ahead[i - 1] = parser->ahead[i];
-    parser->ahead[TOKENS_AHEAD - 1] = parser->input.next_token(parser->input.data);
+    parser->ahead[TOKENS_AHEAD - 1] = preprocessor_advance(parser->preprocessor);
+}
+
+static inline struct file_loc token_loc(const struct parser* parser, const struct token* token) {
+    return preprocessor_token_loc(parser->preprocessor, token);
+}
+
+static inline struct str_view token_contents(const struct parser* parser, const struct token* token) {
+    return preprocessor_token_contents(parser->preprocessor, token);
 }
 
 static inline void eat_token(struct parser* parser, [[maybe_unused]] enum token_tag tag) {
@@ -56,9 +61,10 @@ static inline bool accept_token(struct parser* parser, enum token_tag tag) {
 
 static inline bool expect_token(struct parser* parser, enum token_tag tag) {
     if (!accept_token(parser, tag)) {
-        struct str_view contents = token_printable_contents(parser->ahead);
+        struct str_view contents = token_printable_contents(parser->ahead->tag, token_contents(parser, parser->ahead));
+        struct file_loc loc = token_loc(parser, parser->ahead);
         log_error(parser->log,
-            &parser->ahead->loc,
+            &loc,
             "expected '%s', but got '%.*s'",
             token_tag_to_string(tag),
             (int)contents.length, contents.data);
@@ -74,11 +80,13 @@ static inline struct ast* alloc_ast(
 {
     struct ast* copy = MEM_POOL_ALLOC(*parser->mem_pool, struct ast);
     memcpy(copy, ast, sizeof(struct ast));
+    if (parser->stats)
+        parser->stats->counters[COUNTER_AST_NODES]++;
 
-    struct file_loc* end_loc = &parser->behind->loc;
-    const bool is_after = end_loc->end.row > begin_loc->begin.row ||
-        (end_loc->end.row == begin_loc->begin.row && end_loc->end.col >= begin_loc->begin.col);
-    const bool is_same_file = !strcmp(end_loc->file_name, begin_loc->file_name);
+    const struct file_loc end_loc = token_loc(parser, parser->behind);
+    const bool is_after = end_loc.end.row > begin_loc->begin.row ||
+        (end_loc.end.row == begin_loc->begin.row && end_loc.end.col >= begin_loc->begin.col);
+    const bool is_same_file = !strcmp(end_loc.file_name, begin_loc->file_name);
 
     copy->loc.displayed_file_name = begin_loc->displayed_file_name;
     copy->loc.displayed_line = begin_loc->displayed_line;
@@ -86,7 +94,7 @@ static inline struct ast* alloc_ast(
     copy->loc.file_name = begin_loc->file_name;
     copy->loc.begin = begin_loc->begin;
     if (is_after && is_same_file) {
-        copy->loc.end = end_loc->end;
+        copy->loc.end = end_loc.end;
     } else {
         // Make sure the location shows up as one entire line from the first token, as this is the
         // best we can do to assign a single location to an AST that spans multiple files or comes
@@ -98,7 +106,14 @@ static inline struct ast* alloc_ast(
 }
 
 static const char* parse_ident(struct parser* parser) {
-    struct str_view contents  = parser->ahead->contents;
+    // Identifiers are interned by the preprocessor.
+    if (parser->ahead->tag == TOKEN_IDENT) {
+        const char* ident = preprocessor_token_ident(parser->preprocessor, parser->ahead);
+        eat_token(parser, TOKEN_IDENT);
+        return ident;
+    }
+
+    struct str_view contents = token_contents(parser, parser->ahead);
     char* name = mem_pool_alloc(parser->mem_pool, contents.length + 1, alignof(char));
     xmemcpy(name, contents.data, contents.length);
     name[contents.length] = 0;
@@ -125,17 +140,18 @@ static struct ast* parse_many(
 }
 
 static struct ast* parse_error(struct parser* parser, const char* msg) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
+    struct str_view contents = token_contents(parser, parser->ahead);
     log_error(parser->log,
-        &parser->ahead->loc,
+        &begin_loc,
         "expected %s, but got '%.*s'",
-        msg, (int)parser->ahead->contents.length, parser->ahead->contents.data);
+        msg, (int)contents.length, contents.data);
     read_token(parser);
     return alloc_ast(parser, &begin_loc, &(struct ast) { .tag = AST_ERROR });
 }
 
 static struct ast* parse_attr(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     const char* name = parse_ident(parser);
     struct ast* args = NULL;
     if (accept_token(parser, TOKEN_LPAREN))
@@ -160,7 +176,7 @@ static struct ast* parse_attr_list(struct parser* parser) {
 }
 
 static struct ast* parse_bool_literal(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     bool bool_literal = parser->ahead->tag == TOKEN_TRUE;
     eat_token(parser, bool_literal ? TOKEN_TRUE : TOKEN_FALSE);
     return alloc_ast(parser, &begin_loc, &(struct ast) {
@@ -170,8 +186,8 @@ static struct ast* parse_bool_literal(struct parser* parser) {
 }
 
 static struct ast* parse_int_literal(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
-    int_literal int_literal = parser->ahead->int_literal;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
+    int_literal int_literal = token_int_literal(token_contents(parser, parser->ahead));
     eat_token(parser, TOKEN_INT_LITERAL);
     return alloc_ast(parser, &begin_loc, &(struct ast) {
         .tag = AST_INT_LITERAL,
@@ -180,8 +196,8 @@ static struct ast* parse_int_literal(struct parser* parser) {
 }
 
 static struct ast* parse_float_literal(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
-    float_literal float_literal = parser->ahead->float_literal;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
+    float_literal float_literal = token_float_literal(token_contents(parser, parser->ahead));
     eat_token(parser, TOKEN_FLOAT_LITERAL);
     return alloc_ast(parser, &begin_loc, &(struct ast) {
         .tag = AST_FLOAT_LITERAL,
@@ -190,10 +206,10 @@ static struct ast* parse_float_literal(struct parser* parser) {
 }
 
 static struct ast* parse_string_literal(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     struct str str = str_create();
     while (parser->ahead->tag == TOKEN_STRING_LITERAL) {
-        str_append(&str, parser->ahead->string_literal);
+        str_append(&str, token_string_literal(token_contents(parser, parser->ahead)));
         eat_token(parser, TOKEN_STRING_LITERAL);
     }
     char* string_literal = mem_pool_alloc(parser->mem_pool, str.length + 1, alignof(char));
@@ -207,7 +223,7 @@ static struct ast* parse_string_literal(struct parser* parser) {
 }
 
 static struct ast* parse_compound_init(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_LBRACE);
     struct ast* elems = parse_many(parser, TOKEN_RBRACE, TOKEN_COMMA, parse_expr);
     return alloc_ast(parser, &begin_loc, &(struct ast) {
@@ -217,7 +233,7 @@ static struct ast* parse_compound_init(struct parser* parser) {
 }
 
 static struct ast* parse_cast_expr(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_LPAREN);
     struct ast* type = parse_type(parser);
     expect_token(parser, TOKEN_RPAREN);
@@ -248,7 +264,7 @@ static struct ast* parse_compound_expr(struct parser* parser) {
 }
 
 static struct ast* parse_paren_expr(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_LPAREN);
     struct ast* inner_expr = parse_compound_expr(parser);
     expect_token(parser, TOKEN_RPAREN);
@@ -272,7 +288,7 @@ static struct ast* parse_cast_or_paren_expr(struct parser* parser) {
 }
 
 static struct ast* parse_ident_expr(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     const char* name = parse_ident(parser);
     return alloc_ast(parser, &begin_loc, &(struct ast) {
         .tag = AST_IDENT_EXPR,
@@ -281,7 +297,7 @@ static struct ast* parse_ident_expr(struct parser* parser) {
 }
 
 static struct ast* parse_construct_expr(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     struct ast* type = parse_type(parser);
     expect_token(parser, TOKEN_LPAREN);
     struct ast* args = parse_many(parser, TOKEN_RPAREN, TOKEN_COMMA, parse_expr);
@@ -377,7 +393,7 @@ static struct ast* parse_suffix_expr(struct parser* parser, struct ast* expr) {
 }
 
 static struct ast* parse_prefix_expr(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     enum unary_expr_tag tag = token_tag_to_unary_expr_tag(parser->ahead->tag, true);
     if (tag != UNARY_EXPR_INVALID)
         read_token(parser);
@@ -467,7 +483,7 @@ static struct ast* parse_expr(struct parser* parser) {
 }
 
 static struct ast* parse_prim_type(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     enum prim_type prim_type = PRIM_TYPE_VOID;
     switch (parser->ahead->tag) {
 #define x(name, ...) case TOKEN_##name: prim_type = PRIM_TYPE_##name; break;
@@ -484,7 +500,7 @@ static struct ast* parse_prim_type(struct parser* parser) {
 }
 
 static struct ast* parse_shader_type(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     enum shader_type shader_type = SHADER_TYPE_SHADER;
     switch (parser->ahead->tag) {
 #define x(name, ...) case TOKEN_##name: shader_type = SHADER_TYPE_##name; break;
@@ -502,7 +518,7 @@ static struct ast* parse_shader_type(struct parser* parser) {
 }
 
 static struct ast* parse_closure_type(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_CLOSURE);
     struct ast* inner_type = parse_prim_type(parser);
     return alloc_ast(parser, &begin_loc, &(struct ast) {
@@ -512,7 +528,7 @@ static struct ast* parse_closure_type(struct parser* parser) {
 }
 
 static struct ast* parse_named_type(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     const char* name = parse_ident(parser);
     return alloc_ast(parser, &begin_loc, &(struct ast) {
         .tag = AST_NAMED_TYPE,
@@ -540,7 +556,7 @@ static struct ast* parse_unsized_dim(struct parser* parser, const struct file_lo
 }
 
 static struct ast* parse_array_dim(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     if (accept_token(parser, TOKEN_LBRACKET)) {
         struct ast* dim = parser->ahead->tag == TOKEN_RBRACKET
             ? parse_unsized_dim(parser, &begin_loc)
@@ -552,7 +568,7 @@ static struct ast* parse_array_dim(struct parser* parser) {
 }
 
 static struct ast* parse_metadatum(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     struct ast* type = parse_type(parser);
     const char* name = parse_ident(parser);
     expect_token(parser, TOKEN_EQ);
@@ -574,15 +590,15 @@ static struct ast* parse_metadata(struct parser* parser) {
 }
 
 static void parse_ignored_metadata(struct parser* parser) {
-    struct file_loc loc = parser->ahead->loc;
+    struct file_loc loc = token_loc(parser, parser->ahead);
     struct ast* metadata = parse_metadata(parser);
-    loc.end = parser->behind->loc.end;
+    loc.end = token_loc(parser, parser->behind).end;
     if (metadata)
         log_warn(parser->log, &loc, "shader metadata is not allowed here");
 }
 
 static struct ast* parse_ellipsis(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_ELLIPSIS);
     return alloc_ast(parser, &begin_loc, &(struct ast) {
         .tag = AST_PARAM,
@@ -591,7 +607,7 @@ static struct ast* parse_ellipsis(struct parser* parser) {
 }
 
 static struct ast* parse_param(struct parser* parser, bool is_shader_param) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     bool is_output = accept_token(parser, TOKEN_OUTPUT);
     struct ast* type = parse_type(parser);
     const char* name = NULL;
@@ -630,7 +646,7 @@ static struct ast* parse_shader_param(struct parser* parser) {
 }
 
 static struct ast* parse_if_stmt(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_IF);
     expect_token(parser, TOKEN_LPAREN);
     struct ast* cond = parse_compound_expr(parser);
@@ -650,21 +666,21 @@ static struct ast* parse_if_stmt(struct parser* parser) {
 }
 
 static struct ast* parse_break_stmt(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_BREAK);
     expect_token(parser, TOKEN_SEMICOLON);
     return alloc_ast(parser, &begin_loc, &(struct ast) { .tag = AST_BREAK_STMT });
 }
 
 static struct ast* parse_continue_stmt(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_CONTINUE);
     expect_token(parser, TOKEN_SEMICOLON);
     return alloc_ast(parser, &begin_loc, &(struct ast) { .tag = AST_CONTINUE_STMT });
 }
 
 static struct ast* parse_return_stmt(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_RETURN);
     struct ast* value = NULL;
     if (!accept_token(parser, TOKEN_SEMICOLON)) {
@@ -678,7 +694,7 @@ static struct ast* parse_return_stmt(struct parser* parser) {
 }
 
 static struct ast* parse_while_loop(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_WHILE);
     expect_token(parser, TOKEN_LPAREN);
     struct ast* cond = parse_compound_expr(parser);
@@ -694,7 +710,7 @@ static struct ast* parse_while_loop(struct parser* parser) {
 }
 
 static struct ast* parse_do_while_loop(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_DO);
     struct ast* body = parse_stmt(parser);
     expect_token(parser, TOKEN_WHILE);
@@ -712,7 +728,7 @@ static struct ast* parse_do_while_loop(struct parser* parser) {
 }
 
 static struct ast* parse_var(struct parser* parser, bool with_init) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     const char* name = parse_ident(parser);
     struct ast* dim = parse_array_dim(parser);
     struct ast* init = NULL;
@@ -751,7 +767,7 @@ static struct ast* parse_var_decl(struct parser* parser, struct ast* type, bool
 }
 
 static struct ast* parse_block(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_LBRACE);
     struct ast* stmts = parse_many(parser, TOKEN_RBRACE, TOKEN_ERROR, parse_stmt);
     return alloc_ast(parser, &begin_loc, &(struct ast) {
@@ -809,7 +825,7 @@ static struct ast* parse_for_init(struct parser* parser) {
 }
 
 static struct ast* parse_for_loop(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_FOR);
     expect_token(parser, TOKEN_LPAREN);
     struct ast* init = parse_for_init(parser);
@@ -844,7 +860,7 @@ static struct ast* parse_var_or_func_decl(struct parser* parser, bool is_top_lev
 }
 
 static struct ast* parse_empty_stmt(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_SEMICOLON);
     return alloc_ast(parser, &begin_loc, &(struct ast) { .tag = AST_EMPTY_STMT });
 }
@@ -898,7 +914,7 @@ static struct ast* parse_stmt(struct parser* parser) {
 }
 
 static struct ast* parse_shader_decl(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     struct ast* type = parse_shader_type(parser);
     const char* name = parse_ident(parser);
     struct ast* metadata = parse_metadata(parser);
@@ -922,7 +938,7 @@ static struct ast* parse_field_decl(struct parser* parser) {
 }
 
 static struct ast* parse_struct_decl(struct parser* parser) {
-    struct file_loc begin_loc = parser->ahead->loc;
+    struct file_loc begin_loc = token_loc(parser, parser->ahead);
     eat_token(parser, TOKEN_STRUCT);
     const char* name = parse_ident(parser);
     expect_token(parser, TOKEN_LBRACE);
@@ -957,58 +973,35 @@ static struct ast* parse_top_level_decl(struct parser* parser) {
 }
 
 static struct ast* parse_top_level_decl_with_attrs(struct parser* parser) {
+    struct trace* trace = stats_trace(parser->stats);
+    uint64_t begin_time = trace ? stats_time() : 0;
+
     struct ast* attrs = parse_attr_list(parser);
     struct ast* decl = parse_top_level_decl(parser);
     decl->attrs = attrs;
+
+    if (trace) {
+        const char* decl_name = ast_decl_name(decl);
+        if (decl->tag == AST_VAR_DECL && decl->var_decl.vars)
+            decl_name = decl->var_decl.vars->var.name;
+        trace_add_event(trace, TRACE_TRACK_COMPILER, "parse", decl_name, begin_time, stats_time());
+    }
     return decl;
 }
 
-static struct ast* parse(
+struct ast* parse_with_preprocessor(
     struct mem_pool* mem_pool,
-    const struct parse_input* input,
-    struct log* log)
+    struct preprocessor* preprocessor,
+    struct log* log,
+    struct stats* stats)
 {
     struct parser parser = {
         .mem_pool = mem_pool,
-        .input = *input,
-        .log = log
+        .preprocessor = preprocessor,
+        .log = log,
+        .stats = stats
     };
     for (size_t i = 0; i < TOKENS_AHEAD; ++i)
         read_token(&parser);
     return parse_many(&parser, TOKEN_EOF, TOKEN_ERROR, parse_top_level_decl_with_attrs);
 }
-
-static struct token next_token_from_lexer(void* data) {
-    struct lexer* lexer = data;
-    // Skip new lines. Those are needed by the preprocessor, but we do not need them during parsing.
-    while (true) {
-        struct token token = lexer_advance(lexer);
-        if (token.tag != TOKEN_NL)
-            return token;
-    }
-}
-
-struct ast* parse_with_lexer(struct mem_pool* mem_pool, struct lexer* lexer, struct log* log) {
-    struct parse_input input = {
-        .data = lexer,
-        .next_token = next_token_from_lexer
-    };
-    return parse(mem_pool, &input, log);
-}
-
-static struct token next_token_from_preprocessor(void* data) {
-    struct preprocessor* preprocessor = data;
-    return preprocessor_advance(preprocessor);
-}
-
-struct ast* parse_with_preprocessor(
-    struct mem_pool* mem_pool,
-    struct preprocessor* preprocessor,
-    struct log* log)
-{
-    struct parse_input input = {
-        .data = preprocessor,
-        .next_token = next_token_from_preprocessor
-    };
-    return parse(mem_pool, &input, log);
-}
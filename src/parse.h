@@ -3,10 +3,11 @@
 #include <stddef.h>
 
 struct mem_pool;
-struct lexer;
 struct preprocessor;
 struct log;
 struct ast;
+struct stats;
 
-struct ast* parse_with_lexer(struct mem_pool*, struct lexer*, struct log*);
-struct ast* parse_with_preprocessor(struct mem_pool*, struct preprocessor*, struct log*);
+// Statistics are collected in the given object, unless it is NULL. Identifiers in the resulting AST
+// point to strings allocated in the memory pool given to `preprocessor_open`.
+struct ast* parse_with_preprocessor(struct mem_pool*, struct preprocessor*, struct log*, struct stats*);
@@ -2,36 +2,25 @@
 #include "file_cache.h"
 #include "lexer.h"
 #include "ast.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <overture/file.h>
 #include <overture/hash.h>
 #include <overture/mem.h>
 #include <overture/str_pool.h>
 #include <overture/mem_pool.h>
+#include <overture/map.h>
 #include <overture/set.h>
 
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <inttypes.h>
 
 #define TOKENS_AHEAD 2
-
-#define DIRECTIVE_LIST(x) \
-    x(DEFINE, "define") \
-    x(INCLUDE, "include") \
-    x(IF, "if") \
-    x(ELSE, "else") \
-    x(ELIF, "elif") \
-    x(IFDEF, "ifdef") \
-    x(IFNDEF, "ifndef") \
-    x(ENDIF, "endif") \
-    x(ELIFDEF, "elifdef") \
-    x(ELIFNDEF, "elifndef") \
-    x(UNDEF, "undef") \
-    x(PRAGMA, "pragma") \
-    x(LINE, "line") \
-    x(WARNING, "warning") \
-    x(ERROR, "error")
+#define BUILTIN_MACRO_FILE_NAME "<builtin macro>"
+#define MADE_TOKEN_FILE_ID 0
 
 enum cond_value {
     COND_FALSE,
@@ -42,7 +31,7 @@ enum cond_value {
 };
 
 struct cond {
-    struct file_loc loc;
+    struct token token;
     bool was_active;
     bool was_last_else;
 };
@@ -54,7 +43,7 @@ struct cond_stack {
     size_t inactive_cond_depth;
 };
 
-typedef void (*custom_macro_callback)(struct preprocessor*, struct file_loc*);
+typedef void (*custom_macro_callback)(struct preprocessor*, const struct token*);
 
 struct macro {
     bool has_params;
@@ -74,6 +63,23 @@ enum directive {
 #undef x
 };
 
+struct directive_entry {
+    struct str_view name;
+    enum directive directive;
+};
+
+#include "directive_table.inc"
+
+// State of the detection of the `#ifndef X / #define X / ... #endif` idiom in a source file. Files in
+// which everything except blank lines and comments is enclosed in such a block are not included again
+// while the guard macro is defined.
+enum include_guard_state {
+    INCLUDE_GUARD_START,
+    INCLUDE_GUARD_OPEN,
+    INCLUDE_GUARD_CLOSED,
+    INCLUDE_GUARD_NONE
+};
+
 enum context_tag {
     CONTEXT_SOURCE_FILE,
     CONTEXT_TOKEN_BUFFER
@@ -85,6 +91,10 @@ struct source_file {
     struct cond_stack cond_stack;
     const char* displayed_file_name;
     uint32_t displayed_line;
+    size_t lexed_token_count;
+    uint64_t include_time;
+    enum include_guard_state include_guard_state;
+    struct str_view include_guard;
 };
 
 struct token_buffer {
@@ -106,13 +116,47 @@ struct context {
 };
 
 struct macro_arg {
-    struct file_loc loc;
+    struct token first_token; // Gives the location of the argument, even if it is empty.
     struct token_vec unexpanded_tokens;
     struct token_vec expanded_tokens;
     bool is_expanded;
 };
 
+// Effect of a `#line` directive on the tokens that follow it in a file.
+struct line_directive {
+    uint32_t offset;
+    uint32_t row;
+    uint32_t displayed_line;
+    const char* displayed_file_name;
+};
+
+VEC_DEFINE(line_directive_vec, struct line_directive, PRIVATE)
+
+// Text that tokens point into (see `struct token`). Every inclusion of a source file gets an entry, so
+// that the `#line` directives it contains can be stored with it. Tokens made by the preprocessor, such
+// as the results of `##`, share the entry `MADE_TOKEN_FILE_ID`, and take the location of the tokens
+// they were made from.
+struct token_file {
+    const char* file_name;
+    struct cached_file* cached_file; // Used to find lines quickly. NULL for text that is not a file.
+    struct str_view data;
+    struct line_directive_vec line_directives;
+};
+
+VEC_DEFINE(token_file_vec, struct token_file, PRIVATE)
+
+// Location of the tokens made by the preprocessor from the given offset onwards.
+struct made_token_loc {
+    uint32_t offset;
+    struct file_loc loc;
+};
+
+VEC_DEFINE(made_token_loc_vec, struct made_token_loc, PRIVATE)
+VEC_DEFINE(ident_vec, const char*, PRIVATE)
 VEC_DEFINE(macro_arg_vec, struct macro_arg, PRIVATE)
+VEC_DEFINE(token_vec_vec, struct token_vec, PRIVATE)
+VEC_DEFINE(macro_arg_vec_vec, struct macro_arg_vec, PRIVATE)
+VEC_IMPL(macro_def_vec, struct macro_def, PUBLIC)
 
 static inline uint32_t hash_macro_name(uint32_t h, struct macro* const* macro) {
     return hash_uint64(h, (uint64_t)(*macro)->name);
@@ -124,16 +168,54 @@ static inline bool is_macro_name_equal(struct macro* const* macro, struct macro*
 
 SET_DEFINE(macro_set, struct macro*, hash_macro_name, is_macro_name_equal, PRIVATE)
 
+static inline uint32_t hash_included_file(uint32_t h, struct cached_file* const* cached_file) {
+    return hash_uint64(h, (uintptr_t)*cached_file);
+}
+
+static inline bool are_included_files_equal(struct cached_file* const* cached_file, struct cached_file* const* other) {
+    return *cached_file == *other;
+}
+
+SET_DEFINE(included_file_set, struct cached_file*, hash_included_file, are_included_files_equal, PRIVATE)
+
+static inline uint32_t hash_ident(uint32_t h, const char* const* ident) {
+    return hash_uint64(h, (uintptr_t)*ident);
+}
+
+static inline bool are_idents_equal(const char* const* ident, const char* const* other_ident) {
+    return *ident == *other_ident;
+}
+
+MAP_DEFINE(ident_index_map, const char*, uint32_t, hash_ident, are_idents_equal, PRIVATE)
+
 struct preprocessor {
     struct log* log;
     const char* const* include_paths;
     struct context* context;
     struct macro_set macros;
+    struct mem_pool* mem_pool;
     struct str_pool* str_pool;
-    struct mem_pool mem_pool;
     struct file_cache* file_cache;
     struct cond_stack cond_stack;
     size_t inactive_cond_depth;
+    struct stats* stats;
+    struct cached_file_vec included_files;
+    struct included_file_set included_file_set;
+
+    // Tokens refer to their text with an index in this table. The text of the tokens made by the
+    // preprocessor is stored in `made_text`, where each piece of text is followed by a null
+    // terminator. Identifiers are interned in `idents`, where the index 0 is not used.
+    struct token_file_vec token_files;
+    struct str made_text;
+    struct made_token_loc_vec made_token_locs;
+    struct ident_vec idents;
+    struct ident_index_map ident_indices;
+
+    // Contexts and buffers are recycled instead of being freed, so that expanding a macro does not
+    // need to go through malloc. They are reused in LIFO order, which matches the context stack.
+    struct context* free_contexts;
+    struct token_vec_vec free_token_vecs;
+    struct macro_arg_vec_vec free_macro_arg_vecs;
 };
 
 SMALL_VEC_DEFINE(small_str_view_vec, struct str_view, 4, PRIVATE)
@@ -152,6 +234,117 @@ static inline void free_macro(struct macro* macro) {
     free(macro);
 }
 
+static inline struct str_view token_contents(const struct preprocessor* preprocessor, const struct token* token) {
+    const struct token_file* token_file = &preprocessor->token_files.elems[token->file_id];
+    return (struct str_view) { .data = token_file->data.data + token->offset, .length = token->length };
+}
+
+static inline uint32_t insert_ident(struct preprocessor* preprocessor, struct str_view contents) {
+    const char* ident = str_pool_insert_view(preprocessor->str_pool, contents);
+    const uint32_t* ident_index = ident_index_map_find(&preprocessor->ident_indices, &ident);
+    if (ident_index)
+        return *ident_index;
+    uint32_t new_ident_index = preprocessor->idents.elem_count;
+    ident_vec_push(&preprocessor->idents, &ident);
+    [[maybe_unused]] bool was_inserted = ident_index_map_insert(&preprocessor->ident_indices, &ident, &new_ident_index);
+    assert(was_inserted);
+    return new_ident_index;
+}
+
+static inline const char* intern_ident(struct preprocessor* preprocessor, struct token* token) {
+    assert(token->tag == TOKEN_IDENT);
+    if (!token->ident_index)
+        token->ident_index = insert_ident(preprocessor, token_contents(preprocessor, token));
+    return preprocessor->idents.elems[token->ident_index];
+}
+
+static inline uint16_t add_token_file(struct preprocessor* preprocessor, const struct token_file* token_file) {
+    assert(preprocessor->token_files.elem_count <= UINT16_MAX);
+    assert(token_file->data.length <= UINT32_MAX);
+    token_file_vec_push(&preprocessor->token_files, token_file);
+    return preprocessor->token_files.elem_count - 1;
+}
+
+static struct source_pos find_source_pos(const struct token_file* token_file, size_t offset) {
+    size_t line_begin = 0;
+    struct source_pos line_pos = { .row = 1, .col = 1 };
+    if (token_file->cached_file)
+        line_pos.row = cached_file_find_line(token_file->cached_file, offset, &line_begin);
+    return lexer_advance_source_pos(line_pos, str_view_substr(token_file->data, line_begin, offset - line_begin));
+}
+
+static const struct line_directive* find_line_directive(const struct token_file* token_file, uint32_t offset) {
+    // Directives are sorted by offset, since they are recorded as the file is read.
+    const struct line_directive* line_directives = token_file->line_directives.elems;
+    size_t first = 0, last = token_file->line_directives.elem_count;
+    while (first < last) {
+        size_t middle = first + (last - first) / 2;
+        if (line_directives[middle].offset <= offset)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    return first > 0 ? &line_directives[first - 1] : NULL;
+}
+
+static struct file_loc find_made_token_loc(const struct preprocessor* preprocessor, uint32_t offset) {
+    const struct made_token_loc* made_token_locs = preprocessor->made_token_locs.elems;
+    size_t first = 0, last = preprocessor->made_token_locs.elem_count;
+    while (first < last) {
+        size_t middle = first + (last - first) / 2;
+        if (made_token_locs[middle].offset <= offset)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    return first > 0 ? made_token_locs[first - 1].loc : (struct file_loc) {};
+}
+
+static struct file_loc find_token_loc(const struct preprocessor* preprocessor, const struct token* token) {
+    if (token->file_id == MADE_TOKEN_FILE_ID)
+        return find_made_token_loc(preprocessor, token->offset);
+
+    const struct token_file* token_file = &preprocessor->token_files.elems[token->file_id];
+    struct file_loc loc = {
+        .file_name = token_file->file_name,
+        .begin = find_source_pos(token_file, token->offset)
+    };
+    loc.end = lexer_advance_source_pos(loc.begin, token_contents(preprocessor, token));
+    const struct line_directive* line_directive = find_line_directive(token_file, token->offset);
+    if (line_directive) {
+        loc.displayed_file_name = line_directive->displayed_file_name;
+        loc.displayed_line = line_directive->displayed_line + (loc.begin.row - line_directive->row);
+    }
+    return loc;
+}
+
+// Stores the text of tokens made by the preprocessor, which are shown at the given location. The text
+// must not point into the text of other made tokens, since storing it may move them. Returns the
+// offset of the text.
+static uint32_t add_made_text(struct preprocessor* preprocessor, struct str_view text, const struct file_loc* loc) {
+    uint32_t offset = preprocessor->made_text.length;
+    assert(offset + text.length < UINT32_MAX);
+    str_append(&preprocessor->made_text, text);
+    str_push(&preprocessor->made_text, '\0');
+    preprocessor->token_files.elems[MADE_TOKEN_FILE_ID].data = str_to_view(&preprocessor->made_text);
+    made_token_loc_vec_push(&preprocessor->made_token_locs, &(struct made_token_loc) { .offset = offset, .loc = *loc });
+    return offset;
+}
+
+static inline struct token make_token(
+    struct preprocessor* preprocessor,
+    enum token_tag tag,
+    struct str_view contents,
+    const struct file_loc* loc)
+{
+    return (struct token) {
+        .tag = tag,
+        .file_id = MADE_TOKEN_FILE_ID,
+        .offset = add_made_text(preprocessor, contents, loc),
+        .length = contents.length
+    };
+}
+
 static inline struct macro* find_macro(struct preprocessor* preprocessor, const char* name) {
     struct macro* macro_ptr = &(struct macro) { .name = name };
     struct macro* const* macro = macro_set_find(&preprocessor->macros, &macro_ptr);
@@ -173,8 +366,53 @@ static inline void insert_macro(struct preprocessor* preprocessor, const struct
     }
 }
 
-static inline struct context* alloc_context(struct context* prev, enum context_tag tag) {
-    struct context* context = xcalloc(1, sizeof(struct context));
+static inline void count_avoided_allocation(struct preprocessor* preprocessor) {
+    if (preprocessor->stats)
+        preprocessor->stats->counters[COUNTER_ALLOCATIONS_AVOIDED]++;
+}
+
+static inline struct token_vec alloc_token_vec(struct preprocessor* preprocessor) {
+    if (token_vec_vec_is_empty(&preprocessor->free_token_vecs))
+        return token_vec_create();
+    struct token_vec tokens = *token_vec_vec_last(&preprocessor->free_token_vecs);
+    token_vec_vec_pop(&preprocessor->free_token_vecs);
+    token_vec_clear(&tokens);
+    count_avoided_allocation(preprocessor);
+    return tokens;
+}
+
+static inline void free_token_vec(struct preprocessor* preprocessor, struct token_vec* tokens) {
+    // Empty vectors do not own any memory, so there is nothing to recycle.
+    if (tokens->capacity > 0)
+        token_vec_vec_push(&preprocessor->free_token_vecs, tokens);
+    memset(tokens, 0, sizeof(struct token_vec));
+}
+
+static inline struct macro_arg_vec alloc_macro_arg_vec(struct preprocessor* preprocessor) {
+    if (macro_arg_vec_vec_is_empty(&preprocessor->free_macro_arg_vecs))
+        return macro_arg_vec_create();
+    struct macro_arg_vec macro_args = *macro_arg_vec_vec_last(&preprocessor->free_macro_arg_vecs);
+    macro_arg_vec_vec_pop(&preprocessor->free_macro_arg_vecs);
+    macro_arg_vec_clear(&macro_args);
+    count_avoided_allocation(preprocessor);
+    return macro_args;
+}
+
+static inline void free_macro_arg_vec(struct preprocessor* preprocessor, struct macro_arg_vec* macro_args) {
+    if (macro_args->capacity > 0)
+        macro_arg_vec_vec_push(&preprocessor->free_macro_arg_vecs, macro_args);
+    memset(macro_args, 0, sizeof(struct macro_arg_vec));
+}
+
+static inline struct context* alloc_context(struct preprocessor* preprocessor, struct context* prev, enum context_tag tag) {
+    struct context* context = preprocessor->free_contexts;
+    if (context) {
+        preprocessor->free_contexts = context->prev;
+        memset(context, 0, sizeof(struct context));
+        count_avoided_allocation(preprocessor);
+    } else {
+        context = xcalloc(1, sizeof(struct context));
+    }
     context->tag = tag;
     context->prev = prev;
     context->is_active = true;
@@ -188,8 +426,7 @@ static inline void advance_context(struct context* context) {
     struct token token = { .tag = TOKEN_EOF };
     if (context->tag == CONTEXT_SOURCE_FILE) {
         token = lexer_advance(&context->source_file.lexer);
-        token.loc.displayed_file_name = context->source_file.displayed_file_name;
-        token.loc.displayed_line = context->source_file.displayed_line;
+        context->source_file.lexed_token_count++;
     } else if (context->tag == CONTEXT_TOKEN_BUFFER) {
         if (context->token_buffer.token_index < context->token_buffer.tokens.elem_count)
             token = context->token_buffer.tokens.elems[context->token_buffer.token_index++];
@@ -209,10 +446,20 @@ static inline void finalize_context(struct context* context) {
         advance_context(context);
 }
 
-static inline struct context* alloc_source_file_context(struct cached_file* cached_file, struct context* prev) {
-    struct context* context = alloc_context(prev, CONTEXT_SOURCE_FILE);
+static inline struct context* alloc_source_file_context(
+    struct preprocessor* preprocessor,
+    struct cached_file* cached_file,
+    struct context* prev)
+{
+    uint16_t file_id = add_token_file(preprocessor, &(struct token_file) {
+        .file_name = cached_file->file_name,
+        .cached_file = cached_file,
+        .data = cached_file->file_data,
+        .line_directives = line_directive_vec_create()
+    });
+    struct context* context = alloc_context(preprocessor, prev, CONTEXT_SOURCE_FILE);
     context->source_file.cond_stack.conds = cond_vec_create();
-    context->source_file.lexer = lexer_create(cached_file->file_name, cached_file->file_data);
+    context->source_file.lexer = lexer_create(file_id, cached_file->file_data);
     context->source_file.cached_file = cached_file;
     context->source_file.displayed_file_name = cached_file->file_name;
     context->source_file.displayed_line = 1;
@@ -220,31 +467,69 @@ static inline struct context* alloc_source_file_context(struct cached_file* cach
     return context;
 }
 
-static inline struct context* alloc_token_buffer_context(struct context* prev) {
-    struct context* context = alloc_context(prev, CONTEXT_TOKEN_BUFFER);
+// Skips lines of an inactive block without lexing them, right after the new line token that ends the
+// previous line has been read. The context is left in the same state as if the skipped lines had been
+// read token by token.
+static inline void skip_inactive_lines(struct context* context, const struct token* new_line) {
+    assert(context->tag == CONTEXT_SOURCE_FILE && !context->is_active);
+    struct source_file* source_file = &context->source_file;
+    struct lexer lexer = source_file->lexer;
+    lexer.bytes_read = new_line->offset + new_line->length;
+    lexer.on_new_line = true;
+    const size_t line_count = lexer_skip_inactive_lines(&lexer);
+    if (line_count == 0)
+        return;
+
+    // The tokens in the lookahead buffer are lexed again. New lines are only counted once they reach
+    // the front of the buffer, so the last skipped one is counted by shifting it through the buffer.
+    static_assert(TOKENS_AHEAD == 2);
+    source_file->lexer = lexer;
+    source_file->displayed_line += line_count - 1;
+    if (context->ahead[0].tag == TOKEN_NL)
+        source_file->displayed_line--;
+    context->ahead[0] = (struct token) { .tag = TOKEN_ERROR, .error = TOKEN_ERROR_INVALID };
+    context->ahead[1] = (struct token) { .tag = TOKEN_NL };
+    for (int i = 0; i < TOKENS_AHEAD; ++i)
+        advance_context(context);
+}
+
+static inline void record_included_file(struct preprocessor* preprocessor, struct cached_file* cached_file) {
+    if (included_file_set_insert(&preprocessor->included_file_set, &cached_file))
+        cached_file_vec_push(&preprocessor->included_files, &cached_file);
+}
+
+static inline struct context* alloc_token_buffer_context(struct preprocessor* preprocessor, struct context* prev) {
+    struct context* context = alloc_context(preprocessor, prev, CONTEXT_TOKEN_BUFFER);
     context->tag = CONTEXT_TOKEN_BUFFER;
-    context->token_buffer.tokens = token_vec_create();
+    context->token_buffer.tokens = alloc_token_vec(preprocessor);
     return context;
 }
 
-static inline struct context* alloc_expanded_macro_context(struct context* prev, struct macro* macro) {
-    struct context* context = alloc_token_buffer_context(prev);
+static inline struct context* alloc_expanded_macro_context(
+    struct preprocessor* preprocessor,
+    struct context* prev,
+    struct macro* macro)
+{
+    struct context* context = alloc_token_buffer_context(preprocessor, prev);
     context->macro = macro;
     return context;
 }
 
-static inline void free_context(struct context* context) {
+static inline void free_context(struct preprocessor* preprocessor, struct context* context) {
     if (context->tag == CONTEXT_SOURCE_FILE) {
         cond_vec_destroy(&context->source_file.cond_stack.conds);
     } else if (context->tag == CONTEXT_TOKEN_BUFFER) {
-        token_vec_destroy(&context->token_buffer.tokens);
+        free_token_vec(preprocessor, &context->token_buffer.tokens);
     } else {
         assert(false && "invalid context");
     }
-    free(context);
+    context->prev = preprocessor->free_contexts;
+    preprocessor->free_contexts = context;
 }
 
 static inline void push_context(struct preprocessor* preprocessor, struct context* context) {
+    if (preprocessor->stats)
+        preprocessor->stats->counters[COUNTER_CONTEXTS_PUSHED]++;
     if (context->macro)
         context->macro->is_disabled = true;
     context->prev = preprocessor->context;
@@ -260,14 +545,34 @@ static inline struct cond* find_last_cond(const struct context* context) {
 static inline struct context* pop_context(struct preprocessor* preprocessor) {
     assert(preprocessor->context);
     struct cond* last_cond = find_last_cond(preprocessor->context);
-    if (last_cond)
-        log_error(preprocessor->log, &last_cond->loc, "unterminated '#if'");
+    if (last_cond) {
+        struct file_loc loc = find_token_loc(preprocessor, &last_cond->token);
+        log_error(preprocessor->log, &loc, "unterminated '#if'");
+    }
 
     if (preprocessor->context->macro)
         preprocessor->context->macro->is_disabled = false;
 
+    // The guard is only recorded if the whole file was read.
+    if (preprocessor->context->tag == CONTEXT_SOURCE_FILE &&
+        preprocessor->context->source_file.include_guard_state == INCLUDE_GUARD_CLOSED &&
+        preprocessor->context->ahead[0].tag == TOKEN_EOF)
+    {
+        const struct source_file* source_file = &preprocessor->context->source_file;
+        source_file->cached_file->include_guard = source_file->include_guard;
+    }
+
+    if (preprocessor->stats && preprocessor->context->tag == CONTEXT_SOURCE_FILE) {
+        const struct source_file* source_file = &preprocessor->context->source_file;
+        preprocessor->stats->counters[COUNTER_TOKENS_LEXED] += source_file->lexed_token_count;
+        if (preprocessor->stats->trace && preprocessor->context->prev) {
+            trace_add_event(preprocessor->stats->trace, TRACE_TRACK_PREPROCESSOR, "include",
+                source_file->cached_file->file_name, source_file->include_time, stats_time());
+        }
+    }
+
     struct context* prev_context = preprocessor->context->prev;
-    free_context(preprocessor->context);
+    free_context(preprocessor, preprocessor->context);
     return preprocessor->context = prev_context;
 }
 
@@ -314,8 +619,9 @@ static inline bool accept_token(struct preprocessor* preprocessor, enum token_ta
 static inline bool expect_token(struct preprocessor* preprocessor, enum token_tag tag) {
     if (!accept_token(preprocessor, tag)) {
         struct token token = peek_token(preprocessor);
-        struct str_view contents = token_printable_contents(&token);
-        log_error(preprocessor->log, &token.loc,
+        struct str_view contents = token_printable_contents(token.tag, token_contents(preprocessor, &token));
+        struct file_loc loc = find_token_loc(preprocessor, &token);
+        log_error(preprocessor->log, &loc,
             "expected '%s', but got '%.*s'",
             token_tag_to_string(tag),
             (int)contents.length, contents.data);
@@ -324,16 +630,16 @@ static inline bool expect_token(struct preprocessor* preprocessor, enum token_ta
     return true;
 }
 
-static inline struct macro_arg macro_arg_create(void) {
+static inline struct macro_arg macro_arg_create(struct preprocessor* preprocessor) {
     return (struct macro_arg) {
-        .expanded_tokens = token_vec_create(),
-        .unexpanded_tokens = token_vec_create()
+        .expanded_tokens = alloc_token_vec(preprocessor),
+        .unexpanded_tokens = alloc_token_vec(preprocessor)
     };
 }
 
-static inline void macro_arg_destroy(struct macro_arg* macro_arg) {
-    token_vec_destroy(&macro_arg->expanded_tokens);
-    token_vec_destroy(&macro_arg->unexpanded_tokens);
+static inline void macro_arg_destroy(struct preprocessor* preprocessor, struct macro_arg* macro_arg) {
+    free_token_vec(preprocessor, &macro_arg->expanded_tokens);
+    free_token_vec(preprocessor, &macro_arg->unexpanded_tokens);
     memset(macro_arg, 0, sizeof(struct macro_arg));
 }
 
@@ -343,7 +649,7 @@ static const struct token_vec* expand_macro_arg(struct preprocessor* preprocesso
 
     // Push a context with all the tokens of the macro argument on it, and then expand every token
     // from that context, to get the fully expanded tokens of the macro argument.
-    struct context* context = alloc_token_buffer_context(preprocessor->context);
+    struct context* context = alloc_token_buffer_context(preprocessor, preprocessor->context);
     VEC_FOREACH(struct token, token, macro_arg->unexpanded_tokens)
         token_vec_push(&context->token_buffer.tokens, token);
     token_vec_push(&context->token_buffer.tokens, &(struct token) { .tag = TOKEN_STOP_EXPAND });
@@ -361,58 +667,55 @@ static const struct token_vec* expand_macro_arg(struct preprocessor* preprocesso
     return &macro_arg->expanded_tokens;
 }
 
-static inline struct token make_string_literal_token(struct str_view contents, const struct file_loc* loc) {
-    return (struct token) {
-        .tag = TOKEN_STRING_LITERAL,
-        .loc = *loc,
-        .contents = contents,
-        .string_literal = str_view_shrink(contents, 1, 1)
-    };
-}
-
 static struct token stringify_macro_arg(struct preprocessor* preprocessor, struct macro_arg* macro_arg) {
     struct str str = str_create();
     str_push(&str, '\"');
     for (size_t i = 0; i < macro_arg->unexpanded_tokens.elem_count; ++i) {
-        struct token token = macro_arg->unexpanded_tokens.elems[i];
-        if (token.has_space_before && i > 0)
+        const struct token* token = &macro_arg->unexpanded_tokens.elems[i];
+        if (token->has_space_before && i > 0)
             str_push(&str, ' ');
-        if (token.tag == TOKEN_STRING_LITERAL) {
+        if (token->tag == TOKEN_STRING_LITERAL) {
             str_append(&str, STR_VIEW("\\\""));
-            str_append(&str, str_view_shrink(token.contents, 1, 1));
+            str_append(&str, token_string_literal(token_contents(preprocessor, token)));
             str_append(&str, STR_VIEW("\\\""));
         } else {
-            str_append(&str, token.contents);
+            str_append(&str, token_contents(preprocessor, token));
         }
     }
     str_push(&str, '\"');
-    const char* contents = str_pool_insert_view(preprocessor->str_pool, str_to_view(&str));
+    struct file_loc loc = find_token_loc(preprocessor, &macro_arg->first_token);
+    struct token token = make_token(preprocessor, TOKEN_STRING_LITERAL, str_to_view(&str), &loc);
     str_destroy(&str);
-
-    return make_string_literal_token(STR_VIEW(contents), &macro_arg->loc);
+    return token;
 }
 
 static inline struct token concatenate_tokens(
     struct preprocessor* preprocessor,
     const struct token* left_token,
     const struct token* right_token,
-    const struct file_loc* concat_loc)
+    const struct token* concat_token)
 {
     struct str concat_str = str_create();
-    str_append(&concat_str, left_token->contents);
-    str_append(&concat_str, right_token->contents);
-    const char* lexer_data = str_pool_insert_view(preprocessor->str_pool, str_to_view(&concat_str));
+    str_append(&concat_str, token_contents(preprocessor, left_token));
+    str_append(&concat_str, token_contents(preprocessor, right_token));
+    struct file_loc concat_loc = find_token_loc(preprocessor, concat_token);
+    uint32_t offset = add_made_text(preprocessor, str_to_view(&concat_str), &concat_loc);
+    size_t end = offset + concat_str.length;
     str_destroy(&concat_str);
 
-    struct lexer lexer = lexer_create(concat_loc->file_name, STR_VIEW(lexer_data));
+    // The result is lexed in place, so that it takes the location of the concatenation operator.
+    struct lexer lexer = lexer_create(MADE_TOKEN_FILE_ID, str_view_substr(str_to_view(&preprocessor->made_text), 0, end));
+    lexer.bytes_read = offset;
     struct token first_token = lexer_advance(&lexer);
     struct token next_token = lexer_advance(&lexer);
     if (first_token.tag == TOKEN_ERROR || next_token.tag != TOKEN_EOF) {
-        log_error(preprocessor->log, &left_token->loc, "cannot concatenate '%.*s' and '%.*s'",
-            (int)left_token ->contents.length, left_token ->contents.data,
-            (int)right_token->contents.length, right_token->contents.data);
+        struct str_view left_contents  = token_contents(preprocessor, left_token);
+        struct str_view right_contents = token_contents(preprocessor, right_token);
+        struct file_loc loc = find_token_loc(preprocessor, left_token);
+        log_error(preprocessor->log, &loc, "cannot concatenate '%.*s' and '%.*s'",
+            (int)left_contents .length, left_contents .data,
+            (int)right_contents.length, right_contents.data);
     }
-    first_token.loc = *concat_loc;
     return first_token;
 }
 
@@ -420,7 +723,7 @@ static inline bool parse_macro_args(
     struct preprocessor* preprocessor,
     const struct macro* macro,
     struct macro_arg_vec* macro_args,
-    const struct file_loc* loc)
+    const struct token* macro_token)
 {
     if (!macro->has_params)
         return true;
@@ -434,14 +737,15 @@ static inline bool parse_macro_args(
 
         // Allocate a macro argument, if there is not one already.
         if (!last_arg) {
-            struct macro_arg macro_arg = macro_arg_create();
+            struct macro_arg macro_arg = macro_arg_create(preprocessor);
             macro_arg_vec_push(macro_args, &macro_arg);
             last_arg = macro_arg_vec_last(macro_args);
-            last_arg->loc = token.loc;
+            last_arg->first_token = token;
         }
 
         if (token.tag == TOKEN_EOF) {
-            log_error(preprocessor->log, &token.loc, "unterminated argument list for macro '%s'", macro->name);
+            struct file_loc loc = find_token_loc(preprocessor, &token);
+            log_error(preprocessor->log, &loc, "unterminated argument list for macro '%s'", macro->name);
             return false;
         } else if (token.tag == TOKEN_RPAREN) {
             if (paren_depth == 0)
@@ -461,7 +765,8 @@ static inline bool parse_macro_args(
     }
 
     if (macro->param_count > macro_args->elem_count || (!macro->is_variadic && macro->param_count != macro_args->elem_count)) {
-        log_error(preprocessor->log, loc, "expected %zu argument(s) to macro '%s', but got %zu",
+        struct file_loc loc = find_token_loc(preprocessor, macro_token);
+        log_error(preprocessor->log, &loc, "expected %zu argument(s) to macro '%s', but got %zu",
             macro->param_count, macro->name, macro_args->elem_count);
         return false;
     }
@@ -472,14 +777,13 @@ static inline struct context* expand_macro_with_args(
     struct preprocessor* preprocessor,
     struct macro* macro,
     struct macro_arg* args,
-    size_t arg_count,
-    [[maybe_unused]] const struct file_loc* loc)
+    size_t arg_count)
 {
     assert(macro->param_count == arg_count || (arg_count >= macro->param_count && macro->is_variadic));
     bool should_concat_left = false;
-    struct file_loc concat_loc = {};
+    struct token concat_token = {};
 
-    struct context* context = alloc_expanded_macro_context(preprocessor->context, macro);
+    struct context* context = alloc_expanded_macro_context(preprocessor, preprocessor->context, macro);
     for (size_t i = 0; i < macro->tokens.elem_count; ++i) {
         struct token macro_token = macro->tokens.elems[i];
         const struct token* expanded_tokens = &macro_token;
@@ -499,7 +803,7 @@ static inline struct context* expand_macro_with_args(
             num_expanded_tokens = arg_tokens->elem_count;
         } else if (macro_token.tag == TOKEN_CONCAT) {
             should_concat_left = true;
-            concat_loc = macro_token.loc;
+            concat_token = macro_token;
             continue;
         } else if (macro_token.tag == TOKEN_HASH) {
             assert(i + 1 < macro->tokens.elem_count);
@@ -512,7 +816,7 @@ static inline struct context* expand_macro_with_args(
             // if argument expansion produced no token on either side.
             if (num_expanded_tokens > 0 && !token_vec_is_empty(&context->token_buffer.tokens)) {
                 struct token* last_token = token_vec_last(&context->token_buffer.tokens);
-                *last_token = concatenate_tokens(preprocessor, last_token, &expanded_tokens[0], &concat_loc);
+                *last_token = concatenate_tokens(preprocessor, last_token, &expanded_tokens[0], &concat_token);
                 expanded_tokens++;
                 num_expanded_tokens--;
             }
@@ -530,16 +834,16 @@ static inline struct context* expand_macro_with_args(
 static inline struct context* expand_macro(
     struct preprocessor* preprocessor,
     struct macro* macro,
-    const struct file_loc* loc)
+    const struct token* macro_token)
 {
     struct context* context = NULL;
-    struct macro_arg_vec macro_args = macro_arg_vec_create();
-    if (parse_macro_args(preprocessor, macro, &macro_args, loc))
-        context = expand_macro_with_args(preprocessor, macro, macro_args.elems, macro_args.elem_count, loc);
+    struct macro_arg_vec macro_args = alloc_macro_arg_vec(preprocessor);
+    if (parse_macro_args(preprocessor, macro, &macro_args, macro_token))
+        context = expand_macro_with_args(preprocessor, macro, macro_args.elems, macro_args.elem_count);
 
     VEC_FOREACH(struct macro_arg, macro_arg, macro_args)
-        macro_arg_destroy(macro_arg);
-    macro_arg_vec_destroy(&macro_args);
+        macro_arg_destroy(preprocessor, macro_arg);
+    free_macro_arg_vec(preprocessor, &macro_args);
     return context;
 }
 
@@ -549,11 +853,7 @@ static struct token expand_token(struct preprocessor* preprocessor) {
         if (token.tag != TOKEN_IDENT || !preprocessor->context->is_active)
             return token;
 
-        const char* ident = str_pool_find_view(preprocessor->str_pool, token.contents);
-        if (!ident)
-            return token;
-
-        struct macro* macro = find_macro(preprocessor, ident);
+        struct macro* macro = find_macro(preprocessor, intern_ident(preprocessor, &token));
         if (!macro || macro->is_disabled)
             return token;
 
@@ -561,10 +861,13 @@ static struct token expand_token(struct preprocessor* preprocessor) {
         if (macro->has_params && !has_args)
             return token;
 
+        if (preprocessor->stats)
+            preprocessor->stats->counters[COUNTER_MACROS_EXPANDED]++;
+
         if (macro->callback) {
-            macro->callback(preprocessor, &token.loc);
+            macro->callback(preprocessor, &token);
         } else {
-            struct context* context = expand_macro(preprocessor, macro, &token.loc);
+            struct context* context = expand_macro(preprocessor, macro, &token);
             if (context)
                 push_context(preprocessor, context);
         }
@@ -572,25 +875,29 @@ static struct token expand_token(struct preprocessor* preprocessor) {
 }
 
 static inline enum directive directive_from_string(struct str_view string) {
-#define x(name, str) if (str_view_is_equal(&string, &STR_VIEW(str))) return DIRECTIVE_##name;
-    DIRECTIVE_LIST(x)
-#undef x
-    return DIRECTIVE_NONE;
+    const struct directive_entry* entry = &directive_table[hash_directive(string)];
+    return entry->name.length == string.length && !memcmp(entry->name.data, string.data, string.length)
+        ? entry->directive : DIRECTIVE_NONE;
 }
 
 static inline struct file_loc eat_extra_tokens(struct preprocessor* preprocessor, const char* directive_name) {
-    struct file_loc loc;
+    struct token first_token = {}, last_token = {};
     bool has_extra_tokens = false;
     while (true) {
         struct token token = read_token(preprocessor);
         if (token.tag == TOKEN_NL || token.tag == TOKEN_EOF)
             break;
         if (!has_extra_tokens)
-            loc = token.loc;
-        loc.end = token.loc.end;
+            first_token = token;
+        last_token = token;
         has_extra_tokens = true;
     }
-    if (directive_name && has_extra_tokens)
+    if (!has_extra_tokens)
+        return (struct file_loc) {};
+
+    struct file_loc loc = find_token_loc(preprocessor, &first_token);
+    loc.end = find_token_loc(preprocessor, &last_token).end;
+    if (directive_name)
         log_error(preprocessor->log, &loc, "extra tokens after '#%s'", directive_name);
     return loc;
 }
@@ -603,36 +910,32 @@ static inline struct source_file* find_containing_source_file(struct context* co
     return &context->source_file;
 }
 
-static void expand_file_macro(struct preprocessor* preprocessor, struct file_loc* loc) {
+static void expand_file_macro(struct preprocessor* preprocessor, const struct token* macro_token) {
     struct source_file* source_file = find_containing_source_file(preprocessor->context);
-    struct context* context = alloc_token_buffer_context(preprocessor->context);
+    struct context* context = alloc_token_buffer_context(preprocessor, preprocessor->context);
 
     struct str file_str = str_create();
     str_printf(&file_str, "\"%s\"", source_file->displayed_file_name);
-    const char* file_string = str_pool_insert(preprocessor->str_pool, file_str.data);
+    struct file_loc loc = find_token_loc(preprocessor, macro_token);
+    struct token file_token = make_token(preprocessor, TOKEN_STRING_LITERAL, str_to_view(&file_str), &loc);
     str_destroy(&file_str);
 
-    struct token file_token = make_string_literal_token(STR_VIEW(file_string), loc);
     token_vec_push(&context->token_buffer.tokens, &file_token);
     finalize_context(context);
     push_context(preprocessor, context);
 }
 
-static void expand_line_macro(struct preprocessor* preprocessor, struct file_loc* loc) {
+static void expand_line_macro(struct preprocessor* preprocessor, const struct token* macro_token) {
     struct source_file* source_file = find_containing_source_file(preprocessor->context);
-    struct context* context = alloc_token_buffer_context(preprocessor->context);
+    struct context* context = alloc_token_buffer_context(preprocessor, preprocessor->context);
 
+    // The value of the literal is parsed from its contents when needed.
     struct str line_str = str_create();
-    str_printf(&line_str, "\"%"PRIu32"\"", source_file->displayed_line);
-    const char* line_string = str_pool_insert(preprocessor->str_pool, line_str.data);
+    str_printf(&line_str, "%"PRIu32, source_file->displayed_line);
+    struct file_loc loc = find_token_loc(preprocessor, macro_token);
+    struct token line_token = make_token(preprocessor, TOKEN_INT_LITERAL, str_to_view(&line_str), &loc);
     str_destroy(&line_str);
 
-    struct token line_token = {
-        .tag = TOKEN_INT_LITERAL,
-        .loc = *loc,
-        .contents = STR_VIEW(line_string),
-        .int_literal = source_file->displayed_line
-    };
     token_vec_push(&context->token_buffer.tokens, &line_token);
     finalize_context(context);
     push_context(preprocessor, context);
@@ -655,10 +958,12 @@ static void register_standard_macros(struct preprocessor* preprocessor) {
 }
 
 struct preprocessor* preprocessor_open(
+    struct mem_pool* mem_pool,
     struct log* log,
     struct file_cache* file_cache,
     const char* file_name,
-    const char* const* include_paths)
+    const char* const* include_paths,
+    struct stats* stats)
 {
     struct cached_file* cached_file = file_cache_read(file_cache, file_name);
     if (!cached_file)
@@ -671,13 +976,35 @@ struct preprocessor* preprocessor_open(
     preprocessor->context = NULL;
     preprocessor->file_cache = file_cache;
     preprocessor->include_paths = include_paths;
+    preprocessor->stats = stats;
     preprocessor->macros = macro_set_create();
-    preprocessor->mem_pool = mem_pool_create();
-    preprocessor->str_pool = str_pool_create(&preprocessor->mem_pool);
+    preprocessor->mem_pool = mem_pool;
+    preprocessor->str_pool = str_pool_create(mem_pool);
+    preprocessor->included_files = cached_file_vec_create();
+    preprocessor->included_file_set = included_file_set_create();
+    preprocessor->free_contexts = NULL;
+    preprocessor->free_token_vecs = token_vec_vec_create();
+    preprocessor->free_macro_arg_vecs = macro_arg_vec_vec_create();
+    preprocessor->token_files = token_file_vec_create();
+    preprocessor->made_text = str_create();
+    preprocessor->made_token_locs = made_token_loc_vec_create();
+    preprocessor->idents = ident_vec_create();
+    preprocessor->ident_indices = ident_index_map_create();
+
+    // The text of made tokens starts with an empty string, so that the contents of tokens never start
+    // from a null pointer, and so that tokens that are not made from any text, such as the ones that
+    // end a macro expansion, have no location.
+    str_push(&preprocessor->made_text, '\0');
+    [[maybe_unused]] uint16_t made_token_file_id = add_token_file(preprocessor, &(struct token_file) {
+        .data = str_to_view(&preprocessor->made_text)
+    });
+    assert(made_token_file_id == MADE_TOKEN_FILE_ID);
+    ident_vec_push(&preprocessor->idents, &(const char*) { NULL });
 
     register_standard_macros(preprocessor);
 
-    push_context(preprocessor, alloc_source_file_context(cached_file, NULL));
+    record_included_file(preprocessor, cached_file);
+    push_context(preprocessor, alloc_source_file_context(preprocessor, cached_file, NULL));
     return preprocessor;
 }
 
@@ -688,13 +1015,38 @@ void preprocessor_close(struct preprocessor* preprocessor) {
         free_macro(*macro);
     }
     macro_set_destroy(&preprocessor->macros);
+    while (preprocessor->free_contexts) {
+        struct context* next = preprocessor->free_contexts->prev;
+        free(preprocessor->free_contexts);
+        preprocessor->free_contexts = next;
+    }
+    VEC_FOREACH(struct token_vec, tokens, preprocessor->free_token_vecs) {
+        token_vec_destroy(tokens);
+    }
+    VEC_FOREACH(struct macro_arg_vec, macro_args, preprocessor->free_macro_arg_vecs) {
+        macro_arg_vec_destroy(macro_args);
+    }
+    token_vec_vec_destroy(&preprocessor->free_token_vecs);
+    macro_arg_vec_vec_destroy(&preprocessor->free_macro_arg_vecs);
+    VEC_FOREACH(struct token_file, token_file, preprocessor->token_files) {
+        line_directive_vec_destroy(&token_file->line_directives);
+    }
+    token_file_vec_destroy(&preprocessor->token_files);
+    str_destroy(&preprocessor->made_text);
+    made_token_loc_vec_destroy(&preprocessor->made_token_locs);
+    ident_vec_destroy(&preprocessor->idents);
+    ident_index_map_destroy(&preprocessor->ident_indices);
+    included_file_set_destroy(&preprocessor->included_file_set);
+    cached_file_vec_destroy(&preprocessor->included_files);
     str_pool_destroy(preprocessor->str_pool);
-    mem_pool_destroy(&preprocessor->mem_pool);
     free(preprocessor);
 }
 
 static const char* parse_ident(struct preprocessor* preprocessor) {
-    const char* ident = str_pool_insert_view(preprocessor->str_pool, peek_token(preprocessor).contents);
+    struct token token = peek_token(preprocessor);
+    const char* ident = token.tag == TOKEN_IDENT
+        ? intern_ident(preprocessor, &token)
+        : str_pool_insert_view(preprocessor->str_pool, token_contents(preprocessor, &token));
     expect_token(preprocessor, TOKEN_IDENT);
     return ident;
 }
@@ -703,7 +1055,7 @@ static int parse_primary_cond(struct preprocessor* preprocessor, bool should_eva
     struct token token = expand_token(preprocessor);
     switch (token.tag) {
         case TOKEN_INT_LITERAL:
-            return token.int_literal;
+            return token_int_literal(token_contents(preprocessor, &token));
         case TOKEN_TRUE:
             return 1;
         case TOKEN_FALSE:
@@ -713,8 +1065,9 @@ static int parse_primary_cond(struct preprocessor* preprocessor, bool should_eva
             expect_token(preprocessor, TOKEN_RPAREN);
             return cond;
         }
-        case TOKEN_IDENT:
-            if (str_view_is_equal(&token.contents, &STR_VIEW("defined"))) {
+        case TOKEN_IDENT: {
+            struct str_view contents = token_contents(preprocessor, &token);
+            if (str_view_is_equal(&contents, &STR_VIEW("defined"))) {
                 bool has_paren = accept_token(preprocessor, TOKEN_LPAREN);
                 const char* ident = parse_ident(preprocessor);
                 if (has_paren)
@@ -722,11 +1075,13 @@ static int parse_primary_cond(struct preprocessor* preprocessor, bool should_eva
                 return should_eval && find_macro(preprocessor, ident) ? 1 : 0;
             }
             return 0;
-        default:
-            log_error(preprocessor->log, &token.loc,
-                "expected condition, but got '%.*s'",
-                (int)token.contents.length, token.contents.data);
+        }
+        default: {
+            struct str_view contents = token_contents(preprocessor, &token);
+            struct file_loc loc = find_token_loc(preprocessor, &token);
+            log_error(preprocessor->log, &loc, "expected condition, but got '%.*s'", (int)contents.length, contents.data);
             return 0;
+        }
     }
 }
 
@@ -799,7 +1154,8 @@ static inline int parse_binary_cond(struct preprocessor* preprocessor, int left,
                     case BINARY_EXPR_DIV:
                     case BINARY_EXPR_REM:
                         if (right == 0) {
-                            log_error(preprocessor->log, &token.loc, "division by zero while evaluating condition");
+                            struct file_loc loc = find_token_loc(preprocessor, &token);
+                            log_error(preprocessor->log, &loc, "division by zero while evaluating condition");
                             right = 1;
                         }
                         left = tag == BINARY_EXPR_DIV ? left / right : left % right;
@@ -855,7 +1211,7 @@ static void enter_if(
     struct preprocessor* preprocessor,
     const char* directive_name,
     enum cond_value cond_value,
-    struct file_loc* loc)
+    const struct token* directive_token)
 {
     assert(preprocessor->context->tag == CONTEXT_SOURCE_FILE);
     if (!preprocessor->context->is_active) {
@@ -867,7 +1223,7 @@ static void enter_if(
     const bool is_active = eval_cond(preprocessor, cond_value);
     cond_vec_push(
         &preprocessor->context->source_file.cond_stack.conds,
-        &(struct cond) { .was_active = is_active, .loc = *loc });
+        &(struct cond) { .was_active = is_active, .token = *directive_token });
 
     preprocessor->context->is_active &= is_active;
     eat_extra_tokens(preprocessor, directive_name);
@@ -877,7 +1233,7 @@ static inline void enter_elif(
     struct preprocessor* preprocessor,
     const char* directive_name,
     enum cond_value cond_value,
-    struct file_loc* loc)
+    const struct token* directive_token)
 {
     assert(preprocessor->context->tag == CONTEXT_SOURCE_FILE);
     if (preprocessor->context->source_file.cond_stack.inactive_cond_depth > 0) {
@@ -888,8 +1244,10 @@ static inline void enter_elif(
     struct cond* last_cond = find_last_cond(preprocessor->context);
     assert(last_cond);
 
-    if (last_cond->was_last_else)
-        log_error(preprocessor->log, loc, "'#%s' after '#else'", directive_name);
+    if (last_cond->was_last_else) {
+        struct file_loc loc = find_token_loc(preprocessor, directive_token);
+        log_error(preprocessor->log, &loc, "'#%s' after '#else'", directive_name);
+    }
 
     const bool is_active = eval_cond(preprocessor, cond_value) & !last_cond->was_active;
     last_cond->was_active |= is_active;
@@ -901,30 +1259,31 @@ static inline void enter_elif(
 static inline bool error_on_empty_cond_stack(
     struct preprocessor* preprocessor,
     const char* directive_name,
-    struct file_loc* loc)
+    const struct token* directive_token)
 {
     if (!find_last_cond(preprocessor->context)) {
-        log_error(preprocessor->log, loc, "'#%s' without '#if'", directive_name);
+        struct file_loc loc = find_token_loc(preprocessor, directive_token);
+        log_error(preprocessor->log, &loc, "'#%s' without '#if'", directive_name);
         return true;
     }
     return false;
 }
 
-static void parse_if(struct preprocessor* preprocessor, struct file_loc* loc) {
-    enter_if(preprocessor, "if", COND_PARSE, loc);
+static void parse_if(struct preprocessor* preprocessor, const struct token* directive_token) {
+    enter_if(preprocessor, "if", COND_PARSE, directive_token);
 }
 
-static void parse_else(struct preprocessor* preprocessor, struct file_loc* loc) {
-    if (!error_on_empty_cond_stack(preprocessor, "else", loc))
-        enter_elif(preprocessor, "else", COND_TRUE, loc);
+static void parse_else(struct preprocessor* preprocessor, const struct token* directive_token) {
+    if (!error_on_empty_cond_stack(preprocessor, "else", directive_token))
+        enter_elif(preprocessor, "else", COND_TRUE, directive_token);
 }
 
-static void parse_elif(struct preprocessor* preprocessor, struct file_loc* loc) {
-    if (!error_on_empty_cond_stack(preprocessor, "elif", loc))
-        enter_elif(preprocessor, "elif", COND_PARSE, loc);
+static void parse_elif(struct preprocessor* preprocessor, const struct token* directive_token) {
+    if (!error_on_empty_cond_stack(preprocessor, "elif", directive_token))
+        enter_elif(preprocessor, "elif", COND_PARSE, directive_token);
 }
 
-static void parse_endif(struct preprocessor* preprocessor, struct file_loc* loc) {
+static void parse_endif(struct preprocessor* preprocessor, const struct token* directive_token) {
     assert(preprocessor->context->tag == CONTEXT_SOURCE_FILE);
     if (preprocessor->context->source_file.cond_stack.inactive_cond_depth > 0) {
         preprocessor->context->source_file.cond_stack.inactive_cond_depth--;
@@ -932,38 +1291,38 @@ static void parse_endif(struct preprocessor* preprocessor, struct file_loc* loc)
         return;
     }
 
-    if (!error_on_empty_cond_stack(preprocessor, "endif", loc))
+    if (!error_on_empty_cond_stack(preprocessor, "endif", directive_token))
         cond_vec_pop(&preprocessor->context->source_file.cond_stack.conds);
 
     preprocessor->context->is_active = true;
     eat_extra_tokens(preprocessor, "endif");
 }
 
-static inline void parse_ifdef_or_ifndef(struct preprocessor* preprocessor, bool is_ifndef, struct file_loc* loc) {
+static inline void parse_ifdef_or_ifndef(struct preprocessor* preprocessor, bool is_ifndef, const struct token* directive_token) {
     const char* directive_name = is_ifndef ? "ifndef" : "ifdef";
-    enter_if(preprocessor, directive_name, is_ifndef ? COND_IS_NOT_DEFINED : COND_IS_DEFINED, loc);
+    enter_if(preprocessor, directive_name, is_ifndef ? COND_IS_NOT_DEFINED : COND_IS_DEFINED, directive_token);
 }
 
-static void parse_ifdef(struct preprocessor* preprocessor, struct file_loc* loc) {
-    parse_ifdef_or_ifndef(preprocessor, false, loc);
+static void parse_ifdef(struct preprocessor* preprocessor, const struct token* directive_token) {
+    parse_ifdef_or_ifndef(preprocessor, false, directive_token);
 }
 
-static void parse_ifndef(struct preprocessor* preprocessor, struct file_loc* loc) {
-    parse_ifdef_or_ifndef(preprocessor, true, loc);
+static void parse_ifndef(struct preprocessor* preprocessor, const struct token* directive_token) {
+    parse_ifdef_or_ifndef(preprocessor, true, directive_token);
 }
 
-static void parse_elifdef_or_elifndef(struct preprocessor* preprocessor, bool is_elifndef, struct file_loc* loc) {
+static void parse_elifdef_or_elifndef(struct preprocessor* preprocessor, bool is_elifndef, const struct token* directive_token) {
     const char* directive_name = is_elifndef ? "elifndef" : "elifdef";
-    if (!error_on_empty_cond_stack(preprocessor, directive_name, loc))
-        enter_elif(preprocessor, directive_name, is_elifndef ? COND_IS_NOT_DEFINED : COND_IS_DEFINED, loc);
+    if (!error_on_empty_cond_stack(preprocessor, directive_name, directive_token))
+        enter_elif(preprocessor, directive_name, is_elifndef ? COND_IS_NOT_DEFINED : COND_IS_DEFINED, directive_token);
 }
 
-static void parse_elifdef(struct preprocessor* preprocessor, struct file_loc* loc) {
-    parse_elifdef_or_elifndef(preprocessor, false, loc);
+static void parse_elifdef(struct preprocessor* preprocessor, const struct token* directive_token) {
+    parse_elifdef_or_elifndef(preprocessor, false, directive_token);
 }
 
-static void parse_elifndef(struct preprocessor* preprocessor, struct file_loc* loc) {
-    parse_elifdef_or_elifndef(preprocessor, true, loc);
+static void parse_elifndef(struct preprocessor* preprocessor, const struct token* directive_token) {
+    parse_elifdef_or_elifndef(preprocessor, true, directive_token);
 }
 
 static inline size_t find_macro_param_index(
@@ -972,16 +1331,18 @@ static inline size_t find_macro_param_index(
     const struct token* token,
     bool is_variadic)
 {
-    if (str_view_is_equal(&token->contents, &STR_VIEW("__VA_ARGS__"))) {
+    struct str_view contents = token_contents(preprocessor, token);
+    if (str_view_is_equal(&contents, &STR_VIEW("__VA_ARGS__"))) {
         if (!is_variadic) {
-            log_warn(preprocessor->log, &token->loc, "'__VA_ARGS__' is only allowed inside variadic macros");
+            struct file_loc loc = find_token_loc(preprocessor, token);
+            log_warn(preprocessor->log, &loc, "'__VA_ARGS__' is only allowed inside variadic macros");
             return SIZE_MAX;
         }
         return params->elem_count;
     }
 
     for (size_t i = 0; i < params->elem_count; ++i) {
-        if (str_view_is_equal(&params->elems[i], &token->contents))
+        if (str_view_is_equal(&params->elems[i], &contents))
             return i;
     }
     return SIZE_MAX;
@@ -1013,7 +1374,7 @@ static bool verify_macro(struct preprocessor* preprocessor, const struct macro*
     return true;
 }
 
-static void parse_define(struct preprocessor* preprocessor, struct file_loc* loc) {
+static void parse_define(struct preprocessor* preprocessor, const struct token* directive_token) {
     const char* name = parse_ident(preprocessor);
 
     bool has_params = false;
@@ -1024,7 +1385,8 @@ static void parse_define(struct preprocessor* preprocessor, struct file_loc* loc
         has_params = true;
         while (peek_token(preprocessor).tag == TOKEN_IDENT) {
             struct token token = read_token(preprocessor);
-            small_str_view_vec_push(&params, &token.contents);
+            struct str_view param = token_contents(preprocessor, &token);
+            small_str_view_vec_push(&params, &param);
             assert(token.tag == TOKEN_IDENT);
             if (!accept_token(preprocessor, TOKEN_COMMA))
                 break;
@@ -1039,7 +1401,7 @@ static void parse_define(struct preprocessor* preprocessor, struct file_loc* loc
         .has_params = has_params,
         .is_variadic = is_variadic,
         .param_count = params.elem_count,
-        .loc = *loc
+        .loc = find_token_loc(preprocessor, directive_token)
     };
 
     while (true) {
@@ -1047,17 +1409,20 @@ static void parse_define(struct preprocessor* preprocessor, struct file_loc* loc
         if (token.tag == TOKEN_NL || token.tag == TOKEN_EOF)
             break;
 
-        macro.loc.end = token.loc.end;
         if (token.tag == TOKEN_IDENT) {
             const size_t macro_param_index = find_macro_param_index(preprocessor, &params, &token, is_variadic);
             if (macro_param_index != SIZE_MAX) {
                 token.tag = TOKEN_MACRO_PARAM;
                 token.macro_param_index = macro_param_index;
+            } else {
+                intern_ident(preprocessor, &token);
             }
         }
         token_vec_push(&macro.tokens, &token);
     }
     small_str_view_vec_destroy(&params);
+    if (!token_vec_is_empty(&macro.tokens))
+        macro.loc.end = find_token_loc(preprocessor, token_vec_last(&macro.tokens)).end;
 
     if (!verify_macro(preprocessor, &macro)) {
         cleanup_macro(&macro);
@@ -1068,7 +1433,8 @@ static void parse_define(struct preprocessor* preprocessor, struct file_loc* loc
 }
 
 static void parse_undef(struct preprocessor* preprocessor) {
-    const struct file_loc loc = peek_token(preprocessor).loc;
+    const struct token token = peek_token(preprocessor);
+    const struct file_loc loc = find_token_loc(preprocessor, &token);
     const char* name = parse_ident(preprocessor);
     struct macro* macro = find_macro(preprocessor, name);
     if (!macro) {
@@ -1089,7 +1455,8 @@ static struct str_view extract_line(const char* str) {
 
 static void parse_warning_or_error(struct preprocessor* preprocessor, bool is_error) {
     // Extract the warning/error message, by reading the source file data that has not been lexed yet.
-    struct str_view msg = extract_line(peek_token(preprocessor).contents.data);
+    struct token token = peek_token(preprocessor);
+    struct str_view msg = extract_line(token_contents(preprocessor, &token).data);
     struct file_loc loc = eat_extra_tokens(preprocessor, NULL);
     log_msg(is_error ? MSG_ERROR : MSG_WARN, preprocessor->log, &loc, "%.*s", (int)msg.length, msg.data);
 }
@@ -1102,56 +1469,68 @@ static void parse_error(struct preprocessor* preprocessor) {
     parse_warning_or_error(preprocessor, true);
 }
 
-static inline void ignore_directive(struct preprocessor* preprocessor, const char* directive_name, struct file_loc* loc) {
+static inline void ignore_directive(
+    struct preprocessor* preprocessor,
+    const char* directive_name,
+    const struct token* directive_token)
+{
     eat_extra_tokens(preprocessor, NULL);
-    log_warn(preprocessor->log, loc, "ignoring '#%s'", directive_name);
+    struct file_loc loc = find_token_loc(preprocessor, directive_token);
+    log_warn(preprocessor->log, &loc, "ignoring '#%s'", directive_name);
 }
 
-static void parse_line(struct preprocessor* preprocessor, struct file_loc* loc) {
+static void parse_line(struct preprocessor* preprocessor, const struct token* directive_token) {
     assert(preprocessor->context->tag == CONTEXT_SOURCE_FILE);
-    struct source_file* source_file = &preprocessor->context->source_file;
+    struct context* context = preprocessor->context;
+    struct source_file* source_file = &context->source_file;
 
     struct token line_token = expand_token(preprocessor);
     if (line_token.tag != TOKEN_INT_LITERAL) {
-        log_error(preprocessor->log, loc, "missing or invalid line number in '#line' directive");
+        struct file_loc loc = find_token_loc(preprocessor, directive_token);
+        log_error(preprocessor->log, &loc, "missing or invalid line number in '#line' directive");
         if (line_token.tag != TOKEN_NL)
             eat_extra_tokens(preprocessor, "line");
         return;
     }
 
     struct token file_name_token = expand_token(preprocessor);
+    struct str_view file_name = token_contents(preprocessor, &file_name_token);
     if (file_name_token.tag == TOKEN_STRING_LITERAL) {
-        source_file->displayed_file_name = str_pool_insert_view(preprocessor->str_pool, file_name_token.string_literal);
+        source_file->displayed_file_name = str_pool_insert_view(preprocessor->str_pool, token_string_literal(file_name));
         eat_extra_tokens(preprocessor, "line");
     } else if (file_name_token.tag != TOKEN_NL) {
-        log_error(preprocessor->log, &file_name_token.loc, "invalid file name '%.*s' in '#line' directive",
-            (int)file_name_token.contents.length, file_name_token.contents.data);
+        struct file_loc loc = find_token_loc(preprocessor, &file_name_token);
+        log_error(preprocessor->log, &loc, "invalid file name '%.*s' in '#line' directive",
+            (int)file_name.length, file_name.data);
         eat_extra_tokens(preprocessor, "line");
         return;
     }
 
-    uint32_t displayed_line = line_token.int_literal;
+    uint32_t displayed_line = token_int_literal(token_contents(preprocessor, &line_token));
     source_file->displayed_line = ++displayed_line;
 
-    // Update the already extracted tokens so that they also have the updated line info.
-    for (int i = 0; i < TOKENS_AHEAD; ++i) {
-        struct token* token = &preprocessor->context->ahead[i];
-        token->loc.displayed_file_name = source_file->displayed_file_name;
-        token->loc.displayed_line = displayed_line;
-        if (token->tag == TOKEN_NL)
-            displayed_line++;
-    }
+    // The directive applies to the tokens of the file from the first one that has not been read yet,
+    // which is at the front of the lookahead buffer.
+    const struct token* next_token = &context->ahead[0];
+    struct token_file* token_file = &preprocessor->token_files.elems[next_token->file_id];
+    line_directive_vec_push(&token_file->line_directives, &(struct line_directive) {
+        .offset = next_token->offset,
+        .row = find_source_pos(token_file, next_token->offset).row,
+        .displayed_line = displayed_line,
+        .displayed_file_name = source_file->displayed_file_name
+    });
 }
 
-static void parse_pragma(struct preprocessor* preprocessor, struct file_loc* loc) {
+static void parse_pragma(struct preprocessor* preprocessor, const struct token* directive_token) {
     struct token token = peek_token(preprocessor);
-    if (token.tag == TOKEN_IDENT && str_view_is_equal(&token.contents, &STR_VIEW("once"))) {
+    struct str_view contents = token_contents(preprocessor, &token);
+    if (token.tag == TOKEN_IDENT && str_view_is_equal(&contents, &STR_VIEW("once"))) {
         assert(preprocessor->context->tag == CONTEXT_SOURCE_FILE);
         preprocessor->context->source_file.cached_file->has_pragma_once = true;
         eat_token(preprocessor, TOKEN_IDENT);
         eat_extra_tokens(preprocessor, "pragma");
     } else {
-        ignore_directive(preprocessor, "pragma", loc);
+        ignore_directive(preprocessor, "pragma", directive_token);
     }
 }
 
@@ -1160,14 +1539,15 @@ static struct str_view parse_include_file_name(struct preprocessor* preprocessor
 
     struct token token = read_token(preprocessor);
     if (token.tag == TOKEN_STRING_LITERAL) {
-        return token.contents;
+        return token_contents(preprocessor, &token);
     } else if (token.tag == TOKEN_CMP_LT) {
         struct token first_token = token;
         struct token last_token  = token;
         do {
             token = read_token(preprocessor);
             if (token.tag == TOKEN_EOF || token.tag == TOKEN_NL) {
-                log_error(preprocessor->log, &token.loc, "unterminated include file name");
+                struct file_loc loc = find_token_loc(preprocessor, &token);
+                log_error(preprocessor->log, &loc, "unterminated include file name");
                 return (struct str_view) {};
             }
             last_token = token;
@@ -1175,35 +1555,27 @@ static struct str_view parse_include_file_name(struct preprocessor* preprocessor
 
         // We know the tokens all come from the same, continuous file data, and not from macro
         // expansion, which makes it possible to just use a string view that spans all tokens.
-        return (struct str_view) {
-            .data = first_token.contents.data,
-            .length = (last_token.contents.data + last_token.contents.length) - first_token.contents.data
-        };
+        assert(first_token.file_id == last_token.file_id);
+        return str_view_substr(
+            preprocessor->token_files.elems[first_token.file_id].data,
+            first_token.offset,
+            last_token.offset + last_token.length - first_token.offset);
     } else {
-        log_error(preprocessor->log, &token.loc, "expected include file name, but got '%.*s'",
-            (int)token.contents.length, token.contents.data);
+        struct str_view contents = token_printable_contents(token.tag, token_contents(preprocessor, &token));
+        struct file_loc loc = find_token_loc(preprocessor, &token);
+        log_error(preprocessor->log, &loc, "expected include file name, but got '%.*s'",
+            (int)contents.length, contents.data);
         return (struct str_view) {};
     }
 }
 
-static inline bool does_file_exist_in_directory(
-    struct str_view directory,
-    struct str_view file_name,
-    struct str* full_path)
-{
-    str_clear(full_path);
-    str_printf(full_path, "%.*s/%.*s",
-        (int)directory.length, directory.data,
-        (int)file_name.length, file_name.data);
-    return file_exists(full_path->data);
-}
-
-static bool find_include_file_name(
+static struct cached_file* find_include_file(
     struct preprocessor* preprocessor,
     struct str_view include_file_name,
-    bool is_relative_include,
-    struct str* full_path)
+    bool is_relative_include)
 {
+    // The file cache remembers where files were found, and where they were not.
+    struct cached_file* cached_file = NULL;
     if (is_relative_include) {
         for (struct context* context = preprocessor->context; context; context = context->prev) {
             // Walk up the chain of included files, lookup files in the same directory
@@ -1211,29 +1583,16 @@ static bool find_include_file_name(
                 continue;
 
             struct str_view include_path = split_path(STR_VIEW(context->source_file.cached_file->file_name)).dir_name;
-            if (does_file_exist_in_directory(include_path, include_file_name, full_path))
-                return true;
+            if (file_cache_find_in_directory(preprocessor->file_cache, include_path, include_file_name, &cached_file))
+                return cached_file;
         }
     }
     for (size_t i = 0; preprocessor->include_paths[i]; ++i) {
         struct str_view include_path = STR_VIEW(preprocessor->include_paths[i]);
-        if (does_file_exist_in_directory(include_path, include_file_name, full_path))
-            return true;
+        if (file_cache_find_in_directory(preprocessor->file_cache, include_path, include_file_name, &cached_file))
+            return cached_file;
     }
-    return false;
-}
-
-static struct cached_file* find_include_file(
-    struct preprocessor* preprocessor,
-    struct str_view include_file_name,
-    bool is_relative_include)
-{
-    struct str full_path = str_create();
-    struct cached_file* cached_file = NULL;
-    if (find_include_file_name(preprocessor, include_file_name, is_relative_include, &full_path))
-        cached_file = file_cache_read(preprocessor->file_cache, full_path.data);
-    str_destroy(&full_path);
-    return cached_file;
+    return NULL;
 }
 
 static bool skip_include_file_delimiters(struct str_view* include_file_name) {
@@ -1247,7 +1606,14 @@ static bool skip_include_file_delimiters(struct str_view* include_file_name) {
     return is_relative_include;
 }
 
-static void parse_include(struct preprocessor* preprocessor, struct file_loc* loc) {
+static bool is_include_guard_defined(struct preprocessor* preprocessor, const struct cached_file* cached_file) {
+    if (cached_file->include_guard.length == 0)
+        return false;
+    const char* name = str_pool_insert_view(preprocessor->str_pool, cached_file->include_guard);
+    return find_macro(preprocessor, name) != NULL;
+}
+
+static void parse_include(struct preprocessor* preprocessor, const struct token* directive_token) {
     struct str_view include_file_name = parse_include_file_name(preprocessor);
 
     struct cached_file* cached_file = NULL;
@@ -1255,15 +1621,28 @@ static void parse_include(struct preprocessor* preprocessor, struct file_loc* lo
         bool is_relative_include = skip_include_file_delimiters(&include_file_name);
         cached_file = find_include_file(preprocessor, include_file_name, is_relative_include);
         if (!cached_file) {
-            log_error(preprocessor->log, loc, "cannot find include file '%.*s'",
+            struct file_loc loc = find_token_loc(preprocessor, directive_token);
+            log_error(preprocessor->log, &loc, "cannot find include file '%.*s'",
                 (int)include_file_name.length, include_file_name.data);
+        } else if (preprocessor->token_files.elem_count > UINT16_MAX ||
+            cached_file->file_data.length > UINT32_MAX)
+        {
+            // Tokens cannot refer to more files, or to offsets past 4GB (see `struct token`).
+            struct file_loc loc = find_token_loc(preprocessor, directive_token);
+            log_error(preprocessor->log, &loc, "cannot include '%s', because there are too many or too large files",
+                cached_file->file_name);
+            cached_file = NULL;
         }
     }
 
     eat_extra_tokens(preprocessor, "include");
 
-    if (cached_file && !cached_file->has_pragma_once)
-        push_context(preprocessor, alloc_source_file_context(cached_file, preprocessor->context));
+    if (cached_file && !cached_file->has_pragma_once && !is_include_guard_defined(preprocessor, cached_file)) {
+        uint64_t include_time = stats_trace(preprocessor->stats) ? stats_time() : 0;
+        record_included_file(preprocessor, cached_file);
+        push_context(preprocessor, alloc_source_file_context(preprocessor, cached_file, preprocessor->context));
+        preprocessor->context->source_file.include_time = include_time;
+    }
 }
 
 static inline bool is_control_directive(enum directive directive) {
@@ -1282,9 +1661,41 @@ static inline bool is_control_directive(enum directive directive) {
     }
 }
 
+static void update_include_guard(struct preprocessor* preprocessor, enum directive directive) {
+    struct source_file* source_file = &preprocessor->context->source_file;
+    const size_t cond_depth =
+        source_file->cond_stack.conds.elem_count + source_file->cond_stack.inactive_cond_depth;
+    switch (source_file->include_guard_state) {
+        case INCLUDE_GUARD_START:
+            source_file->include_guard_state = INCLUDE_GUARD_NONE;
+            struct token token = peek_token(preprocessor);
+            if (directive == DIRECTIVE_IFNDEF && token.tag == TOKEN_IDENT) {
+                source_file->include_guard = token_contents(preprocessor, &token);
+                source_file->include_guard_state = INCLUDE_GUARD_OPEN;
+            }
+            break;
+        case INCLUDE_GUARD_OPEN:
+            if (cond_depth != 1)
+                break;
+            if (directive == DIRECTIVE_ENDIF)
+                source_file->include_guard_state = INCLUDE_GUARD_CLOSED;
+            else if (is_control_directive(directive) && directive != DIRECTIVE_IF &&
+                directive != DIRECTIVE_IFDEF && directive != DIRECTIVE_IFNDEF)
+                source_file->include_guard_state = INCLUDE_GUARD_NONE;
+            break;
+        case INCLUDE_GUARD_CLOSED:
+            source_file->include_guard_state = INCLUDE_GUARD_NONE;
+            break;
+        default:
+            break;
+    }
+}
+
 static void parse_directive(struct preprocessor* preprocessor) {
     struct token token = read_token(preprocessor);
-    enum directive directive = directive_from_string(token.contents);
+    struct str_view contents = token_contents(preprocessor, &token);
+    enum directive directive = directive_from_string(contents);
+    update_include_guard(preprocessor, directive);
 
     if (!preprocessor->context->is_active && !is_control_directive(directive)) {
         eat_extra_tokens(preprocessor, NULL);
@@ -1292,44 +1703,47 @@ static void parse_directive(struct preprocessor* preprocessor) {
     }
 
     if (directive == DIRECTIVE_NONE) {
-        log_error(preprocessor->log, &token.loc, "invalid preprocessor directive '%.*s'",
-            (int)token.contents.length, token.contents.data);
+        struct file_loc loc = find_token_loc(preprocessor, &token);
+        log_error(preprocessor->log, &loc, "invalid preprocessor directive '%.*s'",
+            (int)contents.length, contents.data);
         return;
     }
 
     switch (directive) {
-        case DIRECTIVE_IF:       parse_if(preprocessor, &token.loc);        break;
-        case DIRECTIVE_ELSE:     parse_else(preprocessor, &token.loc);      break;
-        case DIRECTIVE_ELIF:     parse_elif(preprocessor, &token.loc);      break;
-        case DIRECTIVE_ENDIF:    parse_endif(preprocessor, &token.loc);     break;
-        case DIRECTIVE_IFDEF:    parse_ifdef(preprocessor, &token.loc);     break;
-        case DIRECTIVE_IFNDEF:   parse_ifndef(preprocessor, &token.loc);    break;
-        case DIRECTIVE_ELIFDEF:  parse_elifdef(preprocessor, &token.loc);   break;
-        case DIRECTIVE_ELIFNDEF: parse_elifndef(preprocessor, &token.loc);  break;
-        case DIRECTIVE_DEFINE:   parse_define(preprocessor, &token.loc);    break;
+        case DIRECTIVE_IF:       parse_if(preprocessor, &token);        break;
+        case DIRECTIVE_ELSE:     parse_else(preprocessor, &token);      break;
+        case DIRECTIVE_ELIF:     parse_elif(preprocessor, &token);      break;
+        case DIRECTIVE_ENDIF:    parse_endif(preprocessor, &token);     break;
+        case DIRECTIVE_IFDEF:    parse_ifdef(preprocessor, &token);     break;
+        case DIRECTIVE_IFNDEF:   parse_ifndef(preprocessor, &token);    break;
+        case DIRECTIVE_ELIFDEF:  parse_elifdef(preprocessor, &token);   break;
+        case DIRECTIVE_ELIFNDEF: parse_elifndef(preprocessor, &token);  break;
+        case DIRECTIVE_DEFINE:   parse_define(preprocessor, &token);    break;
         case DIRECTIVE_UNDEF:    parse_undef(preprocessor);                 break;
         case DIRECTIVE_WARNING:  parse_warning(preprocessor);               break;
         case DIRECTIVE_ERROR:    parse_error(preprocessor);                 break;
-        case DIRECTIVE_LINE:     parse_line(preprocessor, &token.loc);      break;
-        case DIRECTIVE_PRAGMA:   parse_pragma(preprocessor, &token.loc);    break;
-        case DIRECTIVE_INCLUDE:  parse_include(preprocessor, &token.loc);   break;
+        case DIRECTIVE_LINE:     parse_line(preprocessor, &token);      break;
+        case DIRECTIVE_PRAGMA:   parse_pragma(preprocessor, &token);    break;
+        case DIRECTIVE_INCLUDE:  parse_include(preprocessor, &token);   break;
         default:
             assert(false && "invalid preprocessor directive");
             break;
     }
 }
 
-static void print_token_error(struct log* log, const struct token* token) {
+static void print_token_error(struct preprocessor* preprocessor, const struct token* token) {
     assert(token->tag == TOKEN_ERROR);
+    struct str_view contents = token_contents(preprocessor, token);
+    struct file_loc loc = find_token_loc(preprocessor, token);
     switch (token->error) {
         case TOKEN_ERROR_INVALID:
-            log_error(log, &token->loc, "invalid token '%.*s'", (int)token->contents.length, token->contents.data);
+            log_error(preprocessor->log, &loc, "invalid token '%.*s'", (int)contents.length, contents.data);
             break;
         case TOKEN_ERROR_UNTERMINATED_COMMENT:
-            log_error(log, &token->loc, "unterminated multi-line comment");
+            log_error(preprocessor->log, &loc, "unterminated multi-line comment");
             break;
         case TOKEN_ERROR_UNTERMINATED_STRING:
-            log_error(log, &token->loc, "unterminated string");
+            log_error(preprocessor->log, &loc, "unterminated string");
             break;
         default:
             assert(false && "invalid token error");
@@ -1337,7 +1751,7 @@ static void print_token_error(struct log* log, const struct token* token) {
     }
 }
 
-struct token preprocessor_advance(struct preprocessor* preprocessor) {
+static struct token advance_preprocessor(struct preprocessor* preprocessor) {
     while (true) {
         struct token token = expand_token(preprocessor);
         if (token.tag == TOKEN_HASH && token.on_new_line && preprocessor->context->tag == CONTEXT_SOURCE_FILE) {
@@ -1349,16 +1763,35 @@ struct token preprocessor_advance(struct preprocessor* preprocessor) {
                 continue;
             }
         } else if (token.tag == TOKEN_NL || !preprocessor->context->is_active) {
+            if (token.tag == TOKEN_NL && !preprocessor->context->is_active &&
+                preprocessor->context->tag == CONTEXT_SOURCE_FILE)
+                skip_inactive_lines(preprocessor->context, &token);
             continue;
         } else if (token.tag == TOKEN_ERROR) {
-            print_token_error(preprocessor->log, &token);
+            print_token_error(preprocessor, &token);
             continue;
         }
 
+        // Tokens outside of the guard of a file prevent it from being skipped when included again.
+        if (token.tag != TOKEN_EOF) {
+            struct source_file* source_file = find_containing_source_file(preprocessor->context);
+            if (source_file->include_guard_state != INCLUDE_GUARD_OPEN)
+                source_file->include_guard_state = INCLUDE_GUARD_NONE;
+        }
         return token;
     }
 }
 
+struct token preprocessor_advance(struct preprocessor* preprocessor) {
+    if (!preprocessor->stats)
+        return advance_preprocessor(preprocessor);
+
+    uint64_t start_time = stats_time();
+    struct token token = advance_preprocessor(preprocessor);
+    preprocessor->stats->phase_times[PHASE_PREPROCESS] += stats_time() - start_time;
+    return token;
+}
+
 void preprocessor_register_macro(struct preprocessor* preprocessor, const char* name, const char* expansion) {
     // Internalize strings so that their lifetime is tied to the preprocessor.
     name = str_pool_insert(preprocessor->str_pool, name);
@@ -1370,16 +1803,141 @@ void preprocessor_register_macro(struct preprocessor* preprocessor, const char*
         .has_params = false,
         .is_variadic = false,
         .param_count = 0,
-        .loc = { .file_name = "<builtin macro>" }
+        .loc = { .file_name = BUILTIN_MACRO_FILE_NAME }
     };
 
-    struct lexer lexer = lexer_create(name, STR_VIEW(expansion));
+    uint16_t file_id = add_token_file(preprocessor, &(struct token_file) {
+        .file_name = BUILTIN_MACRO_FILE_NAME,
+        .data = STR_VIEW(expansion)
+    });
+    struct lexer lexer = lexer_create(file_id, STR_VIEW(expansion));
     while (true) {
         struct token token = lexer_advance(&lexer);
         if (token.tag == TOKEN_EOF)
             break;
+        if (token.tag == TOKEN_IDENT)
+            intern_ident(preprocessor, &token);
         token_vec_push(&macro.tokens, &token);
     }
 
     insert_macro(preprocessor, &macro);
 }
+
+static int compare_macro_defs(const void* left, const void* right) {
+    return strcmp(((const struct macro_def*)left)->name, ((const struct macro_def*)right)->name);
+}
+
+struct macro_def_vec preprocessor_export_macros(struct preprocessor* preprocessor) {
+    struct macro_def_vec macro_defs = macro_def_vec_create();
+    SET_FOREACH(struct macro*, macro_ptr, preprocessor->macros) {
+        const struct macro* macro = *macro_ptr;
+        if (macro->callback || !strcmp(macro->loc.file_name, BUILTIN_MACRO_FILE_NAME))
+            continue;
+        struct macro_def_token* tokens =
+            MEM_POOL_ALLOC_ARRAY(*preprocessor->mem_pool, macro->tokens.elem_count, struct macro_def_token);
+        for (size_t i = 0; i < macro->tokens.elem_count; ++i) {
+            const struct token* token = &macro->tokens.elems[i];
+            tokens[i] = (struct macro_def_token) {
+                .tag = token->tag,
+                .on_new_line = token->on_new_line,
+                .has_space_before = token->has_space_before,
+                .loc = find_token_loc(preprocessor, token),
+                .contents = token_contents(preprocessor, token)
+            };
+            if (token->tag == TOKEN_MACRO_PARAM)
+                tokens[i].macro_param_index = token->macro_param_index;
+            else if (token->tag == TOKEN_ERROR)
+                tokens[i].error = token->error;
+        }
+        macro_def_vec_push(&macro_defs, &(struct macro_def) {
+            .name = macro->name,
+            .has_params = macro->has_params,
+            .is_variadic = macro->is_variadic,
+            .param_count = macro->param_count,
+            .loc = macro->loc,
+            .tokens = tokens,
+            .token_count = macro->tokens.elem_count
+        });
+    }
+    // Sorting makes the order independent from the addresses of the names.
+    qsort(macro_defs.elems, macro_defs.elem_count, sizeof(struct macro_def), compare_macro_defs);
+    return macro_defs;
+}
+
+static bool have_same_definition(
+    const struct preprocessor* preprocessor,
+    const struct macro* macro,
+    const struct macro* other)
+{
+    if (macro->callback || other->callback ||
+        macro->has_params != other->has_params ||
+        macro->is_variadic != other->is_variadic ||
+        macro->param_count != other->param_count ||
+        macro->tokens.elem_count != other->tokens.elem_count)
+        return false;
+    for (size_t i = 0; i < macro->tokens.elem_count; ++i) {
+        const struct token* token = &macro->tokens.elems[i];
+        const struct token* other_token = &other->tokens.elems[i];
+        if (token->tag != other_token->tag ||
+            (i > 0 && token->has_space_before != other_token->has_space_before))
+            return false;
+        struct str_view contents = token_contents(preprocessor, token);
+        struct str_view other_contents = token_contents(preprocessor, other_token);
+        if (!str_view_is_equal(&contents, &other_contents))
+            return false;
+    }
+    return true;
+}
+
+void preprocessor_import_macros(struct preprocessor* preprocessor, const struct macro_def* macro_defs, size_t macro_count) {
+    for (size_t i = 0; i < macro_count; ++i) {
+        struct macro macro = {
+            .tokens = token_vec_create(),
+            .name = str_pool_insert(preprocessor->str_pool, macro_defs[i].name),
+            .has_params = macro_defs[i].has_params,
+            .is_variadic = macro_defs[i].is_variadic,
+            .param_count = macro_defs[i].param_count,
+            .loc = macro_defs[i].loc
+        };
+        for (size_t j = 0; j < macro_defs[i].token_count; ++j) {
+            const struct macro_def_token* def_token = &macro_defs[i].tokens[j];
+            struct token token = make_token(preprocessor, def_token->tag, def_token->contents, &def_token->loc);
+            token.on_new_line = def_token->on_new_line;
+            token.has_space_before = def_token->has_space_before;
+            if (token.tag == TOKEN_IDENT)
+                intern_ident(preprocessor, &token);
+            else if (token.tag == TOKEN_MACRO_PARAM)
+                token.macro_param_index = def_token->macro_param_index;
+            else if (token.tag == TOKEN_ERROR)
+                token.error = def_token->error;
+            token_vec_push(&macro.tokens, &token);
+        }
+
+        // Macros of a precompiled header silently replace identical definitions, such as those of
+        // the headers it was built from, but not those given differently on the command line.
+        struct macro* existing_macro = find_macro(preprocessor, macro.name);
+        if (existing_macro && have_same_definition(preprocessor, existing_macro, &macro)) {
+            cleanup_macro(existing_macro);
+            *existing_macro = macro;
+        } else {
+            insert_macro(preprocessor, &macro);
+        }
+    }
+}
+
+const struct cached_file_vec* preprocessor_included_files(const struct preprocessor* preprocessor) {
+    return &preprocessor->included_files;
+}
+
+struct str_view preprocessor_token_contents(const struct preprocessor* preprocessor, const struct token* token) {
+    return token_contents(preprocessor, token);
+}
+
+struct file_loc preprocessor_token_loc(const struct preprocessor* preprocessor, const struct token* token) {
+    return find_token_loc(preprocessor, token);
+}
+
+const char* preprocessor_token_ident(struct preprocessor* preprocessor, const struct token* token) {
+    struct token ident_token = *token;
+    return intern_ident(preprocessor, &ident_token);
+}
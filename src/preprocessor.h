@@ -2,17 +2,104 @@
 
 #include "token.h"
 
+#define DIRECTIVE_LIST(x) \
+    x(DEFINE, "define") \
+    x(INCLUDE, "include") \
+    x(IF, "if") \
+    x(ELSE, "else") \
+    x(ELIF, "elif") \
+    x(IFDEF, "ifdef") \
+    x(IFNDEF, "ifndef") \
+    x(ENDIF, "endif") \
+    x(ELIFDEF, "elifdef") \
+    x(ELIFNDEF, "elifndef") \
+    x(UNDEF, "undef") \
+    x(PRAGMA, "pragma") \
+    x(LINE, "line") \
+    x(WARNING, "warning") \
+    x(ERROR, "error")
+
+// Directives are looked up like keywords (see `hash_keyword`), in a table generated at build time by
+// `gen_lookup_tables.c`.
+#define DIRECTIVE_TABLE_SIZE 32
+
+static inline size_t hash_directive(struct str_view string) {
+    if (string.length == 0)
+        return 0;
+    size_t first_char = (unsigned char)string.data[0];
+    size_t last_char  = (unsigned char)string.data[string.length - 1];
+    return (string.length + first_char * 5 + last_char * 9) % DIRECTIVE_TABLE_SIZE;
+}
+
 struct log;
+struct mem_pool;
 struct preprocessor;
 struct file_cache;
+struct stats;
+struct cached_file_vec;
+
+// Token of a macro definition, with its location and contents resolved, so that it does not depend
+// on the preprocessor it comes from.
+struct macro_def_token {
+    enum token_tag tag;
+    bool on_new_line;
+    bool has_space_before;
+    union {
+        uint32_t macro_param_index;
+        enum token_error error;
+    };
+    struct file_loc loc;
+    struct str_view contents;
+};
+
+// Definition of a macro, as stored in precompiled headers.
+struct macro_def {
+    const char* name;
+    bool has_params;
+    bool is_variadic;
+    size_t param_count;
+    struct file_loc loc;
+    const struct macro_def_token* tokens;
+    size_t token_count;
+};
+
+VEC_DECL(macro_def_vec, struct macro_def, PUBLIC)
 
+// Statistics are collected in the given object, unless it is NULL. Strings interned by the
+// preprocessor, which include the identifiers of the tokens it returns, are allocated in the given
+// memory pool, and remain valid after the preprocessor is closed.
 [[nodiscard]] struct preprocessor* preprocessor_open(
+    struct mem_pool*,
     struct log*,
     struct file_cache*,
     const char* file_name,
-    const char* const* include_paths);
+    const char* const* include_paths,
+    struct stats*);
 
 void preprocessor_close(struct preprocessor*);
 struct token preprocessor_advance(struct preprocessor*);
 
+// Tokens only store where their text is (see `struct token`). The contents returned here remain valid
+// until the next call to `preprocessor_advance`.
+[[nodiscard]] struct str_view preprocessor_token_contents(const struct preprocessor*, const struct token*);
+[[nodiscard]] struct file_loc preprocessor_token_loc(const struct preprocessor*, const struct token*);
+
+// Returns the interned name of an identifier token, which remains valid after the preprocessor is
+// closed.
+[[nodiscard]] const char* preprocessor_token_ident(struct preprocessor*, const struct token*);
+
 void preprocessor_register_macro(struct preprocessor*, const char* name, const char* expansion);
+
+// Returns the macros defined by source files, sorted by name. The tokens of the definitions are
+// allocated in the memory pool of the preprocessor, but their contents point to data owned by the
+// preprocessor, and remain valid until its macros are modified or it is closed.
+[[nodiscard]] struct macro_def_vec preprocessor_export_macros(struct preprocessor*);
+
+// Defines the given macros, replacing the ones that have the same name. Like for `#define`, a warning
+// is emitted when a macro is replaced by a different definition. Tokens are copied, along with their
+// contents.
+void preprocessor_import_macros(struct preprocessor*, const struct macro_def* macro_defs, size_t macro_count);
+
+// Returns the files opened by the preprocessor so far, starting with the main file, in the order in
+// which they were first opened.
+[[nodiscard]] const struct cached_file_vec* preprocessor_included_files(const struct preprocessor*);
@@ -0,0 +1,890 @@
+#include "serialize.h"
+#include "preprocessor.h"
+#include "ast.h"
+#include "type_table.h"
+
+#include <overture/map.h>
+#include <overture/hash.h>
+#include <overture/mem.h>
+#include <overture/mem_pool.h>
+#include <overture/str_pool.h>
+
+#include <assert.h>
+#include <string.h>
+
+// Images start with a header, followed by three sections that contain strings, types, and AST
+// nodes, in that order. Each section starts with the number of elements it contains. References to
+// strings, types, or nodes are encoded as indices into the corresponding section, offset by one so
+// that zero represents NULL. Types are stored in dependency order, so that they can be interned in
+// the type table as they are read.
+//
+// Precompiled headers also record the number of nodes in their base image in their header. Node
+// references below that number designate nodes of the base image. The node section of precompiled
+// headers is followed by the files they depend on, by their macros, and by the macros that were
+// defined outside of the sources when they were built.
+
+#define IMAGE_MAGIC "NOSLAST"
+#define PCH_MAGIC   "NOSLPCH"
+#define IMAGE_VERSION 4
+
+static_assert(sizeof(IMAGE_MAGIC) == sizeof(PCH_MAGIC));
+
+static inline uint32_t hash_string_ptr(uint32_t h, const char* const* string_ptr) {
+    return hash_string(h, *string_ptr);
+}
+
+static inline bool are_strings_equal(const char* const* string_ptr, const char* const* other_ptr) {
+    return !strcmp(*string_ptr, *other_ptr);
+}
+
+static inline uint32_t hash_type_ptr(uint32_t h, const struct type* const* type_ptr) {
+    return hash_uint64(h, (uintptr_t)*type_ptr);
+}
+
+static inline bool are_type_ptrs_equal(const struct type* const* type_ptr, const struct type* const* other_ptr) {
+    return *type_ptr == *other_ptr;
+}
+
+static inline uint32_t hash_ast_ptr(uint32_t h, const struct ast* const* ast_ptr) {
+    return hash_uint64(h, (uintptr_t)*ast_ptr);
+}
+
+static inline bool are_ast_ptrs_equal(const struct ast* const* ast_ptr, const struct ast* const* other_ptr) {
+    return *ast_ptr == *other_ptr;
+}
+
+VEC_DEFINE(byte_vec, uint8_t, PRIVATE)
+MAP_DEFINE(string_index_map, const char*, uint32_t, hash_string_ptr, are_strings_equal, PRIVATE)
+MAP_DEFINE(type_index_map, const struct type*, uint32_t, hash_type_ptr, are_type_ptrs_equal, PRIVATE)
+MAP_DEFINE(ast_index_map, const struct ast*, uint32_t, hash_ast_ptr, are_ast_ptrs_equal, PRIVATE)
+
+struct writer {
+    const struct image_base* base;
+    struct str_pool* str_pool;
+    struct byte_vec strings;
+    struct byte_vec types;
+    struct byte_vec nodes;
+    struct string_index_map string_indices;
+    struct type_index_map type_indices;
+    struct ast_index_map ast_indices;
+    struct ast_vec pending_asts;
+};
+
+struct reader {
+    const struct image_base* base;
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+    bool is_invalid;
+    struct mem_pool* mem_pool;
+    struct type_table* type_table;
+    const char** strings;
+    uint32_t string_count;
+    const struct type** types;
+    uint32_t type_count;
+    struct ast* asts;
+    uint32_t ast_count;
+};
+
+struct serializer {
+    bool is_reading;
+    union {
+        struct writer* writer;
+        struct reader* reader;
+    };
+};
+
+static inline void write_bytes(struct byte_vec* bytes, const void* data, size_t size) {
+    for (size_t i = 0; i < size; ++i)
+        byte_vec_push(bytes, &((const uint8_t*)data)[i]);
+}
+
+// Integers are written with a variable-length encoding, 7 bits at a time, which keeps the image
+// small since most values (indices, enumerations, source positions) are small.
+static inline void write_int(struct byte_vec* bytes, uint64_t value) {
+    while (value >= 0x80) {
+        byte_vec_push(bytes, (uint8_t[]) { (uint8_t)(value | 0x80) });
+        value >>= 7;
+    }
+    byte_vec_push(bytes, (uint8_t[]) { (uint8_t)value });
+}
+
+static inline const uint8_t* read_bytes(struct reader* reader, size_t size) {
+    if (reader->is_invalid || reader->size - reader->pos < size) {
+        reader->is_invalid = true;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->data + reader->pos;
+    reader->pos += size;
+    return bytes;
+}
+
+static inline uint64_t read_int(struct reader* reader) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        const uint8_t* byte = read_bytes(reader, 1);
+        if (!byte)
+            return 0;
+        value |= (uint64_t)(*byte & 0x7F) << shift;
+        if (!(*byte & 0x80))
+            return value;
+    }
+    reader->is_invalid = true;
+    return 0;
+}
+
+static inline uint32_t read_ref(struct reader* reader, uint32_t count) {
+    uint64_t ref = read_int(reader);
+    if (ref > count) {
+        reader->is_invalid = true;
+        return 0;
+    }
+    return ref;
+}
+
+static uint32_t write_string(struct writer* writer, const char* string) {
+    if (!string)
+        return 0;
+    const uint32_t* index = string_index_map_find(&writer->string_indices, &string);
+    if (index)
+        return *index + 1;
+
+    uint32_t new_index = writer->string_indices.elem_count;
+    [[maybe_unused]] bool was_inserted = string_index_map_insert(&writer->string_indices, &string, &new_index);
+    assert(was_inserted);
+    size_t length = strlen(string);
+    write_int(&writer->strings, length);
+    write_bytes(&writer->strings, string, length + 1);
+    return new_index + 1;
+}
+
+static uint32_t write_type(struct writer*, const struct type*);
+
+static inline void write_type_record(struct writer* writer, const struct type* type) {
+    struct byte_vec* bytes = &writer->types;
+    write_int(bytes, type->tag);
+    switch (type->tag) {
+        case TYPE_ERROR:
+            break;
+        case TYPE_PRIM:
+            write_int(bytes, type->prim_type);
+            break;
+        case TYPE_SHADER:
+            write_int(bytes, type->shader_type);
+            break;
+        case TYPE_CLOSURE:
+            write_int(bytes, write_type(writer, type->closure_type.inner_type));
+            break;
+        case TYPE_ARRAY:
+            write_int(bytes, write_type(writer, type->array_type.elem_type));
+            write_int(bytes, type->array_type.elem_count);
+            break;
+        case TYPE_FUNC:
+            write_int(bytes, write_type(writer, type->func_type.ret_type));
+            write_int(bytes, type->func_type.has_ellipsis);
+            write_int(bytes, type->func_type.param_count);
+            for (size_t i = 0; i < type->func_type.param_count; ++i) {
+                write_int(bytes, write_type(writer, type->func_type.params[i].type));
+                write_int(bytes, type->func_type.params[i].is_output);
+            }
+            break;
+        case TYPE_COMPOUND:
+            write_int(bytes, type->compound_type.elem_count);
+            for (size_t i = 0; i < type->compound_type.elem_count; ++i)
+                write_int(bytes, write_type(writer, type->compound_type.elem_types[i]));
+            break;
+        case TYPE_STRUCT:
+            write_int(bytes, write_string(writer, type->struct_type.name));
+            write_int(bytes, type->struct_type.field_count);
+            for (size_t i = 0; i < type->struct_type.field_count; ++i) {
+                write_int(bytes, write_string(writer, type->struct_type.fields[i].name));
+                write_int(bytes, write_type(writer, type->struct_type.fields[i].type));
+            }
+            break;
+        default:
+            assert(false && "invalid type");
+            break;
+    }
+}
+
+static inline void write_type_deps(struct writer* writer, const struct type* type) {
+    switch (type->tag) {
+        case TYPE_CLOSURE:
+            write_type(writer, type->closure_type.inner_type);
+            break;
+        case TYPE_ARRAY:
+            write_type(writer, type->array_type.elem_type);
+            break;
+        case TYPE_FUNC:
+            write_type(writer, type->func_type.ret_type);
+            for (size_t i = 0; i < type->func_type.param_count; ++i)
+                write_type(writer, type->func_type.params[i].type);
+            break;
+        case TYPE_COMPOUND:
+            for (size_t i = 0; i < type->compound_type.elem_count; ++i)
+                write_type(writer, type->compound_type.elem_types[i]);
+            break;
+        case TYPE_STRUCT:
+            for (size_t i = 0; i < type->struct_type.field_count; ++i)
+                write_type(writer, type->struct_type.fields[i].type);
+            break;
+        default:
+            break;
+    }
+}
+
+static uint32_t write_type(struct writer* writer, const struct type* type) {
+    if (!type)
+        return 0;
+    const uint32_t* index = type_index_map_find(&writer->type_indices, &type);
+    if (index)
+        return *index + 1;
+
+    // Dependencies must be written first, so that the reader can intern them before this type.
+    write_type_deps(writer, type);
+    write_type_record(writer, type);
+
+    uint32_t new_index = writer->type_indices.elem_count;
+    [[maybe_unused]] bool was_inserted = type_index_map_insert(&writer->type_indices, &type, &new_index);
+    assert(was_inserted);
+    return new_index + 1;
+}
+
+static uint32_t write_ast(struct writer* writer, const struct ast* ast) {
+    if (!ast)
+        return 0;
+    const size_t base_count = writer->base ? writer->base->ast_count : 0;
+    if (base_count > 0 && ast >= writer->base->asts && ast < writer->base->asts + base_count)
+        return ast - writer->base->asts + 1;
+
+    const uint32_t* index = ast_index_map_find(&writer->ast_indices, &ast);
+    if (index)
+        return *index + base_count + 1;
+
+    // Nodes are written in the order in which they are first referenced.
+    uint32_t new_index = writer->ast_indices.elem_count;
+    [[maybe_unused]] bool was_inserted = ast_index_map_insert(&writer->ast_indices, &ast, &new_index);
+    assert(was_inserted);
+    ast_vec_push(&writer->pending_asts, (struct ast*[]) { (struct ast*)ast });
+    return new_index + base_count + 1;
+}
+
+static const struct type* read_type_record(struct reader* reader) {
+    enum type_tag tag = read_int(reader);
+    switch (tag) {
+        case TYPE_ERROR:
+            return type_table_make_error_type(reader->type_table);
+        case TYPE_PRIM: {
+            enum prim_type prim_type = read_int(reader);
+            if (prim_type >= PRIM_TYPE_COUNT)
+                break;
+            return type_table_make_prim_type(reader->type_table, prim_type);
+        }
+        case TYPE_SHADER:
+            return type_table_make_shader_type(reader->type_table, read_int(reader));
+        case TYPE_CLOSURE: {
+            uint32_t inner_type = read_ref(reader, reader->type_count);
+            if (!inner_type)
+                break;
+            return type_table_make_closure_type(reader->type_table, reader->types[inner_type - 1]);
+        }
+        case TYPE_ARRAY: {
+            uint32_t elem_type = read_ref(reader, reader->type_count);
+            size_t elem_count = read_int(reader);
+            if (!elem_type)
+                break;
+            return elem_count > 0
+                ? type_table_make_sized_array_type(reader->type_table, reader->types[elem_type - 1], elem_count)
+                : type_table_make_unsized_array_type(reader->type_table, reader->types[elem_type - 1]);
+        }
+        case TYPE_FUNC: {
+            uint32_t ret_type = read_ref(reader, reader->type_count);
+            bool has_ellipsis = read_int(reader);
+            size_t param_count = read_int(reader);
+            struct small_func_param_vec params;
+            small_func_param_vec_init(&params);
+            for (size_t i = 0; i < param_count && !reader->is_invalid; ++i) {
+                uint32_t param_type = read_ref(reader, reader->type_count);
+                bool is_output = read_int(reader);
+                if (!param_type)
+                    break;
+                small_func_param_vec_push(&params, &(struct func_param) {
+                    .type = reader->types[param_type - 1],
+                    .is_output = is_output
+                });
+            }
+            const struct type* func_type = NULL;
+            if (ret_type && params.elem_count == param_count) {
+                func_type = type_table_make_func_type(reader->type_table,
+                    reader->types[ret_type - 1], params.elems, params.elem_count, has_ellipsis);
+            }
+            small_func_param_vec_destroy(&params);
+            return func_type;
+        }
+        case TYPE_COMPOUND: {
+            size_t elem_count = read_int(reader);
+            struct small_type_vec elem_types;
+            small_type_vec_init(&elem_types);
+            for (size_t i = 0; i < elem_count && !reader->is_invalid; ++i) {
+                uint32_t elem_type = read_ref(reader, reader->type_count);
+                if (!elem_type)
+                    break;
+                small_type_vec_push(&elem_types, &reader->types[elem_type - 1]);
+            }
+            const struct type* compound_type = NULL;
+            if (elem_types.elem_count == elem_count) {
+                compound_type = type_table_make_compound_type(reader->type_table,
+                    elem_types.elems, elem_types.elem_count);
+            }
+            small_type_vec_destroy(&elem_types);
+            return compound_type;
+        }
+        case TYPE_STRUCT: {
+            uint32_t name = read_ref(reader, reader->string_count);
+            size_t field_count = read_int(reader);
+            if (!name || field_count > reader->size)
+                break;
+            struct type* struct_type = type_table_create_struct_type(reader->type_table, field_count);
+            struct_type->struct_type.name = reader->strings[name - 1];
+            for (size_t i = 0; i < field_count; ++i) {
+                uint32_t field_name = read_ref(reader, reader->string_count);
+                uint32_t field_type = read_ref(reader, reader->type_count);
+                if (!field_name || !field_type) {
+                    reader->is_invalid = true;
+                    break;
+                }
+                struct_type->struct_type.fields[i].name = reader->strings[field_name - 1];
+                struct_type->struct_type.fields[i].type = reader->types[field_type - 1];
+            }
+            if (reader->is_invalid)
+                break;
+            type_table_finalize_struct_type(reader->type_table, struct_type);
+            return struct_type;
+        }
+        default:
+            break;
+    }
+    reader->is_invalid = true;
+    return NULL;
+}
+
+static inline uint64_t serialize_int(struct serializer* serializer, uint64_t value) {
+    if (serializer->is_reading)
+        return read_int(serializer->reader);
+    write_int(&serializer->writer->nodes, value);
+    return value;
+}
+
+static inline void serialize_string_ref(struct serializer* serializer, const char** string) {
+    if (serializer->is_reading) {
+        uint32_t ref = read_ref(serializer->reader, serializer->reader->string_count);
+        *string = ref ? serializer->reader->strings[ref - 1] : NULL;
+    } else {
+        write_int(&serializer->writer->nodes, write_string(serializer->writer, *string));
+    }
+}
+
+static inline void serialize_type_ref(struct serializer* serializer, const struct type** type) {
+    if (serializer->is_reading) {
+        uint32_t ref = read_ref(serializer->reader, serializer->reader->type_count);
+        *type = ref ? serializer->reader->types[ref - 1] : NULL;
+    } else {
+        write_int(&serializer->writer->nodes, write_type(serializer->writer, *type));
+    }
+}
+
+static inline void serialize_ast_ref(struct serializer* serializer, struct ast** ast) {
+    if (serializer->is_reading) {
+        struct reader* reader = serializer->reader;
+        const size_t base_count = reader->base ? reader->base->ast_count : 0;
+        uint32_t ref = read_ref(reader, base_count + reader->ast_count);
+        if (ref == 0)
+            *ast = NULL;
+        else if (ref <= base_count)
+            *ast = &reader->base->asts[ref - 1];
+        else
+            *ast = &reader->asts[ref - base_count - 1];
+    } else {
+        write_int(&serializer->writer->nodes, write_ast(serializer->writer, *ast));
+    }
+}
+
+// This works for enumerations, Booleans, bit fields, and integers.
+#define SERIALIZE_VALUE(serializer, value) \
+    value = serialize_int(serializer, value)
+
+static inline void serialize_float(struct serializer* serializer, float_literal* value) {
+    uint64_t bits = 0;
+    static_assert(sizeof(float_literal) <= sizeof(uint64_t));
+    memcpy(&bits, value, sizeof(float_literal));
+    bits = serialize_int(serializer, bits);
+    memcpy(value, &bits, sizeof(float_literal));
+}
+
+static inline void serialize_loc(struct serializer* serializer, struct file_loc* loc) {
+    serialize_string_ref(serializer, &loc->file_name);
+    serialize_string_ref(serializer, &loc->displayed_file_name);
+    SERIALIZE_VALUE(serializer, loc->displayed_line);
+    SERIALIZE_VALUE(serializer, loc->begin.row);
+    SERIALIZE_VALUE(serializer, loc->begin.col);
+    SERIALIZE_VALUE(serializer, loc->end.row);
+    SERIALIZE_VALUE(serializer, loc->end.col);
+}
+
+static void serialize_node(struct serializer* serializer, struct ast* ast) {
+    SERIALIZE_VALUE(serializer, ast->tag);
+    serialize_type_ref(serializer, &ast->type);
+    serialize_loc(serializer, &ast->loc);
+    serialize_ast_ref(serializer, &ast->next);
+    serialize_ast_ref(serializer, &ast->attrs);
+    switch (ast->tag) {
+        case AST_ERROR:
+        case AST_UNSIZED_DIM:
+        case AST_EMPTY_STMT:
+            break;
+        case AST_METADATUM:
+            serialize_ast_ref(serializer, &ast->metadatum.type);
+            serialize_string_ref(serializer, &ast->metadatum.name);
+            serialize_ast_ref(serializer, &ast->metadatum.init);
+            break;
+        case AST_ATTR:
+            serialize_string_ref(serializer, &ast->attr.name);
+            serialize_ast_ref(serializer, &ast->attr.args);
+            break;
+        case AST_PRIM_TYPE:
+            SERIALIZE_VALUE(serializer, ast->prim_type);
+            break;
+        case AST_CLOSURE_TYPE:
+            serialize_ast_ref(serializer, &ast->closure_type.inner_type);
+            break;
+        case AST_SHADER_TYPE:
+            SERIALIZE_VALUE(serializer, ast->shader_type);
+            break;
+        case AST_NAMED_TYPE:
+            serialize_string_ref(serializer, &ast->named_type.name);
+            serialize_ast_ref(serializer, &ast->named_type.symbol);
+            break;
+        case AST_BOOL_LITERAL:
+            SERIALIZE_VALUE(serializer, ast->bool_literal);
+            break;
+        case AST_INT_LITERAL:
+            SERIALIZE_VALUE(serializer, ast->int_literal);
+            break;
+        case AST_FLOAT_LITERAL:
+            serialize_float(serializer, &ast->float_literal);
+            break;
+        case AST_STRING_LITERAL:
+            serialize_string_ref(serializer, &ast->string_literal);
+            break;
+        case AST_SHADER_DECL:
+            serialize_ast_ref(serializer, &ast->shader_decl.type);
+            serialize_string_ref(serializer, &ast->shader_decl.name);
+            serialize_ast_ref(serializer, &ast->shader_decl.params);
+            serialize_ast_ref(serializer, &ast->shader_decl.body);
+            serialize_ast_ref(serializer, &ast->shader_decl.metadata);
+            break;
+        case AST_STRUCT_DECL:
+            serialize_string_ref(serializer, &ast->struct_decl.name);
+            serialize_ast_ref(serializer, &ast->struct_decl.fields);
+            serialize_type_ref(serializer, &ast->struct_decl.constructor_type);
+            break;
+        case AST_FUNC_DECL:
+            serialize_ast_ref(serializer, &ast->func_decl.ret_type);
+            serialize_string_ref(serializer, &ast->func_decl.name);
+            serialize_ast_ref(serializer, &ast->func_decl.params);
+            serialize_ast_ref(serializer, &ast->func_decl.body);
+            break;
+        case AST_VAR_DECL:
+            serialize_ast_ref(serializer, &ast->var_decl.type);
+            serialize_ast_ref(serializer, &ast->var_decl.vars);
+            break;
+        case AST_VAR:
+            serialize_string_ref(serializer, &ast->var.name);
+            serialize_ast_ref(serializer, &ast->var.dim);
+            serialize_ast_ref(serializer, &ast->var.init);
+            SERIALIZE_VALUE(serializer, ast->var.is_global);
+            break;
+        case AST_PARAM:
+            SERIALIZE_VALUE(serializer, ast->param.is_output);
+            SERIALIZE_VALUE(serializer, ast->param.is_ellipsis);
+            serialize_ast_ref(serializer, &ast->param.type);
+            serialize_string_ref(serializer, &ast->param.name);
+            serialize_ast_ref(serializer, &ast->param.dim);
+            serialize_ast_ref(serializer, &ast->param.init);
+            serialize_ast_ref(serializer, &ast->param.metadata);
+            break;
+        case AST_IDENT_EXPR:
+            serialize_string_ref(serializer, &ast->ident_expr.name);
+            serialize_ast_ref(serializer, &ast->ident_expr.symbol);
+            break;
+        case AST_BINARY_EXPR:
+            SERIALIZE_VALUE(serializer, ast->binary_expr.tag);
+            serialize_ast_ref(serializer, &ast->binary_expr.args);
+            serialize_ast_ref(serializer, &ast->binary_expr.symbol);
+            break;
+        case AST_UNARY_EXPR:
+            SERIALIZE_VALUE(serializer, ast->unary_expr.tag);
+            serialize_ast_ref(serializer, &ast->unary_expr.arg);
+            serialize_ast_ref(serializer, &ast->unary_expr.symbol);
+            break;
+        case AST_CALL_EXPR:
+            serialize_ast_ref(serializer, &ast->call_expr.callee);
+            serialize_ast_ref(serializer, &ast->call_expr.args);
+            break;
+        case AST_CONSTRUCT_EXPR:
+            serialize_ast_ref(serializer, &ast->construct_expr.type);
+            serialize_ast_ref(serializer, &ast->construct_expr.args);
+            SERIALIZE_VALUE(serializer, ast->construct_expr.constructor_type);
+            break;
+        case AST_PAREN_EXPR:
+            serialize_ast_ref(serializer, &ast->paren_expr.inner_expr);
+            break;
+        case AST_COMPOUND_EXPR:
+            serialize_ast_ref(serializer, &ast->compound_expr.elems);
+            break;
+        case AST_COMPOUND_INIT:
+            serialize_ast_ref(serializer, &ast->compound_init.elems);
+            serialize_ast_ref(serializer, &ast->compound_init.symbol);
+            break;
+        case AST_TERNARY_EXPR:
+            serialize_ast_ref(serializer, &ast->ternary_expr.cond);
+            serialize_ast_ref(serializer, &ast->ternary_expr.then_expr);
+            serialize_ast_ref(serializer, &ast->ternary_expr.else_expr);
+            break;
+        case AST_INDEX_EXPR:
+            serialize_ast_ref(serializer, &ast->index_expr.value);
+            serialize_ast_ref(serializer, &ast->index_expr.index);
+            break;
+        case AST_PROJ_EXPR:
+            serialize_ast_ref(serializer, &ast->proj_expr.value);
+            serialize_string_ref(serializer, &ast->proj_expr.elem);
+            SERIALIZE_VALUE(serializer, ast->proj_expr.index);
+            break;
+        case AST_CAST_EXPR:
+            serialize_ast_ref(serializer, &ast->cast_expr.type);
+            serialize_ast_ref(serializer, &ast->cast_expr.value);
+            break;
+        case AST_BLOCK:
+            serialize_ast_ref(serializer, &ast->block.stmts);
+            break;
+        case AST_WHILE_LOOP:
+            serialize_ast_ref(serializer, &ast->while_loop.cond);
+            serialize_ast_ref(serializer, &ast->while_loop.body);
+            break;
+        case AST_DO_WHILE_LOOP:
+            serialize_ast_ref(serializer, &ast->do_while_loop.cond);
+            serialize_ast_ref(serializer, &ast->do_while_loop.body);
+            break;
+        case AST_FOR_LOOP:
+            serialize_ast_ref(serializer, &ast->for_loop.cond);
+            serialize_ast_ref(serializer, &ast->for_loop.init);
+            serialize_ast_ref(serializer, &ast->for_loop.inc);
+            serialize_ast_ref(serializer, &ast->for_loop.body);
+            break;
+        case AST_IF_STMT:
+            serialize_ast_ref(serializer, &ast->if_stmt.cond);
+            serialize_ast_ref(serializer, &ast->if_stmt.then_stmt);
+            serialize_ast_ref(serializer, &ast->if_stmt.else_stmt);
+            break;
+        case AST_BREAK_STMT:
+            serialize_ast_ref(serializer, &ast->break_stmt.loop);
+            break;
+        case AST_CONTINUE_STMT:
+            serialize_ast_ref(serializer, &ast->continue_stmt.loop);
+            break;
+        case AST_RETURN_STMT:
+            serialize_ast_ref(serializer, &ast->return_stmt.value);
+            serialize_ast_ref(serializer, &ast->return_stmt.shader_or_func);
+            break;
+        default:
+            assert(serializer->is_reading && "invalid AST node");
+            serializer->reader->is_invalid = true;
+            break;
+    }
+}
+
+static inline void serialize_str_view(struct serializer* serializer, struct str_view* str_view) {
+    if (serializer->is_reading) {
+        const char* string = NULL;
+        serialize_string_ref(serializer, &string);
+        *str_view = string ? STR_VIEW(string) : (struct str_view) {};
+    } else {
+        // Views are not null-terminated, so they are interned to be stored like other strings.
+        const char* string = str_pool_insert_view(serializer->writer->str_pool, *str_view);
+        serialize_string_ref(serializer, &string);
+    }
+}
+
+static void serialize_macro_def_token(struct serializer* serializer, struct macro_def_token* token) {
+    SERIALIZE_VALUE(serializer, token->tag);
+    SERIALIZE_VALUE(serializer, token->on_new_line);
+    SERIALIZE_VALUE(serializer, token->has_space_before);
+    serialize_loc(serializer, &token->loc);
+    serialize_str_view(serializer, &token->contents);
+    switch (token->tag) {
+        case TOKEN_MACRO_PARAM:
+            SERIALIZE_VALUE(serializer, token->macro_param_index);
+            break;
+        case TOKEN_ERROR:
+            SERIALIZE_VALUE(serializer, token->error);
+            break;
+        default:
+            break;
+    }
+}
+
+static void serialize_macro_def(struct serializer* serializer, struct macro_def* macro_def) {
+    serialize_string_ref(serializer, &macro_def->name);
+    SERIALIZE_VALUE(serializer, macro_def->has_params);
+    SERIALIZE_VALUE(serializer, macro_def->is_variadic);
+    SERIALIZE_VALUE(serializer, macro_def->param_count);
+    serialize_loc(serializer, &macro_def->loc);
+    SERIALIZE_VALUE(serializer, macro_def->token_count);
+
+    struct macro_def_token* tokens = (struct macro_def_token*)macro_def->tokens;
+    if (serializer->is_reading) {
+        struct reader* reader = serializer->reader;
+        if (!macro_def->name || macro_def->token_count > reader->size) {
+            reader->is_invalid = true;
+            return;
+        }
+        tokens = MEM_POOL_ALLOC_ARRAY(*reader->mem_pool, macro_def->token_count, struct macro_def_token);
+        memset(tokens, 0, sizeof(struct macro_def_token) * macro_def->token_count);
+        macro_def->tokens = tokens;
+    }
+    for (size_t i = 0; i < macro_def->token_count; ++i)
+        serialize_macro_def_token(serializer, &tokens[i]);
+}
+
+static void serialize_pch_dep(struct serializer* serializer, struct pch_dep* pch_dep) {
+    serialize_string_ref(serializer, &pch_dep->file_name);
+    SERIALIZE_VALUE(serializer, pch_dep->content_hash);
+    SERIALIZE_VALUE(serializer, pch_dep->has_pragma_once);
+    if (serializer->is_reading && !pch_dep->file_name)
+        serializer->reader->is_invalid = true;
+}
+
+static void serialize_pch_define(struct serializer* serializer, struct pch_define* pch_define) {
+    serialize_string_ref(serializer, &pch_define->name);
+    serialize_string_ref(serializer, &pch_define->expansion);
+    if (serializer->is_reading && (!pch_define->name || !pch_define->expansion))
+        serializer->reader->is_invalid = true;
+}
+
+static inline void write_section(struct byte_vec* image, uint32_t count, const struct byte_vec* bytes) {
+    write_int(image, count);
+    write_bytes(image, bytes->elems, bytes->elem_count);
+}
+
+static struct writer create_writer(const struct image_base* base, struct str_pool* str_pool) {
+    return (struct writer) {
+        .base = base,
+        .str_pool = str_pool,
+        .strings = byte_vec_create(),
+        .types = byte_vec_create(),
+        .nodes = byte_vec_create(),
+        .string_indices = string_index_map_create(),
+        .type_indices = type_index_map_create(),
+        .ast_indices = ast_index_map_create(),
+        .pending_asts = ast_vec_create()
+    };
+}
+
+static void destroy_writer(struct writer* writer) {
+    ast_vec_destroy(&writer->pending_asts);
+    ast_index_map_destroy(&writer->ast_indices);
+    type_index_map_destroy(&writer->type_indices);
+    string_index_map_destroy(&writer->string_indices);
+    byte_vec_destroy(&writer->nodes);
+    byte_vec_destroy(&writer->types);
+    byte_vec_destroy(&writer->strings);
+}
+
+static void write_nodes(struct writer* writer, const struct ast* ast) {
+    struct serializer serializer = { .is_reading = false, .writer = writer };
+    write_ast(writer, ast);
+    for (size_t i = 0; i < writer->pending_asts.elem_count; ++i)
+        serialize_node(&serializer, writer->pending_asts.elems[i]);
+}
+
+static bool write_image(FILE* file, const char* magic, const struct writer* writer) {
+    struct byte_vec image = byte_vec_create();
+    write_bytes(&image, magic, sizeof(IMAGE_MAGIC));
+    write_int(&image, IMAGE_VERSION);
+    if (writer->base)
+        write_int(&image, writer->base->ast_count);
+    write_section(&image, writer->string_indices.elem_count, &writer->strings);
+    write_section(&image, writer->type_indices.elem_count, &writer->types);
+    write_section(&image, writer->ast_indices.elem_count, &writer->nodes);
+    bool is_ok = fwrite(image.elems, 1, image.elem_count, file) == image.elem_count;
+    byte_vec_destroy(&image);
+    return is_ok;
+}
+
+bool serialize_ast(FILE* file, const struct ast* ast) {
+    struct writer writer = create_writer(NULL, NULL);
+    write_nodes(&writer, ast);
+    bool is_ok = write_image(file, IMAGE_MAGIC, &writer);
+    destroy_writer(&writer);
+    return is_ok;
+}
+
+bool serialize_pch(FILE* file, const struct pch* pch, const struct image_base* base) {
+    struct mem_pool mem_pool = mem_pool_create();
+    struct str_pool* str_pool = str_pool_create(&mem_pool);
+    struct writer writer = create_writer(base ? base : &(struct image_base) {}, str_pool);
+    struct serializer serializer = { .is_reading = false, .writer = &writer };
+
+    write_nodes(&writer, pch->ast);
+    write_int(&writer.nodes, pch->dep_count);
+    for (size_t i = 0; i < pch->dep_count; ++i)
+        serialize_pch_dep(&serializer, (struct pch_dep*)&pch->deps[i]);
+    write_int(&writer.nodes, pch->macro_count);
+    for (size_t i = 0; i < pch->macro_count; ++i)
+        serialize_macro_def(&serializer, (struct macro_def*)&pch->macros[i]);
+    write_int(&writer.nodes, pch->define_count);
+    for (size_t i = 0; i < pch->define_count; ++i)
+        serialize_pch_define(&serializer, (struct pch_define*)&pch->defines[i]);
+
+    bool is_ok = write_image(file, PCH_MAGIC, &writer);
+    destroy_writer(&writer);
+    str_pool_destroy(str_pool);
+    mem_pool_destroy(&mem_pool);
+    return is_ok;
+}
+
+static inline bool read_header(struct reader* reader, const char* magic) {
+    const uint8_t* image_magic = read_bytes(reader, sizeof(IMAGE_MAGIC));
+    if (!image_magic || memcmp(image_magic, magic, sizeof(IMAGE_MAGIC)) || read_int(reader) != IMAGE_VERSION)
+        return false;
+    return !reader->base || read_int(reader) == reader->base->ast_count;
+}
+
+static inline bool read_strings(struct reader* reader) {
+    reader->string_count = read_int(reader);
+    if (reader->string_count > reader->size)
+        return false;
+    reader->strings = xmalloc(sizeof(const char*) * reader->string_count);
+    for (uint32_t i = 0; i < reader->string_count; ++i) {
+        uint32_t length = read_int(reader);
+        const uint8_t* string = read_bytes(reader, (size_t)length + 1);
+        if (!string || string[length] != 0)
+            return false;
+        reader->strings[i] = (const char*)string;
+    }
+    return !reader->is_invalid;
+}
+
+static inline bool read_types(struct reader* reader) {
+    uint32_t type_count = read_int(reader);
+    if (type_count > reader->size)
+        return false;
+    reader->types = xmalloc(sizeof(const struct type*) * type_count);
+    for (; reader->type_count < type_count; reader->type_count++) {
+        const struct type* type = read_type_record(reader);
+        if (!type)
+            return false;
+        reader->types[reader->type_count] = type;
+    }
+    return !reader->is_invalid;
+}
+
+static inline bool read_asts(struct reader* reader) {
+    reader->ast_count = read_int(reader);
+    if (reader->ast_count > reader->size)
+        return false;
+    reader->asts = MEM_POOL_ALLOC_ARRAY(*reader->mem_pool, reader->ast_count, struct ast);
+    memset(reader->asts, 0, sizeof(struct ast) * reader->ast_count);
+
+    struct serializer serializer = { .is_reading = true, .reader = reader };
+    for (uint32_t i = 0; i < reader->ast_count && !reader->is_invalid; ++i)
+        serialize_node(&serializer, &reader->asts[i]);
+    return !reader->is_invalid;
+}
+
+struct ast* deserialize_ast(
+    struct mem_pool* mem_pool,
+    struct type_table* type_table,
+    const uint8_t* data,
+    size_t size,
+    struct image_base* image_base)
+{
+    struct reader reader = {
+        .data = data,
+        .size = size,
+        .mem_pool = mem_pool,
+        .type_table = type_table
+    };
+    bool is_ok =
+        read_header(&reader, IMAGE_MAGIC) &&
+        read_strings(&reader) &&
+        read_types(&reader) &&
+        read_asts(&reader) &&
+        reader.ast_count > 0 &&
+        reader.pos == reader.size;
+    free(reader.types);
+    free(reader.strings);
+    if (is_ok && image_base)
+        *image_base = (struct image_base) { .asts = reader.asts, .ast_count = reader.ast_count };
+    return is_ok ? &reader.asts[0] : NULL;
+}
+
+static inline bool read_pch_environment(struct reader* reader, struct pch* pch) {
+    struct serializer serializer = { .is_reading = true, .reader = reader };
+
+    pch->dep_count = read_int(reader);
+    if (pch->dep_count > reader->size)
+        return false;
+    struct pch_dep* deps = MEM_POOL_ALLOC_ARRAY(*reader->mem_pool, pch->dep_count, struct pch_dep);
+    memset(deps, 0, sizeof(struct pch_dep) * pch->dep_count);
+    for (size_t i = 0; i < pch->dep_count && !reader->is_invalid; ++i)
+        serialize_pch_dep(&serializer, &deps[i]);
+    pch->deps = deps;
+
+    pch->macro_count = read_int(reader);
+    if (pch->macro_count > reader->size)
+        return false;
+    struct macro_def* macros = MEM_POOL_ALLOC_ARRAY(*reader->mem_pool, pch->macro_count, struct macro_def);
+    memset(macros, 0, sizeof(struct macro_def) * pch->macro_count);
+    for (size_t i = 0; i < pch->macro_count && !reader->is_invalid; ++i)
+        serialize_macro_def(&serializer, &macros[i]);
+    pch->macros = macros;
+
+    pch->define_count = read_int(reader);
+    if (pch->define_count > reader->size)
+        return false;
+    struct pch_define* defines = MEM_POOL_ALLOC_ARRAY(*reader->mem_pool, pch->define_count, struct pch_define);
+    memset(defines, 0, sizeof(struct pch_define) * pch->define_count);
+    for (size_t i = 0; i < pch->define_count && !reader->is_invalid; ++i)
+        serialize_pch_define(&serializer, &defines[i]);
+    pch->defines = defines;
+    return !reader->is_invalid;
+}
+
+bool deserialize_pch(
+    struct mem_pool* mem_pool,
+    struct type_table* type_table,
+    const struct image_base* base,
+    const uint8_t* data,
+    size_t size,
+    struct pch* pch)
+{
+    struct reader reader = {
+        .base = base ? base : &(struct image_base) {},
+        .data = data,
+        .size = size,
+        .mem_pool = mem_pool,
+        .type_table = type_table
+    };
+    bool is_ok =
+        read_header(&reader, PCH_MAGIC) &&
+        read_strings(&reader) &&
+        read_types(&reader) &&
+        read_asts(&reader) &&
+        read_pch_environment(&reader, pch) &&
+        reader.pos == reader.size;
+    free(reader.types);
+    free(reader.strings);
+    pch->ast = is_ok && reader.ast_count > 0 ? &reader.asts[0] : NULL;
+    return is_ok;
+}
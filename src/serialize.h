@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct ast;
+struct mem_pool;
+struct type_table;
+struct macro_def;
+
+// Nodes read from an image, which other images can refer to without containing them. Nodes of such a
+// base image are referred to by their index, so the same base must be used to read those images back.
+struct image_base {
+    struct ast* asts;
+    size_t ast_count;
+};
+
+// File used to build a precompiled header, with the hash of the contents it had at that time.
+struct pch_dep {
+    const char* file_name;
+    uint64_t content_hash;
+    bool has_pragma_once;
+};
+
+// Macro defined outside of the sources (by the session or on the command line) when a precompiled
+// header was built. The header can only be used with the same definitions.
+struct pch_define {
+    const char* name;
+    const char* expansion;
+};
+
+// Contents of a precompiled header: the checked declarations and the macros obtained at the end of a
+// header, along with the files it includes (the header itself comes first) and the macros it was
+// built with.
+struct pch {
+    struct ast* ast;
+    const struct pch_dep* deps;
+    size_t dep_count;
+    const struct macro_def* macros;
+    size_t macro_count;
+    const struct pch_define* defines;
+    size_t define_count;
+};
+
+// Writes a list of checked declarations, along with the types they use, in a binary format that can
+// only be read back by the same build of the compiler.
+[[nodiscard]] bool serialize_ast(FILE*, const struct ast*);
+
+// Reads back declarations written by `serialize_ast`, interning their types in the given type table.
+// The resulting AST points to strings stored in the given data, which must therefore outlive it.
+// Returns NULL if the data is not a valid image. When the last argument is not NULL, it receives the
+// nodes of the image, so that they can be used as the base of other images.
+[[nodiscard]] struct ast* deserialize_ast(
+    struct mem_pool*,
+    struct type_table*,
+    const uint8_t* data,
+    size_t size,
+    struct image_base*);
+
+// Writes a precompiled header. Its declarations can refer to the nodes of the given base image, which
+// can be NULL.
+[[nodiscard]] bool serialize_pch(FILE*, const struct pch*, const struct image_base*);
+
+// Reads back a precompiled header written by `serialize_pch` with the same base image. Like for
+// `deserialize_ast`, the result points to the given data. Returns false if the data is not valid.
+[[nodiscard]] bool deserialize_pch(
+    struct mem_pool*,
+    struct type_table*,
+    const struct image_base*,
+    const uint8_t* data,
+    size_t size,
+    struct pch*);
@@ -0,0 +1,286 @@
+#include "server.h"
+
+#include <overture/mem.h>
+#include <overture/vec.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Messages sent by the server are made of a kind, a 32-bit length, and a payload. Requests sent by
+// the client are made of a 32-bit string count, followed by the working directory of the client and
+// its arguments, each of them encoded as a 32-bit length and the contents of the string.
+enum message_kind {
+    MESSAGE_OUTPUT      = 'o',
+    MESSAGE_DIAGNOSTICS = 'e',
+    MESSAGE_EXIT        = 'x'
+};
+
+#define MAX_STRING_COUNT  UINT32_C(65536)
+#define MAX_STRING_LENGTH UINT32_C(1 << 20)
+
+struct server_connection {
+    int socket;
+    bool is_broken;
+};
+
+VEC_DEFINE(raw_str_vec, char*, PRIVATE)
+
+static bool write_bytes(int socket, const void* data, size_t size) {
+    const char* bytes = data;
+    while (size > 0) {
+        ssize_t written = write(socket, bytes, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        bytes += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+static bool read_bytes(int socket, void* data, size_t size) {
+    char* bytes = data;
+    while (size > 0) {
+        ssize_t read_count = read(socket, bytes, size);
+        if (read_count < 0 && errno == EINTR)
+            continue;
+        if (read_count <= 0)
+            return false;
+        bytes += read_count;
+        size -= (size_t)read_count;
+    }
+    return true;
+}
+
+static bool write_uint32(int socket, uint32_t value) {
+    return write_bytes(socket, &value, sizeof(value));
+}
+
+static bool read_uint32(int socket, uint32_t* value) {
+    return read_bytes(socket, value, sizeof(*value));
+}
+
+static bool write_string(int socket, const char* string) {
+    size_t length = strlen(string);
+    return length <= MAX_STRING_LENGTH && write_uint32(socket, (uint32_t)length) && write_bytes(socket, string, length);
+}
+
+static char* read_string(int socket) {
+    uint32_t length = 0;
+    if (!read_uint32(socket, &length) || length > MAX_STRING_LENGTH)
+        return NULL;
+    char* string = xmalloc(length + 1);
+    if (!read_bytes(socket, string, length)) {
+        free(string);
+        return NULL;
+    }
+    string[length] = 0;
+    return string;
+}
+
+static bool write_message(int socket, enum message_kind kind, const void* data, size_t size) {
+    uint8_t kind_byte = kind;
+    return
+        write_bytes(socket, &kind_byte, 1) &&
+        write_uint32(socket, (uint32_t)size) &&
+        write_bytes(socket, data, size);
+}
+
+static bool make_socket_address(const char* socket_path, struct sockaddr_un* address) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "socket path '%s' is too long\n", socket_path);
+        return false;
+    }
+    strcpy(address->sun_path, socket_path);
+    return true;
+}
+
+static int connect_to(const struct sockaddr_un* address) {
+    int client_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client_socket < 0)
+        return -1;
+    if (connect(client_socket, (const struct sockaddr*)address, sizeof(struct sockaddr_un)) != 0) {
+        close(client_socket);
+        return -1;
+    }
+    return client_socket;
+}
+
+static void free_strings(struct raw_str_vec* strings) {
+    VEC_FOREACH(char*, string, *strings) {
+        free(*string);
+    }
+    raw_str_vec_destroy(strings);
+}
+
+static bool read_request(int socket, struct raw_str_vec* strings) {
+    uint32_t string_count = 0;
+    if (!read_uint32(socket, &string_count) || string_count < 2 || string_count > MAX_STRING_COUNT)
+        return false;
+    for (uint32_t i = 0; i < string_count; ++i) {
+        char* string = read_string(socket);
+        if (!string)
+            return false;
+        raw_str_vec_push(strings, &string);
+    }
+    return true;
+}
+
+static void handle_request(int socket, server_handler handler, void* data) {
+    struct raw_str_vec strings = raw_str_vec_create();
+    if (!read_request(socket, &strings)) {
+        free_strings(&strings);
+        return;
+    }
+
+    // The handler is allowed to modify the argument array (e.g. when parsing options), so it gets
+    // a copy, terminated by NULL like the arguments of `main`.
+    int argc = (int)strings.elem_count - 1;
+    char** argv = xcalloc(argc + 1, sizeof(char*));
+    memcpy(argv, strings.elems + 1, sizeof(char*) * argc);
+
+    struct server_connection connection = { .socket = socket };
+    int32_t status = 1;
+    if (chdir(strings.elems[0]) == 0) {
+        status = handler(data, argc, argv, &connection);
+    } else {
+        static const char message[] = "cannot change to the working directory of the client\n";
+        server_send(&connection, SERVER_STREAM_DIAGNOSTICS, message, sizeof(message) - 1);
+    }
+    if (!connection.is_broken)
+        write_message(socket, MESSAGE_EXIT, &status, sizeof(status));
+
+    free(argv);
+    free_strings(&strings);
+}
+
+void server_run(const char* socket_path, server_handler handler, void* data) {
+    struct sockaddr_un address;
+    if (!make_socket_address(socket_path, &address))
+        return;
+
+    // Only remove the socket file if no other server is listening on it.
+    int other_server = connect_to(&address);
+    if (other_server >= 0) {
+        close(other_server);
+        fprintf(stderr, "another server is already listening on '%s'\n", socket_path);
+        return;
+    }
+    unlink(socket_path);
+
+    int server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_socket < 0 ||
+        bind(server_socket, (const struct sockaddr*)&address, sizeof(struct sockaddr_un)) != 0 ||
+        listen(server_socket, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "cannot listen on '%s'\n", socket_path);
+        if (server_socket >= 0)
+            close(server_socket);
+        return;
+    }
+
+    // Clients that disconnect in the middle of a request should not terminate the server.
+    signal(SIGPIPE, SIG_IGN);
+
+    while (true) {
+        int client_socket = accept(server_socket, NULL, NULL);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "cannot accept connections on '%s': %s\n", socket_path, strerror(errno));
+            break;
+        }
+        handle_request(client_socket, handler, data);
+        close(client_socket);
+    }
+
+    close(server_socket);
+    unlink(socket_path);
+}
+
+void server_send(
+    struct server_connection* connection,
+    enum server_stream stream,
+    const char* data,
+    size_t size)
+{
+    if (connection->is_broken || size == 0)
+        return;
+    enum message_kind kind = stream == SERVER_STREAM_OUTPUT ? MESSAGE_OUTPUT : MESSAGE_DIAGNOSTICS;
+    while (size > 0 && !connection->is_broken) {
+        size_t chunk_size = size < MAX_STRING_LENGTH ? size : MAX_STRING_LENGTH;
+        connection->is_broken = !write_message(connection->socket, kind, data, chunk_size);
+        data += chunk_size;
+        size -= chunk_size;
+    }
+}
+
+static bool send_request(int socket, int argc, char** argv) {
+    char* working_dir = getcwd(NULL, 0);
+    if (!working_dir)
+        return false;
+
+    bool status = write_uint32(socket, (uint32_t)argc + 1) && write_string(socket, working_dir);
+    for (int i = 0; i < argc && status; ++i)
+        status &= write_string(socket, argv[i]);
+    free(working_dir);
+    return status;
+}
+
+static bool receive_reply(int socket, int* exit_status) {
+    char buffer[4096];
+    while (true) {
+        uint8_t kind = 0;
+        uint32_t size = 0;
+        if (!read_bytes(socket, &kind, 1) || !read_uint32(socket, &size) || size > MAX_STRING_LENGTH)
+            return false;
+
+        if (kind == MESSAGE_EXIT) {
+            int32_t status = 0;
+            if (size != sizeof(status) || !read_bytes(socket, &status, sizeof(status)))
+                return false;
+            *exit_status = status;
+            return true;
+        }
+
+        FILE* file = kind == MESSAGE_OUTPUT ? stdout : stderr;
+        while (size > 0) {
+            size_t chunk_size = size < sizeof(buffer) ? size : sizeof(buffer);
+            if (!read_bytes(socket, buffer, chunk_size))
+                return false;
+            fwrite(buffer, 1, chunk_size, file);
+            size -= chunk_size;
+        }
+    }
+}
+
+int client_run(const char* socket_path, int argc, char** argv) {
+    struct sockaddr_un address;
+    if (!make_socket_address(socket_path, &address))
+        return -1;
+
+    int client_socket = connect_to(&address);
+    if (client_socket < 0) {
+        fprintf(stderr, "cannot connect to the server listening on '%s'\n", socket_path);
+        return -1;
+    }
+
+    int exit_status = -1;
+    if (!send_request(client_socket, argc, argv) || !receive_reply(client_socket, &exit_status)) {
+        fprintf(stderr, "lost connection to the server listening on '%s'\n", socket_path);
+        exit_status = -1;
+    }
+    close(client_socket);
+    return exit_status;
+}
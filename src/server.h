@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Transport used by the compile server: the client forwards its working directory and command-line
+// arguments over a local socket, and the server streams back the standard output, standard error,
+// and exit status of the request.
+
+enum server_stream {
+    SERVER_STREAM_OUTPUT,
+    SERVER_STREAM_DIAGNOSTICS
+};
+
+struct server_connection;
+
+// Handles a request. The arguments follow the same conventions as the arguments of `main`, and
+// must not be freed by the handler. The returned value is used as the exit status of the client.
+typedef int (*server_handler)(void* data, int argc, char** argv, struct server_connection*);
+
+// Listens on the given socket path and handles requests one after the other, in the working
+// directory of the client that sent them. The server never stops by itself: this only returns,
+// after printing an error, if the socket cannot be created, or if accepting a connection fails for
+// another reason than an interruption or an aborted connection, in which case the socket file is
+// removed.
+void server_run(const char* socket_path, server_handler handler, void* data);
+
+// Sends some text to the client, to be written on its standard output or standard error.
+void server_send(struct server_connection*, enum server_stream, const char* data, size_t size);
+
+// Forwards the given arguments to the server listening on the given socket path, and writes back
+// what the server sends on the standard output and standard error. Returns the exit status of the
+// request, or -1 if the server cannot be reached.
+[[nodiscard]] int client_run(const char* socket_path, int argc, char** argv);
@@ -0,0 +1,478 @@
+#include "session.h"
+#include "parse.h"
+#include "check.h"
+#include "type_table.h"
+#include "file_cache.h"
+#include "preprocessor.h"
+#include "serialize.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <overture/mem.h>
+#include <overture/mem_pool.h>
+#include <overture/log.h>
+#include <overture/vec.h>
+#include <overture/str.h>
+#include <overture/file.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+VEC_DEFINE(session_macro_vec, struct session_macro, PRIVATE)
+
+// Precompiled header loaded by a previous compilation. Its nodes and macros point to the contents of
+// its file, so it is only reused while that file has the same modification time and is not reloaded.
+struct loaded_pch {
+    const struct cached_file* file;
+    const char* file_data;
+    time_t modification_time;
+    const struct builtins* base;
+    struct pch pch;
+    struct cached_file** dep_files;
+    struct builtins* builtins;
+};
+
+struct session {
+    struct mem_pool mem_pool;
+    struct type_table* type_table;
+    struct file_cache* file_cache;
+    struct line_reader line_reader;
+    struct session_macro_vec default_macros;
+    const uint8_t* builtins_image;
+    size_t builtins_image_size;
+    struct builtins* builtins;
+    struct image_base builtins_image_base;
+    struct mem_pool pch_mem_pool;
+    struct loaded_pch loaded_pch;
+
+    // Memory of the last compilation, which the AST it returned depends on. The pool is reset rather
+    // than destroyed between compilations, so that its blocks are reused.
+    struct mem_pool compile_mem_pool;
+    struct cached_file_vec included_files;
+};
+
+static struct file_line read_line(void* data, const char* file_name, uint32_t line) {
+    struct file_cache* file_cache = data;
+
+    // Source locations refer to files by the name under which they are stored in the cache, which
+    // avoids resolving the path again for every line that is displayed.
+    struct cached_file* cached_file = file_cache_find_loaded(file_cache, file_name);
+    if (!cached_file)
+        cached_file = file_cache_read(file_cache, file_name);
+
+    struct str_view contents;
+    if (!cached_file || !cached_file_read_line(cached_file, line, &contents))
+        return (struct file_line) {};
+    return (struct file_line) {
+        .is_valid = true,
+        .contents = contents
+    };
+}
+
+static char* copy_string(const char* string) {
+    size_t length = strlen(string);
+    char* copy = xmalloc(length + 1);
+    memcpy(copy, string, length + 1);
+    return copy;
+}
+
+struct session* session_create(const uint8_t* builtins_image, size_t builtins_image_size) {
+    struct session* session = xcalloc(1, sizeof(struct session));
+    session->mem_pool = mem_pool_create();
+    session->type_table = type_table_create(&session->mem_pool);
+    session->file_cache = file_cache_create();
+    session->line_reader = (struct line_reader) {
+        .read_line = read_line,
+        .data = session->file_cache
+    };
+    session->default_macros = session_macro_vec_create();
+    session->builtins_image = builtins_image;
+    session->builtins_image_size = builtins_image_size;
+    session->pch_mem_pool = mem_pool_create();
+    session->compile_mem_pool = mem_pool_create();
+    session->included_files = cached_file_vec_create();
+    return session;
+}
+
+static void release_compilation(struct session* session) {
+    mem_pool_reset(&session->compile_mem_pool);
+    cached_file_vec_clear(&session->included_files);
+}
+
+void session_destroy(struct session* session) {
+    release_compilation(session);
+    mem_pool_destroy(&session->compile_mem_pool);
+    cached_file_vec_destroy(&session->included_files);
+    VEC_FOREACH(struct session_macro, macro, session->default_macros) {
+        free((char*)macro->name);
+        free((char*)macro->expansion);
+    }
+    session_macro_vec_destroy(&session->default_macros);
+    if (session->loaded_pch.builtins)
+        builtins_destroy(session->loaded_pch.builtins);
+    mem_pool_destroy(&session->pch_mem_pool);
+    if (session->builtins)
+        builtins_destroy(session->builtins);
+    file_cache_destroy(session->file_cache);
+    type_table_destroy(session->type_table);
+    mem_pool_destroy(&session->mem_pool);
+    free(session);
+}
+
+void session_define_macro(struct session* session, const char* name, const char* expansion) {
+    struct session_macro macro = {
+        .name = copy_string(name),
+        .expansion = copy_string(expansion)
+    };
+    session_macro_vec_push(&session->default_macros, &macro);
+}
+
+size_t session_revalidate(struct session* session) {
+    return file_cache_revalidate(session->file_cache);
+}
+
+void session_disable_file_mapping(struct session* session) {
+    file_cache_disable_mapping(session->file_cache);
+}
+
+void session_insert_file(struct session* session, const char* file_name, const char* data, size_t size) {
+    file_cache_insert(session->file_cache, file_name, (struct str_view) { .data = data, .length = size });
+}
+
+void session_set_include_resolver(struct session* session, const struct include_resolver* include_resolver) {
+    file_cache_set_include_resolver(session->file_cache, include_resolver);
+}
+
+const struct line_reader* session_line_reader(const struct session* session) {
+    return &session->line_reader;
+}
+
+const struct cached_file_vec* session_included_files(const struct session* session) {
+    return &session->included_files;
+}
+
+static void register_standard_macros(struct preprocessor* preprocessor) {
+    preprocessor_register_macro(preprocessor, "M_PI",       "3.1415926535897932");
+    preprocessor_register_macro(preprocessor, "M_PI_2",     "1.5707963267948966");
+    preprocessor_register_macro(preprocessor, "M_PI_4",     "0.7853981633974483");
+    preprocessor_register_macro(preprocessor, "M_2_PI",     "0.6366197723675813");
+    preprocessor_register_macro(preprocessor, "M_2PI",      "6.2831853071795865");
+    preprocessor_register_macro(preprocessor, "M_4PI",      "12.566370614359173");
+    preprocessor_register_macro(preprocessor, "M_2_SQRTPI", "1.1283791670955126");
+    preprocessor_register_macro(preprocessor, "M_E",        "2.7182818284590452");
+    preprocessor_register_macro(preprocessor, "M_LN2",      "0.6931471805599453");
+    preprocessor_register_macro(preprocessor, "M_LN10",     "2.3025850929940457");
+    preprocessor_register_macro(preprocessor, "M_LOG2E",    "1.4426950408889634");
+    preprocessor_register_macro(preprocessor, "M_LOG10E",   "0.4342944819032518");
+    preprocessor_register_macro(preprocessor, "M_SQRT2",    "1.4142135623730950");
+    preprocessor_register_macro(preprocessor, "M_SQRT1_2",  "0.7071067811865475");
+
+#define STR(x) #x
+#define STRINGIFY(x) STR(x)
+
+    preprocessor_register_macro(preprocessor, "NOSL_VERSION_MAJOR", STRINGIFY(NOSL_VERSION_MINOR));
+    preprocessor_register_macro(preprocessor, "NOSL_VERSION_MINOR", STRINGIFY(NOSL_VERSION_MINOR));
+    preprocessor_register_macro(preprocessor, "NOSL_VERSION_PATCH", STRINGIFY(NOSL_VERSION_PATCH));
+
+#undef STRINGIFY
+#undef STR
+
+    struct str full_version = str_create();
+    str_printf(&full_version, "%d", 10000 * NOSL_VERSION_MAJOR + 100 * NOSL_VERSION_MINOR + NOSL_VERSION_PATCH);
+    preprocessor_register_macro(preprocessor, "NOSL_VERSION", str_terminate(&full_version));
+    str_destroy(&full_version);
+}
+
+static void register_macros(
+    struct preprocessor* preprocessor,
+    const struct session_macro* macros,
+    size_t macro_count)
+{
+    for (size_t i = 0; i < macro_count; ++i)
+        preprocessor_register_macro(preprocessor, macros[i].name, macros[i].expansion);
+}
+
+static const struct builtins* load_builtins(struct session* session) {
+    // The image is generated at build time from the already checked built-ins, so there is no need
+    // to parse or check them again.
+    if (!session->builtins && session->builtins_image) {
+        struct ast* builtins_ast = deserialize_ast(&session->mem_pool, session->type_table,
+            session->builtins_image, session->builtins_image_size, &session->builtins_image_base);
+        assert(builtins_ast && "invalid built-ins image");
+        session->builtins = builtins_create(NULL, builtins_ast);
+    }
+    return session->builtins;
+}
+
+// Returns the macros that are defined before the sources: the default macros of the session, followed
+// by the ones of the compilation. The array must be freed by the caller.
+static struct pch_define* collect_pch_defines(
+    const struct session* session,
+    const struct compile_options* options,
+    size_t* define_count)
+{
+    *define_count = session->default_macros.elem_count + options->macro_count;
+    struct pch_define* defines = xmalloc(sizeof(struct pch_define) * *define_count);
+    for (size_t i = 0; i < session->default_macros.elem_count; ++i) {
+        defines[i] = (struct pch_define) {
+            .name = session->default_macros.elems[i].name,
+            .expansion = session->default_macros.elems[i].expansion
+        };
+    }
+    for (size_t i = 0; i < options->macro_count; ++i) {
+        defines[session->default_macros.elem_count + i] = (struct pch_define) {
+            .name = options->macros[i].name,
+            .expansion = options->macros[i].expansion
+        };
+    }
+    return defines;
+}
+
+static void write_pch(
+    const char* file_name,
+    const struct session* session,
+    const struct compile_options* options,
+    struct preprocessor* preprocessor,
+    struct ast* ast,
+    const struct image_base* image_base,
+    struct log* log)
+{
+    FILE* file = fopen(file_name, "wb");
+    if (!file) {
+        log_error(log, NULL, "cannot open '%s' for writing", file_name);
+        return;
+    }
+
+    const struct cached_file_vec* included_files = preprocessor_included_files(preprocessor);
+    struct pch_dep* deps = xmalloc(sizeof(struct pch_dep) * included_files->elem_count);
+    for (size_t i = 0; i < included_files->elem_count; ++i) {
+        struct cached_file* cached_file = included_files->elems[i];
+        deps[i] = (struct pch_dep) {
+            .file_name = cached_file->file_name,
+            .content_hash = cached_file_content_hash(cached_file),
+            .has_pragma_once = cached_file->has_pragma_once
+        };
+    }
+
+    size_t define_count = 0;
+    struct pch_define* defines = collect_pch_defines(session, options, &define_count);
+    struct macro_def_vec macros = preprocessor_export_macros(preprocessor);
+    struct pch pch = {
+        .ast = ast,
+        .deps = deps,
+        .dep_count = included_files->elem_count,
+        .macros = macros.elems,
+        .macro_count = macros.elem_count,
+        .defines = defines,
+        .define_count = define_count
+    };
+    if (!serialize_pch(file, &pch, image_base))
+        log_error(log, NULL, "cannot write precompiled header to '%s'", file_name);
+    macro_def_vec_destroy(&macros);
+    free(defines);
+    free(deps);
+    fclose(file);
+}
+
+// Checks that a precompiled header was built with the same macros as the current compilation, since
+// they may have changed its contents. Like GCC, the header is rejected otherwise.
+static bool check_pch_defines(
+    const char* file_name,
+    const struct pch* pch,
+    const struct session* session,
+    const struct compile_options* options,
+    struct log* log)
+{
+    size_t define_count = 0;
+    struct pch_define* defines = collect_pch_defines(session, options, &define_count);
+    size_t same_count = 0;
+    while (same_count < define_count && same_count < pch->define_count &&
+        !strcmp(defines[same_count].name, pch->defines[same_count].name) &&
+        !strcmp(defines[same_count].expansion, pch->defines[same_count].expansion))
+        same_count++;
+
+    bool is_ok = same_count == define_count && same_count == pch->define_count;
+    if (!is_ok) {
+        log_error(log, NULL, "precompiled header '%s' was built with different macros", file_name);
+        if (same_count < pch->define_count) {
+            log_note(log, NULL, "it was built with macro '%s' defined as '%s'",
+                pch->defines[same_count].name, pch->defines[same_count].expansion);
+        } else {
+            log_note(log, NULL, "it was built without macro '%s'", defines[same_count].name);
+        }
+    }
+    free(defines);
+    return is_ok;
+}
+
+// Deserializes a precompiled header into the memory of the session, replacing the one loaded before.
+static bool load_pch(struct session* session, struct cached_file* pch_file, const struct builtins* builtins) {
+    struct loaded_pch* loaded_pch = &session->loaded_pch;
+    if (loaded_pch->builtins)
+        builtins_destroy(loaded_pch->builtins);
+    mem_pool_reset(&session->pch_mem_pool);
+    *loaded_pch = (struct loaded_pch) {};
+
+    struct pch pch;
+    const struct image_base* image_base = builtins ? &session->builtins_image_base : NULL;
+    if (!deserialize_pch(&session->pch_mem_pool, session->type_table, image_base,
+        (const uint8_t*)pch_file->file_data.data, pch_file->file_data.length, &pch))
+        return false;
+
+    // Dependencies are looked up when the header is first used.
+    struct cached_file** dep_files = MEM_POOL_ALLOC_ARRAY(session->pch_mem_pool, pch.dep_count, struct cached_file*);
+    memset(dep_files, 0, sizeof(struct cached_file*) * pch.dep_count);
+    *loaded_pch = (struct loaded_pch) {
+        .file = pch_file,
+        .file_data = pch_file->file_data.data,
+        .modification_time = pch_file->modification_time,
+        .base = builtins,
+        .pch = pch,
+        .dep_files = dep_files,
+        .builtins = builtins_create(builtins, pch.ast)
+    };
+    return true;
+}
+
+// Loads a precompiled header and defines its macros in the given preprocessor. Its declarations are
+// returned as built-ins that extend the given ones. Returns NULL if the precompiled header cannot be
+// used, for instance because one of the files it was built from has changed. The header is kept in
+// the session, so that compiling several files with it only reads it once.
+static const struct builtins* include_pch(
+    const char* file_name,
+    struct session* session,
+    const struct compile_options* options,
+    const struct builtins* builtins,
+    struct preprocessor* preprocessor,
+    struct log* log)
+{
+    struct cached_file* pch_file = file_cache_read(session->file_cache, file_name);
+    if (!pch_file) {
+        log_error(log, NULL, "cannot open precompiled header '%s'", file_name);
+        return NULL;
+    }
+
+    // Files are reloaded in place, so the address of their data tells whether they were reloaded.
+    struct loaded_pch* loaded_pch = &session->loaded_pch;
+    bool is_loaded =
+        loaded_pch->file == pch_file &&
+        loaded_pch->file_data == pch_file->file_data.data &&
+        loaded_pch->modification_time == pch_file->modification_time &&
+        loaded_pch->base == builtins;
+    if (!is_loaded && !load_pch(session, pch_file, builtins)) {
+        // The number of built-in nodes is part of the header, so headers that were built with a
+        // different built-ins configuration are rejected as well.
+        log_error(log, NULL, "invalid precompiled header '%s'", file_name);
+        log_note(log, NULL, "it may have been built %s built-ins", builtins ? "without" : "with");
+        return NULL;
+    }
+
+    const struct pch* pch = &loaded_pch->pch;
+    if (!check_pch_defines(file_name, pch, session, options, log))
+        return NULL;
+
+    // Only files that were reloaded since the last compilation need to be looked up again.
+    for (size_t i = 0; i < pch->dep_count; ++i) {
+        struct cached_file* cached_file = loaded_pch->dep_files[i];
+        if (!cached_file || cached_file->is_stale)
+            cached_file = loaded_pch->dep_files[i] = file_cache_read(session->file_cache, pch->deps[i].file_name);
+        if (!cached_file || cached_file_content_hash(cached_file) != pch->deps[i].content_hash) {
+            log_error(log, NULL, "precompiled header '%s' is out of date, because '%s' has changed",
+                file_name, pch->deps[i].file_name);
+            return NULL;
+        }
+        cached_file->has_pragma_once |= pch->deps[i].has_pragma_once;
+    }
+
+    preprocessor_import_macros(preprocessor, pch->macros, pch->macro_count);
+    return loaded_pch->builtins;
+}
+
+static struct ast* compile(
+    struct session* session,
+    const char* file_name,
+    const struct compile_options* options,
+    struct log* log,
+    struct stats* stats)
+{
+    static const char* const no_include_dirs[] = { NULL };
+    const char* const* include_dirs = options->include_dirs ? options->include_dirs : no_include_dirs;
+    struct preprocessor* preprocessor = preprocessor_open(
+        &session->compile_mem_pool, log, session->file_cache, file_name, include_dirs, stats);
+    assert(preprocessor);
+
+    register_standard_macros(preprocessor);
+    register_macros(preprocessor, session->default_macros.elems, session->default_macros.elem_count);
+    register_macros(preprocessor, options->macros, options->macro_count);
+
+    // The preprocessor runs on demand during parsing, and measures its own time.
+    size_t type_count = type_table_type_count(session->type_table);
+    uint64_t preprocess_time = stats ? stats->phase_times[PHASE_PREPROCESS] : 0;
+    uint64_t compile_begin_time = stats_time();
+
+    const struct builtins* builtins = options->disable_builtins ? NULL : load_builtins(session);
+    if (options->pch_file)
+        builtins = include_pch(options->pch_file, session, options, builtins, preprocessor, log);
+
+    struct ast* first_decl = !options->pch_file || builtins
+        ? parse_with_preprocessor(&session->compile_mem_pool, preprocessor, log, stats) : NULL;
+    uint64_t phase_begin_time = stats_end_phase(stats, PHASE_PARSE, compile_begin_time);
+    if (stats)
+        stats->phase_times[PHASE_PARSE] -= stats->phase_times[PHASE_PREPROCESS] - preprocess_time;
+
+    if (first_decl) {
+        check(&session->compile_mem_pool, session->type_table, builtins, first_decl, log, stats);
+        stats_end_phase(stats, PHASE_CHECK, phase_begin_time);
+    }
+
+    // Headers that only define macros do not have any declaration, but still make a valid
+    // precompiled header.
+    if (options->pch_output_file && log->error_count == 0) {
+        const struct image_base* image_base = builtins ? &session->builtins_image_base : NULL;
+        write_pch(options->pch_output_file, session, options, preprocessor, first_decl, image_base, log);
+    }
+
+    // Included files are kept, so that dependencies can be reported without preprocessing again.
+    VEC_FOREACH(struct cached_file*, cached_file, *preprocessor_included_files(preprocessor)) {
+        cached_file_vec_push(&session->included_files, cached_file);
+    }
+    preprocessor_close(preprocessor);
+
+    if (stats)
+        stats->counters[COUNTER_TYPES_INTERNED] += type_table_type_count(session->type_table) - type_count;
+    if (stats_trace(stats))
+        trace_add_event(stats->trace, TRACE_TRACK_COMPILER, "compile", file_name, compile_begin_time, stats_time());
+    return first_decl;
+}
+
+struct ast* session_compile_file(
+    struct session* session,
+    const char* file_name,
+    const struct compile_options* options,
+    struct log* log,
+    struct stats* stats)
+{
+    release_compilation(session);
+    if (!is_file(file_name) || !file_exists(file_name)) {
+        log_error(log, NULL, "cannot open '%s'\n", file_name);
+        return NULL;
+    }
+    return compile(session, file_name, options, log, stats);
+}
+
+struct ast* session_compile_buffer(
+    struct session* session,
+    const char* file_name,
+    const char* data,
+    size_t size,
+    const struct compile_options* options,
+    struct log* log,
+    struct stats* stats)
+{
+    // The previous compilation may refer to the data of the file that is replaced.
+    release_compilation(session);
+    session_insert_file(session, file_name, data, size);
+    return compile(session, file_name, options, log, stats);
+}
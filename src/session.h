@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A compilation session owns everything that can be shared between compilations: the file cache,
+// the type table, the built-ins, and the default macros. Files can be compiled repeatedly with the
+// same session, which only loads the built-ins once. A session must only be used by one thread at a
+// time.
+
+struct ast;
+struct log;
+struct stats;
+struct line_reader;
+struct include_resolver;
+struct cached_file_vec;
+struct session;
+
+struct session_macro {
+    const char* name;
+    const char* expansion;
+};
+
+struct compile_options {
+    const char* const* include_dirs; // Terminated by NULL, or NULL if there are none.
+    const struct session_macro* macros; // Defined after the default macros of the session.
+    size_t macro_count;
+    const char* pch_file;
+    const char* pch_output_file;
+    bool disable_builtins;
+};
+
+// Creates a session that uses the given built-ins image, which can be NULL, and which must outlive
+// the session. The built-ins are only loaded by the first compilation that needs them.
+[[nodiscard]] struct session* session_create(const uint8_t* builtins_image, size_t builtins_image_size);
+void session_destroy(struct session*);
+
+// Adds a macro that is defined in every file compiled afterwards. The strings are copied.
+void session_define_macro(struct session*, const char* name, const char* expansion);
+
+// Checks whether files have changed on disk since they were last read. See `file_cache_revalidate`.
+// Files are mapped in memory by default, so a file truncated or rewritten in place by another process
+// can still raise SIGBUS if it is accessed before that: long-lived sessions should disable mapping.
+size_t session_revalidate(struct session*);
+
+// Makes the session read files instead of mapping them. See `file_cache_disable_mapping`.
+void session_disable_file_mapping(struct session*);
+
+// Adds a file with the given contents to the session, so that it can be compiled or included without
+// reading it from disk. See `file_cache_insert`.
+void session_insert_file(struct session*, const char* file_name, const char* data, size_t size);
+
+// Sets the resolver used to find included files that are not in the session, or removes it if NULL.
+void session_set_include_resolver(struct session*, const struct include_resolver*);
+
+// Returns a line reader that displays lines of the files compiled in this session, to be used in the
+// log passed to `session_compile_file`.
+[[nodiscard]] const struct line_reader* session_line_reader(const struct session*);
+
+// Parses and checks the given file. Returns the first declaration of the file, which remains valid
+// until the next compilation, or NULL if the file could not be parsed. Errors are reported in the
+// given log, and statistics are collected in the given object, unless it is NULL.
+struct ast* session_compile_file(
+    struct session*,
+    const char* file_name,
+    const struct compile_options*,
+    struct log*,
+    struct stats*);
+
+// Returns the files opened by the last compilation, starting with the compiled file, in the order in
+// which they were first included. This does not contain the files of a precompiled header.
+[[nodiscard]] const struct cached_file_vec* session_included_files(const struct session*);
+
+// Same as `session_compile_file`, but compiles the given contents, under the given file name. The
+// file is inserted in the session, and relative includes are looked up from its directory.
+struct ast* session_compile_buffer(
+    struct session*,
+    const char* file_name,
+    const char* data,
+    size_t size,
+    const struct compile_options*,
+    struct log*,
+    struct stats*);
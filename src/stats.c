@@ -0,0 +1,97 @@
+#include "stats.h"
+#include "trace.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+
+const char* phase_to_string(enum phase phase) {
+    switch (phase) {
+#define x(tag, str) case PHASE_##tag: return str;
+        PHASE_LIST(x)
+#undef x
+        default:
+            assert(false && "invalid phase");
+            return NULL;
+    }
+}
+
+uint64_t stats_time(void) {
+    struct timespec timespec;
+    clock_gettime(CLOCK_MONOTONIC, &timespec);
+    return (uint64_t)timespec.tv_sec * UINT64_C(1000000000) + (uint64_t)timespec.tv_nsec;
+}
+
+uint64_t stats_end_phase(struct stats* stats, enum phase phase, uint64_t begin_time) {
+    uint64_t end_time = stats_time();
+    if (stats)
+        stats->phase_times[phase] += end_time - begin_time;
+    if (stats_trace(stats))
+        trace_add_event(stats->trace, TRACE_TRACK_COMPILER, "phase", phase_to_string(phase), begin_time, end_time);
+    return end_time;
+}
+
+void stats_accumulate(struct stats* stats, const struct stats* other) {
+    for (size_t i = 0; i < PHASE_COUNT; ++i)
+        stats->phase_times[i] += other->phase_times[i];
+    for (size_t i = 0; i < COUNTER_COUNT; ++i)
+        stats->counters[i] += other->counters[i];
+}
+
+static inline double to_milliseconds(uint64_t time) {
+    return (double)time * 1.0e-6;
+}
+
+void stats_print(FILE* file, const char* title, const struct stats* stats) {
+    fprintf(file, "%s\n", title);
+
+    uint64_t total_time = 0;
+#define x(tag, str) \
+    fprintf(file, "  %-22s %10.3f ms\n", str, to_milliseconds(stats->phase_times[PHASE_##tag])); \
+    total_time += stats->phase_times[PHASE_##tag];
+    PHASE_LIST(x)
+#undef x
+    fprintf(file, "  %-22s %10.3f ms\n", "total", to_milliseconds(total_time));
+
+#define x(tag, json_str, str) \
+    fprintf(file, "  %-22s %10"PRIu64"\n", str, stats->counters[COUNTER_##tag]);
+    COUNTER_LIST(x)
+#undef x
+}
+
+static void print_json_string(FILE* file, const char* string) {
+    fputc('"', file);
+    for (; *string; ++string) {
+        unsigned char c = *string;
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+void stats_print_json(FILE* file, const char* name, const struct stats* stats) {
+    fputs("{\"name\":", file);
+    print_json_string(file, name);
+
+    const char* separator = "";
+    fputs(",\"phases_ms\":{", file);
+#define x(tag, str) \
+    fprintf(file, "%s\"%s\":%.6f", separator, str, to_milliseconds(stats->phase_times[PHASE_##tag])); \
+    separator = ",";
+    PHASE_LIST(x)
+#undef x
+
+    separator = "";
+    fputs("},\"counters\":{", file);
+#define x(tag, json_str, ...) \
+    fprintf(file, "%s\"%s\":%"PRIu64, separator, json_str, stats->counters[COUNTER_##tag]); \
+    separator = ",";
+    COUNTER_LIST(x)
+#undef x
+    fputs("}}", file);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Time spent in each phase of the compilation, and counters that give an idea of the amount of work
+// done in each of them. Preprocessing is timed separately from parsing, even though the parser pulls
+// tokens from the preprocessor on demand.
+
+#define PHASE_LIST(x) \
+    x(PREPROCESS, "preprocess") \
+    x(PARSE,      "parse") \
+    x(CHECK,      "check") \
+    x(PRINT,      "print")
+
+#define COUNTER_LIST(x) \
+    x(TOKENS_LEXED,         "tokens_lexed",         "tokens lexed") \
+    x(MACROS_EXPANDED,      "macros_expanded",      "macros expanded") \
+    x(CONTEXTS_PUSHED,      "contexts_pushed",      "contexts pushed") \
+    x(ALLOCATIONS_AVOIDED,  "allocations_avoided",  "allocations avoided") \
+    x(AST_NODES,            "ast_nodes",            "AST nodes allocated") \
+    x(TYPES_INTERNED,       "types_interned",       "types interned") \
+    x(OVERLOAD_RESOLUTIONS, "overload_resolutions", "overload resolutions") \
+    x(OVERLOADS_MEMOIZED,   "overloads_memoized",   "overload resolutions memoized")
+
+enum phase {
+#define x(name, ...) PHASE_##name,
+    PHASE_LIST(x)
+#undef x
+    PHASE_COUNT
+};
+
+enum counter {
+#define x(name, ...) COUNTER_##name,
+    COUNTER_LIST(x)
+#undef x
+    COUNTER_COUNT
+};
+
+struct trace;
+
+struct stats {
+    uint64_t phase_times[PHASE_COUNT];
+    uint64_t counters[COUNTER_COUNT];
+    struct trace* trace; // Optional, records the events happening during the compilation.
+};
+
+static inline struct trace* stats_trace(const struct stats* stats) {
+    return stats ? stats->trace : NULL;
+}
+
+[[nodiscard]] const char* phase_to_string(enum phase);
+
+// Returns a monotonic time, in nanoseconds.
+[[nodiscard]] uint64_t stats_time(void);
+
+// Adds the time elapsed since the beginning of the given phase to the statistics, unless they are
+// NULL, and records the phase in the trace. Returns the time at which the phase ended.
+uint64_t stats_end_phase(struct stats*, enum phase, uint64_t begin_time);
+
+void stats_accumulate(struct stats*, const struct stats* other);
+
+// Prints the statistics in a human-readable form. The title is printed before the statistics.
+void stats_print(FILE*, const char* title, const struct stats*);
+
+// Prints the statistics as a JSON object, with the given name stored in a "name" field.
+void stats_print_json(FILE*, const char* name, const struct stats*);
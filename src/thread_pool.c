@@ -0,0 +1,138 @@
+#include "thread_pool.h"
+
+#include <overture/mem.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct task_range {
+    pthread_mutex_t mutex;
+    size_t begin;
+    size_t end;
+};
+
+struct worker {
+    struct thread_pool* thread_pool;
+    size_t index;
+    bool is_started;
+    pthread_t thread;
+};
+
+struct thread_pool {
+    thread_pool_task task;
+    void* data;
+    size_t thread_count;
+    struct worker* workers;
+    struct task_range* task_ranges;
+    bool* is_task_done;
+    pthread_mutex_t done_mutex;
+    pthread_cond_t done_cond;
+};
+
+static inline bool pop_task(struct task_range* task_range, size_t* task_index) {
+    pthread_mutex_lock(&task_range->mutex);
+    bool has_task = task_range->begin < task_range->end;
+    if (has_task)
+        *task_index = task_range->begin++;
+    pthread_mutex_unlock(&task_range->mutex);
+    return has_task;
+}
+
+static inline bool steal_task(struct task_range* task_range, size_t* task_index) {
+    pthread_mutex_lock(&task_range->mutex);
+    bool has_task = task_range->begin < task_range->end;
+    if (has_task)
+        *task_index = --task_range->end;
+    pthread_mutex_unlock(&task_range->mutex);
+    return has_task;
+}
+
+static inline bool find_task(struct thread_pool* thread_pool, size_t thread_index, size_t* task_index) {
+    if (pop_task(&thread_pool->task_ranges[thread_index], task_index))
+        return true;
+    for (size_t i = 1; i < thread_pool->thread_count; ++i) {
+        size_t victim_index = (thread_index + i) % thread_pool->thread_count;
+        if (steal_task(&thread_pool->task_ranges[victim_index], task_index))
+            return true;
+    }
+    return false;
+}
+
+static void* run_worker(void* data) {
+    struct worker* worker = data;
+    struct thread_pool* thread_pool = worker->thread_pool;
+    size_t task_index;
+    while (find_task(thread_pool, worker->index, &task_index)) {
+        thread_pool->task(thread_pool->data, task_index, worker->index);
+
+        pthread_mutex_lock(&thread_pool->done_mutex);
+        thread_pool->is_task_done[task_index] = true;
+        pthread_cond_broadcast(&thread_pool->done_cond);
+        pthread_mutex_unlock(&thread_pool->done_mutex);
+    }
+    return NULL;
+}
+
+struct thread_pool* thread_pool_create(
+    size_t thread_count,
+    size_t task_count,
+    thread_pool_task task,
+    void* data)
+{
+    if (thread_count == 0)
+        thread_count = 1;
+
+    struct thread_pool* thread_pool = xmalloc(sizeof(struct thread_pool));
+    thread_pool->task = task;
+    thread_pool->data = data;
+    thread_pool->thread_count = thread_count;
+    thread_pool->is_task_done = xcalloc(task_count ? task_count : 1, sizeof(bool));
+    thread_pool->task_ranges = xmalloc(sizeof(struct task_range) * thread_count);
+    thread_pool->workers = xmalloc(sizeof(struct worker) * thread_count);
+    pthread_mutex_init(&thread_pool->done_mutex, NULL);
+    pthread_cond_init(&thread_pool->done_cond, NULL);
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        pthread_mutex_init(&thread_pool->task_ranges[i].mutex, NULL);
+        thread_pool->task_ranges[i].begin = task_count * i / thread_count;
+        thread_pool->task_ranges[i].end = task_count * (i + 1) / thread_count;
+    }
+
+    size_t started_count = 0;
+    for (size_t i = 0; i < thread_count; ++i) {
+        struct worker* worker = &thread_pool->workers[i];
+        worker->thread_pool = thread_pool;
+        worker->index = i;
+        worker->is_started = pthread_create(&worker->thread, NULL, run_worker, worker) == 0;
+        started_count += worker->is_started ? 1 : 0;
+    }
+
+    // The tasks of threads that could not be started are stolen by the other ones. If no thread
+    // could be started at all, run everything on the calling thread.
+    if (started_count == 0)
+        run_worker(&thread_pool->workers[0]);
+    return thread_pool;
+}
+
+void thread_pool_wait(struct thread_pool* thread_pool, size_t task_index) {
+    pthread_mutex_lock(&thread_pool->done_mutex);
+    while (!thread_pool->is_task_done[task_index])
+        pthread_cond_wait(&thread_pool->done_cond, &thread_pool->done_mutex);
+    pthread_mutex_unlock(&thread_pool->done_mutex);
+}
+
+void thread_pool_destroy(struct thread_pool* thread_pool) {
+    for (size_t i = 0; i < thread_pool->thread_count; ++i) {
+        if (thread_pool->workers[i].is_started)
+            pthread_join(thread_pool->workers[i].thread, NULL);
+    }
+    for (size_t i = 0; i < thread_pool->thread_count; ++i)
+        pthread_mutex_destroy(&thread_pool->task_ranges[i].mutex);
+    pthread_cond_destroy(&thread_pool->done_cond);
+    pthread_mutex_destroy(&thread_pool->done_mutex);
+    free(thread_pool->workers);
+    free(thread_pool->task_ranges);
+    free(thread_pool->is_task_done);
+    free(thread_pool);
+}
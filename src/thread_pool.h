@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+
+// Runs a fixed number of tasks on a pool of threads. Each thread starts with a contiguous range of
+// tasks, that it executes in order, and steals tasks from the end of the ranges of other threads
+// when it runs out of work.
+
+struct thread_pool;
+
+typedef void (*thread_pool_task)(void* data, size_t task_index, size_t thread_index);
+
+[[nodiscard]] struct thread_pool* thread_pool_create(
+    size_t thread_count,
+    size_t task_count,
+    thread_pool_task task,
+    void* data);
+
+// Blocks until the task with the given index has been executed.
+void thread_pool_wait(struct thread_pool*, size_t task_index);
+
+// Waits for all tasks to complete and destroys the pool.
+void thread_pool_destroy(struct thread_pool*);
@@ -1,6 +1,8 @@
 #include "token.h"
 
 #include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
 
 VEC_IMPL(token_vec, struct token, PUBLIC)
 SMALL_VEC_IMPL(small_token_vec, struct token, PUBLIC)
@@ -38,15 +40,32 @@ bool token_tag_is_keyword(enum token_tag tag) {
     }
 }
 
-struct str_view token_printable_contents(const struct token* token) {
-    if (token_tag_is_keyword(token->tag) ||
-        token_tag_is_symbol(token->tag) ||
-        token->tag == TOKEN_ERROR ||
-        token->tag == TOKEN_IDENT ||
-        token->tag == TOKEN_INT_LITERAL ||
-        token->tag == TOKEN_FLOAT_LITERAL ||
-        token->tag == TOKEN_STRING_LITERAL)
-        return token->contents;
-    const char* raw_str = token_tag_to_string(token->tag);
+struct str_view token_printable_contents(enum token_tag tag, struct str_view contents) {
+    if (token_tag_is_keyword(tag) ||
+        token_tag_is_symbol(tag) ||
+        tag == TOKEN_ERROR ||
+        tag == TOKEN_IDENT ||
+        tag == TOKEN_INT_LITERAL ||
+        tag == TOKEN_FLOAT_LITERAL ||
+        tag == TOKEN_STRING_LITERAL)
+        return contents;
+    const char* raw_str = token_tag_to_string(tag);
     return STR_VIEW(raw_str);
 }
+
+// Literals are parsed in place: they always come from null-terminated text, and parsing them stops at
+// or before the end of the literal, as delimited by the lexer.
+int_literal token_int_literal(struct str_view contents) {
+    if (contents.length > 2 && contents.data[0] == '0' && contents.data[1] == 'x')
+        return strtoumax(contents.data + 2, NULL, 16);
+    return strtoumax(contents.data, NULL, 10);
+}
+
+float_literal token_float_literal(struct str_view contents) {
+    return strtod(contents.data, NULL);
+}
+
+struct str_view token_string_literal(struct str_view contents) {
+    assert(contents.length >= 2);
+    return str_view_shrink(contents, 1, 1);
+}
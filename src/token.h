@@ -127,27 +127,39 @@ enum token_error {
     TOKEN_ERROR_UNTERMINATED_STRING
 };
 
+// Tokens are copied by value throughout the preprocessor and the parser, so they only store where
+// their text is: the index of the file it comes from, in a table owned by the preprocessor, and the
+// offset and length of the text in that file. Their contents and location are reconstructed from
+// there when needed (see `preprocessor_token_contents` and `preprocessor_token_loc`), and so are the
+// values of literals. Identifiers store the index of their interned spelling once the preprocessor
+// has looked at them, and 0 before that.
 struct token {
-    enum token_tag tag;
-    bool on_new_line;
-    bool has_space_before;
-    struct file_loc loc;
-    struct str_view contents;
+    uint8_t tag; // One of `enum token_tag`.
+    bool on_new_line : 1;
+    bool has_space_before : 1;
+    uint16_t file_id;
+    uint32_t offset;
+    uint32_t length;
     union {
-        int_literal int_literal;
-        float_literal float_literal;
+        uint32_t ident_index;
+        uint32_t macro_param_index;
         enum token_error error;
-        struct str_view string_literal;
-        size_t macro_param_index;
     };
 };
 
+static_assert(sizeof(struct token) == 16);
+
 VEC_DECL(token_vec, struct token, PUBLIC)
 SMALL_VEC_DECL(small_token_vec, struct token, 4, PUBLIC)
 
 [[nodiscard]] const char* token_tag_to_string(enum token_tag);
 [[nodiscard]] bool token_tag_is_symbol(enum token_tag);
 [[nodiscard]] bool token_tag_is_keyword(enum token_tag);
-[[nodiscard]] struct str_view token_printable_contents(const struct token*);
+[[nodiscard]] struct str_view token_printable_contents(enum token_tag, struct str_view contents);
+
+// Values of literals, parsed from the contents of the token.
+[[nodiscard]] int_literal token_int_literal(struct str_view contents);
+[[nodiscard]] float_literal token_float_literal(struct str_view contents);
+[[nodiscard]] struct str_view token_string_literal(struct str_view contents);
 
 [[nodiscard]] struct token token_concat(const struct token*, const struct token*);
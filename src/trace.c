@@ -0,0 +1,83 @@
+#include "trace.h"
+
+#include <overture/mem.h>
+#include <overture/str.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct trace {
+    size_t thread_index;
+    struct str events;
+};
+
+struct trace* trace_create(size_t thread_index) {
+    struct trace* trace = xcalloc(1, sizeof(struct trace));
+    trace->thread_index = thread_index;
+    trace->events = str_create();
+    return trace;
+}
+
+void trace_destroy(struct trace* trace) {
+    str_destroy(&trace->events);
+    free(trace);
+}
+
+static inline size_t track_id(size_t thread_index, enum trace_track track) {
+    return thread_index * 2 + (size_t)track;
+}
+
+static void append_json_string(struct str* str, const char* string) {
+    str_push(str, '"');
+    for (; *string; ++string) {
+        unsigned char c = *string;
+        if (c == '"' || c == '\\') {
+            str_push(str, '\\');
+            str_push(str, c);
+        } else if (c < 0x20) {
+            str_printf(str, "\\u%04x", c);
+        } else {
+            str_push(str, c);
+        }
+    }
+    str_push(str, '"');
+}
+
+void trace_add_event(
+    struct trace* trace,
+    enum trace_track track,
+    const char* category,
+    const char* name,
+    uint64_t begin_time,
+    uint64_t end_time)
+{
+    // Events are stored already formatted, each of them followed by a comma.
+    str_append(&trace->events, STR_VIEW("{\"name\":"));
+    append_json_string(&trace->events, name);
+    str_printf(&trace->events, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%zu},\n",
+        category,
+        (double)begin_time * 1.0e-3,
+        (double)(end_time - begin_time) * 1.0e-3,
+        track_id(trace->thread_index, track));
+}
+
+void trace_write(FILE* file, struct trace* const* traces, size_t trace_count) {
+    fputs("{\"traceEvents\":[\n", file);
+    size_t thread_count = 0;
+    for (size_t i = 0; i < trace_count; ++i) {
+        fwrite(traces[i]->events.data, 1, traces[i]->events.length, file);
+        if (traces[i]->thread_index >= thread_count)
+            thread_count = traces[i]->thread_index + 1;
+    }
+
+    // Name the tracks after the events, so that there is no trailing comma to deal with.
+    fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"noslc\"}}", file);
+    static const char* track_names[] = { "compiler", "preprocessor" };
+    for (size_t i = 0; i < thread_count; ++i) {
+        for (enum trace_track track = TRACE_TRACK_COMPILER; track <= TRACE_TRACK_PREPROCESSOR; ++track) {
+            fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s %zu\"}}",
+                track_id(i, track), track_names[track], i);
+        }
+    }
+    fputs("\n]}\n", file);
+}
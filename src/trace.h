@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Records events in the Chrome trace event format, which can be viewed with `chrome://tracing` or
+// Perfetto. Each compilation thread gets two tracks: one for the phases of the compiler, and one for
+// the files included by the preprocessor. Since the parser pulls tokens from the preprocessor, events
+// of the two tracks do not nest into each other.
+
+enum trace_track {
+    TRACE_TRACK_COMPILER,
+    TRACE_TRACK_PREPROCESSOR
+};
+
+struct trace;
+
+[[nodiscard]] struct trace* trace_create(size_t thread_index);
+void trace_destroy(struct trace*);
+
+// Adds an event that lasts from the given begin time to the given end time, as given by
+// `stats_time`. The name is copied, and may thus be freed after this call.
+void trace_add_event(
+    struct trace*,
+    enum trace_track,
+    const char* category,
+    const char* name,
+    uint64_t begin_time,
+    uint64_t end_time);
+
+// Writes the events of all the given traces as a JSON document.
+void trace_write(FILE*, struct trace* const* traces, size_t trace_count);
@@ -64,57 +64,60 @@ const char* shader_type_to_string(enum shader_type shader_type) {
     }
 }
 
-enum coercion_rank prim_type_coercion_rank(enum prim_type from, enum prim_type to) {
-    const enum coercion_rank coercion_rank_matrix[PRIM_TYPE_COUNT][PRIM_TYPE_COUNT] = {
+// This table is static, so that it is built by the compiler instead of being filled every time a rank
+// is requested.
+static const enum coercion_rank coercion_rank_matrix[PRIM_TYPE_COUNT][PRIM_TYPE_COUNT] = {
 #define x(name, ...) \
-        [PRIM_TYPE_##name][PRIM_TYPE_VOID] = COERCION_TO_VOID,
-        PRIM_TYPE_LIST_WITHOUT_VOID(x)
+    [PRIM_TYPE_##name][PRIM_TYPE_VOID] = COERCION_TO_VOID,
+    PRIM_TYPE_LIST_WITHOUT_VOID(x)
 #undef x
 
 #define x(name, ...) \
-        [PRIM_TYPE_##name][PRIM_TYPE_##name] = COERCION_EXACT,
-        PRIM_TYPE_LIST(x)
+    [PRIM_TYPE_##name][PRIM_TYPE_##name] = COERCION_EXACT,
+    PRIM_TYPE_LIST(x)
 #undef x
 
-        [PRIM_TYPE_BOOL  ][PRIM_TYPE_MATRIX] = COERCION_SCALAR_TO_MATRIX,
-        [PRIM_TYPE_INT   ][PRIM_TYPE_MATRIX] = COERCION_SCALAR_TO_MATRIX,
-        [PRIM_TYPE_FLOAT ][PRIM_TYPE_MATRIX] = COERCION_SCALAR_TO_MATRIX,
-        [PRIM_TYPE_BOOL  ][PRIM_TYPE_COLOR ] = COERCION_SCALAR_TO_COLOR,
-        [PRIM_TYPE_INT   ][PRIM_TYPE_COLOR ] = COERCION_SCALAR_TO_COLOR,
-        [PRIM_TYPE_FLOAT ][PRIM_TYPE_COLOR ] = COERCION_SCALAR_TO_COLOR,
-        [PRIM_TYPE_BOOL  ][PRIM_TYPE_VECTOR] = COERCION_SCALAR_TO_VECTOR,
-        [PRIM_TYPE_INT   ][PRIM_TYPE_VECTOR] = COERCION_SCALAR_TO_VECTOR,
-        [PRIM_TYPE_FLOAT ][PRIM_TYPE_VECTOR] = COERCION_SCALAR_TO_VECTOR,
-        [PRIM_TYPE_BOOL  ][PRIM_TYPE_POINT ] = COERCION_SCALAR_TO_POINT,
-        [PRIM_TYPE_INT   ][PRIM_TYPE_POINT ] = COERCION_SCALAR_TO_POINT,
-        [PRIM_TYPE_FLOAT ][PRIM_TYPE_POINT ] = COERCION_SCALAR_TO_POINT,
-        [PRIM_TYPE_BOOL  ][PRIM_TYPE_NORMAL] = COERCION_SCALAR_TO_NORMAL,
-        [PRIM_TYPE_INT   ][PRIM_TYPE_NORMAL] = COERCION_SCALAR_TO_NORMAL,
-        [PRIM_TYPE_FLOAT ][PRIM_TYPE_NORMAL] = COERCION_SCALAR_TO_NORMAL,
-        [PRIM_TYPE_COLOR ][PRIM_TYPE_VECTOR] = COERCION_COLOR_TO_VECTOR,
-        [PRIM_TYPE_COLOR ][PRIM_TYPE_POINT ] = COERCION_COLOR_TO_POINT,
-        [PRIM_TYPE_COLOR ][PRIM_TYPE_NORMAL] = COERCION_COLOR_TO_NORMAL,
-        [PRIM_TYPE_NORMAL][PRIM_TYPE_COLOR ] = COERCION_SPATIAL_TO_COLOR,
-        [PRIM_TYPE_POINT ][PRIM_TYPE_COLOR ] = COERCION_SPATIAL_TO_COLOR,
-        [PRIM_TYPE_VECTOR][PRIM_TYPE_COLOR ] = COERCION_SPATIAL_TO_COLOR,
-        [PRIM_TYPE_POINT ][PRIM_TYPE_VECTOR] = COERCION_SPATIAL_TO_VECTOR,
-        [PRIM_TYPE_NORMAL][PRIM_TYPE_VECTOR] = COERCION_SPATIAL_TO_VECTOR,
-        [PRIM_TYPE_VECTOR][PRIM_TYPE_NORMAL] = COERCION_SPATIAL_TO_NORMAL,
-        [PRIM_TYPE_POINT ][PRIM_TYPE_NORMAL] = COERCION_SPATIAL_TO_NORMAL,
-        [PRIM_TYPE_NORMAL][PRIM_TYPE_POINT ] = COERCION_SPATIAL_TO_POINT,
-        [PRIM_TYPE_VECTOR][PRIM_TYPE_POINT ] = COERCION_SPATIAL_TO_POINT,
-        [PRIM_TYPE_MATRIX][PRIM_TYPE_BOOL  ] = COERCION_MATRIX_TO_BOOL,
-        [PRIM_TYPE_NORMAL][PRIM_TYPE_BOOL  ] = COERCION_TRIPLE_TO_BOOL,
-        [PRIM_TYPE_POINT ][PRIM_TYPE_BOOL  ] = COERCION_TRIPLE_TO_BOOL,
-        [PRIM_TYPE_VECTOR][PRIM_TYPE_BOOL  ] = COERCION_TRIPLE_TO_BOOL,
-        [PRIM_TYPE_COLOR ][PRIM_TYPE_BOOL  ] = COERCION_TRIPLE_TO_BOOL,
-        [PRIM_TYPE_STRING][PRIM_TYPE_BOOL  ] = COERCION_STRING_TO_BOOL,
-        [PRIM_TYPE_FLOAT ][PRIM_TYPE_BOOL  ] = COERCION_SCALAR_TO_BOOL,
-        [PRIM_TYPE_INT   ][PRIM_TYPE_BOOL  ] = COERCION_SCALAR_TO_BOOL,
-        [PRIM_TYPE_INT   ][PRIM_TYPE_FLOAT ] = COERCION_TO_FLOAT,
-        [PRIM_TYPE_BOOL  ][PRIM_TYPE_FLOAT ] = COERCION_TO_FLOAT,
-        [PRIM_TYPE_BOOL  ][PRIM_TYPE_INT   ] = COERCION_TO_INT
-    };
+    [PRIM_TYPE_BOOL  ][PRIM_TYPE_MATRIX] = COERCION_SCALAR_TO_MATRIX,
+    [PRIM_TYPE_INT   ][PRIM_TYPE_MATRIX] = COERCION_SCALAR_TO_MATRIX,
+    [PRIM_TYPE_FLOAT ][PRIM_TYPE_MATRIX] = COERCION_SCALAR_TO_MATRIX,
+    [PRIM_TYPE_BOOL  ][PRIM_TYPE_COLOR ] = COERCION_SCALAR_TO_COLOR,
+    [PRIM_TYPE_INT   ][PRIM_TYPE_COLOR ] = COERCION_SCALAR_TO_COLOR,
+    [PRIM_TYPE_FLOAT ][PRIM_TYPE_COLOR ] = COERCION_SCALAR_TO_COLOR,
+    [PRIM_TYPE_BOOL  ][PRIM_TYPE_VECTOR] = COERCION_SCALAR_TO_VECTOR,
+    [PRIM_TYPE_INT   ][PRIM_TYPE_VECTOR] = COERCION_SCALAR_TO_VECTOR,
+    [PRIM_TYPE_FLOAT ][PRIM_TYPE_VECTOR] = COERCION_SCALAR_TO_VECTOR,
+    [PRIM_TYPE_BOOL  ][PRIM_TYPE_POINT ] = COERCION_SCALAR_TO_POINT,
+    [PRIM_TYPE_INT   ][PRIM_TYPE_POINT ] = COERCION_SCALAR_TO_POINT,
+    [PRIM_TYPE_FLOAT ][PRIM_TYPE_POINT ] = COERCION_SCALAR_TO_POINT,
+    [PRIM_TYPE_BOOL  ][PRIM_TYPE_NORMAL] = COERCION_SCALAR_TO_NORMAL,
+    [PRIM_TYPE_INT   ][PRIM_TYPE_NORMAL] = COERCION_SCALAR_TO_NORMAL,
+    [PRIM_TYPE_FLOAT ][PRIM_TYPE_NORMAL] = COERCION_SCALAR_TO_NORMAL,
+    [PRIM_TYPE_COLOR ][PRIM_TYPE_VECTOR] = COERCION_COLOR_TO_VECTOR,
+    [PRIM_TYPE_COLOR ][PRIM_TYPE_POINT ] = COERCION_COLOR_TO_POINT,
+    [PRIM_TYPE_COLOR ][PRIM_TYPE_NORMAL] = COERCION_COLOR_TO_NORMAL,
+    [PRIM_TYPE_NORMAL][PRIM_TYPE_COLOR ] = COERCION_SPATIAL_TO_COLOR,
+    [PRIM_TYPE_POINT ][PRIM_TYPE_COLOR ] = COERCION_SPATIAL_TO_COLOR,
+    [PRIM_TYPE_VECTOR][PRIM_TYPE_COLOR ] = COERCION_SPATIAL_TO_COLOR,
+    [PRIM_TYPE_POINT ][PRIM_TYPE_VECTOR] = COERCION_SPATIAL_TO_VECTOR,
+    [PRIM_TYPE_NORMAL][PRIM_TYPE_VECTOR] = COERCION_SPATIAL_TO_VECTOR,
+    [PRIM_TYPE_VECTOR][PRIM_TYPE_NORMAL] = COERCION_SPATIAL_TO_NORMAL,
+    [PRIM_TYPE_POINT ][PRIM_TYPE_NORMAL] = COERCION_SPATIAL_TO_NORMAL,
+    [PRIM_TYPE_NORMAL][PRIM_TYPE_POINT ] = COERCION_SPATIAL_TO_POINT,
+    [PRIM_TYPE_VECTOR][PRIM_TYPE_POINT ] = COERCION_SPATIAL_TO_POINT,
+    [PRIM_TYPE_MATRIX][PRIM_TYPE_BOOL  ] = COERCION_MATRIX_TO_BOOL,
+    [PRIM_TYPE_NORMAL][PRIM_TYPE_BOOL  ] = COERCION_TRIPLE_TO_BOOL,
+    [PRIM_TYPE_POINT ][PRIM_TYPE_BOOL  ] = COERCION_TRIPLE_TO_BOOL,
+    [PRIM_TYPE_VECTOR][PRIM_TYPE_BOOL  ] = COERCION_TRIPLE_TO_BOOL,
+    [PRIM_TYPE_COLOR ][PRIM_TYPE_BOOL  ] = COERCION_TRIPLE_TO_BOOL,
+    [PRIM_TYPE_STRING][PRIM_TYPE_BOOL  ] = COERCION_STRING_TO_BOOL,
+    [PRIM_TYPE_FLOAT ][PRIM_TYPE_BOOL  ] = COERCION_SCALAR_TO_BOOL,
+    [PRIM_TYPE_INT   ][PRIM_TYPE_BOOL  ] = COERCION_SCALAR_TO_BOOL,
+    [PRIM_TYPE_INT   ][PRIM_TYPE_FLOAT ] = COERCION_TO_FLOAT,
+    [PRIM_TYPE_BOOL  ][PRIM_TYPE_FLOAT ] = COERCION_TO_FLOAT,
+    [PRIM_TYPE_BOOL  ][PRIM_TYPE_INT   ] = COERCION_TO_INT
+};
+
+enum coercion_rank prim_type_coercion_rank(enum prim_type from, enum prim_type to) {
     return coercion_rank_matrix[from][to];
 }
 
@@ -148,6 +151,12 @@ enum coercion_rank type_coercion_rank(const struct type* from, const struct type
     if (from == to)
         return COERCION_EXACT;
 
+    if (from->tag == TYPE_PRIM && to->tag == TYPE_PRIM)
+        return coercion_rank_matrix[from->prim_type][to->prim_type];
+
+    // Ranks of other pairs are not cached: they take a few reads of the table above, which is cheaper
+    // than a lookup keyed by type ids. The checker memoizes overload resolutions, which request most
+    // ranks, so the same pair rarely comes back anyway.
     if (to->tag == TYPE_PRIM)
         return type_coercion_rank_to_prim_type(from, to->prim_type);
 
@@ -94,6 +94,7 @@ SET_DEFINE(type_set, const struct type*, hash_type, is_type_equal, PRIVATE)
 
 struct type_table {
     struct type_set types;
+    size_t type_count;
     struct mem_pool* mem_pool;
     struct str_pool* str_pool;
 };
@@ -101,11 +102,16 @@ struct type_table {
 struct type_table* type_table_create(struct mem_pool* mem_pool) {
     struct type_table* type_table = xmalloc(sizeof(struct type_table));
     type_table->types = type_set_create();
+    type_table->type_count = 0;
     type_table->mem_pool = mem_pool;
     type_table->str_pool = str_pool_create(mem_pool);
     return type_table;
 }
 
+size_t type_table_type_count(const struct type_table* type_table) {
+    return type_table->type_count;
+}
+
 void type_table_destroy(struct type_table* type_table) {
     str_pool_destroy(type_table->str_pool);
     type_set_destroy(&type_table->types);
@@ -115,6 +121,7 @@ void type_table_destroy(struct type_table* type_table) {
 static inline struct type* register_type(struct type_table* type_table, struct type* type) {
     [[maybe_unused]] bool was_inserted = type_set_insert(&type_table->types, (const struct type* const*)&type);
     assert(was_inserted);
+    type_table->type_count++;
     return type;
 }
 
@@ -8,6 +8,9 @@ struct mem_pool;
 [[nodiscard]] struct type_table* type_table_create(struct mem_pool*);
 void type_table_destroy(struct type_table*);
 
+// Returns the number of types interned in the table so far.
+[[nodiscard]] size_t type_table_type_count(const struct type_table*);
+
 [[nodiscard]] struct type* type_table_create_struct_type(struct type_table*, size_t param_count);
 void type_table_finalize_struct_type(struct type_table*, struct type*);
 